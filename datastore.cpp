@@ -1144,6 +1144,264 @@ void DataStoreNodeTemplate::subtract(W64*& p, W64*& psub) const {
   }
 }
 
+//
+// Add the raw data array padd into p, with the same type rules
+// as subtract(): strings in p are left as is.
+//
+void DataStoreNodeTemplate::accumulate(W64*& p, W64*& padd) const {
+  switch (type) {
+  case DS_NODE_TYPE_NULL: {
+    foreach (i, subnodes.length) {
+      subnodes[i]->accumulate(p, padd);
+    }
+    break;
+  }
+  case DS_NODE_TYPE_INT: {
+    foreach (i, count) p[i] += padd[i];
+    p += count;
+    padd += count;
+    break;
+  }
+  case DS_NODE_TYPE_FLOAT: {
+    foreach (i, count) ((double*)p)[i] += ((double*)padd)[i];
+    p += count;
+    padd += count;
+    break;
+  }
+  case DS_NODE_TYPE_STRING: {
+    assert(count == 1);
+    assert((limit % 8) == 0);
+    p += (limit / 8);
+    padd += (limit / 8);
+    break;
+  }
+  default:
+    assert(false);
+  }
+}
+
+//
+// Find a node by its depth first index
+//
+const DataStoreNodeTemplate* DataStoreNodeTemplate::node(W32& index) const {
+  if (!index) return this;
+  index--;
+
+  foreach (i, subnodes.length) {
+    const DataStoreNodeTemplate* t = subnodes[i]->node(index);
+    if (t) return t;
+  }
+
+  return null;
+}
+
+//
+// Parse the fixed part, name and labels of the binary template node
+// at p, without building a DataStoreNodeTemplate. Returns the start
+// of its first subnode, or null if the node overruns end.
+//
+static const byte* parse_template_node(const byte* p, const byte* end, const DataStoreNodeTemplateBase*& base, const char*& name, W16& namelen) {
+  if unlikely ((p + sizeof(DataStoreNodeTemplateBase) + sizeof(W16)) > end) return null;
+  base = (const DataStoreNodeTemplateBase*)p;
+  if unlikely ((base->magic != DataStoreNodeTemplateBase::MAGIC) | (base->length != sizeof(DataStoreNodeTemplateBase))) return null;
+  p += sizeof(DataStoreNodeTemplateBase);
+
+  namelen = *(const W16*)p;
+  p += sizeof(W16);
+  name = (const char*)p;
+  p += namelen;
+  if unlikely (p > end) return null;
+
+  if (base->labeled_histogram) {
+    foreach (i, base->count) {
+      if unlikely ((p + sizeof(W16)) > end) return null;
+      p += sizeof(W16) + *(const W16*)p;
+    }
+    if unlikely (p > end) return null;
+  }
+
+  return p;
+}
+
+//
+// Skip the binary template subtree at p, adding the size of its raw
+// data to size and its node count to nodes
+//
+static const byte* skip_template_node(const byte* p, const byte* end, W64& size, W32& nodes) {
+  const DataStoreNodeTemplateBase* base;
+  const char* name;
+  W16 namelen;
+
+  p = parse_template_node(p, end, base, name, namelen);
+  if unlikely (!p) return null;
+  nodes++;
+
+  switch (base->type) {
+  case DataStoreNodeTemplate::DS_NODE_TYPE_NULL:
+    foreach (i, base->subcount) {
+      p = skip_template_node(p, end, size, nodes);
+      if unlikely (!p) return null;
+    }
+    break;
+  case DataStoreNodeTemplate::DS_NODE_TYPE_INT:
+  case DataStoreNodeTemplate::DS_NODE_TYPE_FLOAT:
+    size += base->count * sizeof(W64); break;
+  case DataStoreNodeTemplate::DS_NODE_TYPE_STRING:
+    size += base->limit; break;
+  default:
+    return null;
+  }
+
+  return p;
+}
+
+//
+// Resolve path (e.g. "ooocore.commit.result.ok") against the binary
+// template at dst. The final component may name a histogram label.
+// Returns false if the path does not exist or the template is bad.
+//
+bool DataStorePath::compile(const void* dst, W64 dstsize, const char* path) {
+  reset();
+  if unlikely (!dst) return false;
+
+  const byte* p = (const byte*)dst;
+  const byte* end = p + dstsize;
+
+  const DataStoreNodeTemplateBase* base;
+  const char* name;
+  W16 namelen;
+
+  p = parse_template_node(p, end, base, name, namelen);
+  if unlikely (!p) return false;
+
+  if (path[0] == '/') path++;
+
+  char* pbase = strdup(path);
+  dynarray<char*> tokens;
+  tokens.tokenize(pbase, "/.");
+
+  bool found = true;
+
+  foreach (i, tokens.length) {
+    const char* token = tokens[i];
+    int tokenlen = strlen(token);
+    bool last = (i == (tokens.length-1));
+
+    if (base->labeled_histogram) {
+      // Labels are stored right after the name
+      found = false;
+      if (!last) break;
+      const byte* l = (const byte*)(name + namelen);
+      foreach (j, base->count) {
+        W16 n = *(const W16*)l;
+        if ((n == tokenlen) && (!memcmp(l + sizeof(W16), token, n))) {
+          offset += j * sizeof(W64);
+          size = sizeof(W64);
+          count = 1;
+          type = base->type;
+          label = 1;
+          found = true;
+          break;
+        }
+        l += sizeof(W16) + n;
+      }
+      break;
+    }
+
+    if (base->type != DataStoreNodeTemplate::DS_NODE_TYPE_NULL) { found = false; break; }
+
+    found = false;
+    W32 subcount = base->subcount;
+    W32 subnode = node + 1;
+
+    foreach (j, subcount) {
+      const DataStoreNodeTemplateBase* subbase;
+      const char* subname;
+      W16 subnamelen;
+
+      const byte* q = parse_template_node(p, end, subbase, subname, subnamelen);
+      if unlikely (!q) break;
+
+      if ((subnamelen == tokenlen) && (!memcmp(subname, token, subnamelen))) {
+        base = subbase;
+        name = subname;
+        namelen = subnamelen;
+        p = q;
+        node = subnode;
+        found = true;
+        break;
+      }
+
+      p = skip_template_node(p, end, offset, subnode);
+      if unlikely (!p) break;
+    }
+
+    if (!found) break;
+  }
+
+  free(pbase);
+
+  if unlikely (!found) { reset(); return false; }
+
+  if (!label) {
+    type = base->type;
+    count = base->count;
+    size = 0;
+    if (type == DataStoreNodeTemplate::DS_NODE_TYPE_NULL) {
+      // Size the whole subtree, starting from its (already parsed) subnodes
+      W32 subnodes = 0;
+      foreach (j, base->subcount) {
+        p = skip_template_node(p, end, size, subnodes);
+        if unlikely (!p) { reset(); return false; }
+      }
+    } else {
+      size = (type == DataStoreNodeTemplate::DS_NODE_TYPE_STRING) ? base->limit : (count * sizeof(W64));
+    }
+  }
+
+  compiled = 1;
+  return true;
+}
+
+//
+// List every int and float word as a named column
+//
+void DataStoreNodeTemplate::columns(dynarray<StatsColumn>& list, W64& word, const char* prefix) const {
+  stringbuf path;
+  if (prefix) {
+    if (*prefix) path << prefix, ".";
+    path << name;
+  }
+
+  switch (type) {
+  case DS_NODE_TYPE_NULL: {
+    foreach (i, subnodes.length) subnodes[i]->columns(list, word, path);
+    break;
+  }
+  case DS_NODE_TYPE_INT:
+  case DS_NODE_TYPE_FLOAT: {
+    foreach (i, count) {
+      StatsColumn col;
+      stringbuf colpath;
+      colpath << path;
+      if (labeled_histogram) colpath << ".", labels[i];
+      else if (count > 1) colpath << "[", i, "]";
+      col.path = strdup(colpath);
+      col.word = word++;
+      col.type = type;
+      list.push(col);
+    }
+    break;
+  }
+  case DS_NODE_TYPE_STRING: {
+    word += limit / 8;
+    break;
+  }
+  default:
+    assert(false);
+  }
+}
+
 //
 // StatsFileWriter
 //
@@ -1161,6 +1419,7 @@ void StatsFileWriter::open(const char* filename, const void* dst, size_t dstsize
   header.record_count = 0; // filled in later
   header.index_offset = 0; // filled in later
   header.index_count = 0; // filled in later
+  records_since_checkpoint = 0;
   os << header;
 
   os.seek(header.template_offset);
@@ -1180,32 +1439,137 @@ void StatsFileWriter::write(const void* record, const char* name) {
 
   os.write(record, header.record_size);
   header.record_count++;
+
+  records_since_checkpoint++;
+  if unlikely (checkpoint_interval && (records_since_checkpoint >= checkpoint_interval)) checkpoint();
+}
+
+//
+// Append a checkpoint marker and a footer without an index after the
+// last record, and point the header at them; the next record will
+// overwrite them.
+//
+void StatsFileWriter::checkpoint() {
+  if (!os.ok()) return;
+
+  W64 checkpoint_offset = os.where();
+  assert(checkpoint_offset == (header.record_offset + (header.record_count * header.record_size)));
+
+  StatsIndexCheckpoint marker;
+  marker.magic = StatsIndexCheckpoint::MAGIC;
+  marker.offset = checkpoint_offset;
+
+  StatsFileFooter footer;
+  footer.magic = StatsFileFooter::MAGIC;
+  footer.checkpoint_offset = checkpoint_offset;
+  footer.record_count = header.record_count;
+  footer.index_offset = checkpoint_offset + sizeof(StatsIndexCheckpoint);
+  footer.index_count = 0;
+  footer.sorted_offset = 0;
+  footer.sorted_count = 0;
+
+  os.write(&marker, sizeof(marker));
+  os.write(&footer, sizeof(footer));
+
+  // The header sees an empty index, where the footer starts:
+  StatsFileHeader h = header;
+  h.index_offset = footer.index_offset;
+  h.index_count = 0;
+  os.seek(0);
+  os << h;
+
+  os.seek(checkpoint_offset);
+  records_since_checkpoint = 0;
 }
 
+struct StatsIndexSortComparator {
+  int operator ()(const StatsIndexRecordLink* a, const StatsIndexRecordLink* b) const {
+    int r = strcmp(a->name, b->name);
+    if (r) return r;
+    return (a->uuid < b->uuid) ? -1 : (a->uuid > b->uuid) ? +1 : 0;
+  }
+};
+
+//
+// Append the full index after the last record and point the header
+// at it; the next record will overwrite it. A name used by several
+// snapshots resolves to the earliest one.
+//
 void StatsFileWriter::flush() {
   if (!os.ok()) return;
 
-  header.index_offset = os.where();
-  assert(header.index_offset == (header.record_offset + (header.record_count * header.record_size)));
+  W64 checkpoint_offset = os.where();
+  assert(checkpoint_offset == (header.record_offset + (header.record_count * header.record_size)));
+
+  dynarray<StatsIndexRecordLink*> links;
+  W64 listsize = 0;
 
   StatsIndexRecordLink* namelink = namelist;
-  int n = 0;
 
   while (namelink) {
-    os << namelink->uuid;
-    W16 namelen = strlen(namelink->name) + 1;
-    os << namelen;
-    os.write(namelink->name, namelen);
+    links.push(namelink);
+    listsize += sizeof(W64) + sizeof(W16) + strlen(namelink->name) + 1;
     namelink = (StatsIndexRecordLink*)namelink->next;
-    n++;
   }
 
-  assert(n == header.index_count);
+  assert(links.length == header.index_count);
+
+  W64 checkpoint_size = sizeof(StatsIndexCheckpoint) + listsize + (links.length * sizeof(StatsIndexEntry)) + sizeof(StatsFileFooter);
+  byte* checkpoint = new byte[checkpoint_size];
+  byte* p = checkpoint;
+
+  StatsIndexCheckpoint& marker = *(StatsIndexCheckpoint*)p;
+  marker.magic = StatsIndexCheckpoint::MAGIC;
+  marker.offset = checkpoint_offset;
+  p += sizeof(StatsIndexCheckpoint);
+
+  // Unsorted index, in the original format:
+  header.index_offset = checkpoint_offset + (p - checkpoint);
 
+  foreach (i, links.length) {
+    StatsIndexRecordLink* link = links[i];
+    link->nameoffset = checkpoint_offset + (p - checkpoint) + sizeof(W64);
+    *(W64*)p = link->uuid; p += sizeof(W64);
+    W16 namelen = strlen(link->name) + 1;
+    *(W16*)p = namelen; p += sizeof(W16);
+    memcpy(p, link->name, namelen); p += namelen;
+  }
+
+  // Sorted index, without duplicate names:
+  sort(links.data, links.length, StatsIndexSortComparator());
+
+  W64 sorted_offset = checkpoint_offset + (p - checkpoint);
+  W64 sorted_count = 0;
+
+  foreach (i, links.length) {
+    StatsIndexRecordLink* link = links[i];
+    if (i && strequal(link->name, links[i-1]->name)) continue;
+    StatsIndexEntry& entry = *(StatsIndexEntry*)p;
+    entry.uuid = link->uuid;
+    entry.name = link->nameoffset;
+    p += sizeof(StatsIndexEntry);
+    sorted_count++;
+  }
+
+  StatsFileFooter& footer = *(StatsFileFooter*)p;
+  footer.magic = StatsFileFooter::MAGIC;
+  footer.checkpoint_offset = checkpoint_offset;
+  footer.record_count = header.record_count;
+  footer.index_offset = header.index_offset;
+  footer.index_count = header.index_count;
+  footer.sorted_offset = sorted_offset;
+  footer.sorted_count = sorted_count;
+  p += sizeof(StatsFileFooter);
+
+  os.write(checkpoint, p - checkpoint);
+  delete[] checkpoint;
+
+  // Seeking pushes the checkpoint out before the header that points to it:
   os.seek(0);
   os << header;
 
-  os.seek(header.record_offset + (header.record_count * header.record_size));
+  os.seek(checkpoint_offset);
+  records_since_checkpoint = 0;
 }
 
 void StatsFileWriter::close() {
@@ -1232,29 +1596,58 @@ void StatsFileWriter::close() {
   os.close();
 }
 
+//
+// Drop the stream without writing the index or header. This is
+// used by a forked child whose parent still owns the file: the
+// parent must flush its buffers before forking, so closing our
+// copy of the descriptor writes nothing.
+//
+void StatsFileWriter::discard() {
+  if (!os.ok()) return;
+
+  StatsIndexRecordLink* namelink = namelist;
+
+  while (namelink) {
+    StatsIndexRecordLink* next = (StatsIndexRecordLink*)namelink->next;
+    namelink->unlink();
+    delete namelink->name;
+    delete namelink;
+    namelink = next;
+  }
+
+  namelist = null;
+  header.index_count = 0;
+
+  os.close();
+}
+
 //
 // StatsFileReader
 //
 
-bool StatsFileReader::open(const char* filename) {
+//
+// With quiet, errors are left for the caller to report (e.g. from
+// worker threads that must not share cerr).
+//
+bool StatsFileReader::open(const char* filename, bool quiet) {
   close();
   is.open(filename);
 
   if (!is) {
-    cerr << "StatsFileReader: cannot open ", filename, endl;
+    if (!quiet) cerr << "StatsFileReader: cannot open ", filename, endl;
     return false;
   }
 
   is >> header;
 
   if (!is) {
-    cerr << "StatsFileReader: error reading header", endl;
+    if (!quiet) cerr << "StatsFileReader: error reading header", endl;
     close();
     return false;
   }
 
   if (header.magic != StatsFileHeader::MAGIC) {
-    cerr << "StatsFileReader: header magic or version mismatch", endl;
+    if (!quiet) cerr << "StatsFileReader: header magic or version mismatch", endl;
     close();
     return false;
   }
@@ -1266,36 +1659,239 @@ bool StatsFileReader::open(const char* filename) {
   dst = new DataStoreNodeTemplate(is);
 
   if ((!is) | (!dst)) {
-    cerr << "StatsFileReader: error while reading and parsing template", endl;
+    if (!quiet) cerr << "StatsFileReader: error while reading and parsing template", endl;
+    close();
+    return false;
+  }
+
+  dstraw = new byte[header.template_size];
+  is.seek(header.template_offset);
+
+  if (is.read(dstraw, header.template_size) != header.template_size) {
+    if (!quiet) cerr << "StatsFileReader: error while reading template", endl;
     close();
     return false;
   }
 
   //
-  // Read in the index
+  // Use the last index checkpoint if it is still current, then
+  // an index from before checkpoints existed, and otherwise scan
+  // the records of a run that was killed between checkpoints.
   //
+  W64 filesize = is.size();
+
+  bool indexed = 0;
+
+  if (read_footer(filesize - sizeof(StatsFileFooter), filesize, indexed) ||
+      ((!header.index_count) && read_footer(header.index_offset, filesize, indexed))) {
+    if (indexed) return true;
+  } else if (read_index(filesize)) {
+    return true;
+  }
+
+  recover(filesize, filename, quiet);
+
+  return true;
+}
+
+//
+// Accept the footer at offset only if the checkpoint it describes
+// directly follows the last record and its marker has not been
+// overwritten by a later record. A full index ends the file, while
+// a periodic checkpoint (indexed = 0) is found through the header.
+//
+bool StatsFileReader::read_footer(W64 offset, W64 filesize, bool& indexed) {
+  StatsFileFooter footer;
+
+  if ((offset < (header.record_offset + sizeof(StatsIndexCheckpoint))) | ((offset + sizeof(StatsFileFooter)) > filesize)) return false;
+
+  is.seek(offset);
+  if (is.read(&footer, sizeof(footer)) != sizeof(footer)) return false;
+
+  if (footer.magic != StatsFileFooter::MAGIC) return false;
+  if (footer.checkpoint_offset != (header.record_offset + (footer.record_count * header.record_size))) return false;
+  if (footer.index_offset != (footer.checkpoint_offset + sizeof(StatsIndexCheckpoint))) return false;
+
+  indexed = (footer.sorted_offset != 0);
+
+  if (indexed) {
+    if ((footer.sorted_offset + (footer.sorted_count * sizeof(StatsIndexEntry))) != offset) return false;
+  } else {
+    if ((footer.index_count != 0) | (footer.index_offset != offset)) return false;
+  }
+
+  StatsIndexCheckpoint marker;
+  is.seek(footer.checkpoint_offset);
+  if (is.read(&marker, sizeof(marker)) != sizeof(marker)) return false;
+  if ((marker.magic != StatsIndexCheckpoint::MAGIC) | (marker.offset != footer.checkpoint_offset)) return false;
+
+  header.record_count = footer.record_count;
+  header.index_offset = footer.index_offset;
+  header.index_count = footer.index_count;
+  sorted_offset = footer.sorted_offset;
+  sorted_count = footer.sorted_count;
+
+  return true;
+}
+
+//
+// Read an index that ends the file, as written before checkpoints
+// were added, into name_to_uuid.
+//
+bool StatsFileReader::read_index(W64 filesize) {
+  if (header.index_offset != (header.record_offset + (header.record_count * header.record_size))) return false;
+  if (header.index_offset > filesize) return false;
+
   is.seek(header.index_offset);
+  W64 pos = header.index_offset;
 
   foreach (i, header.index_count) {
     W64 uuid = 0;
+    W16 namelen = 0;
     is >> uuid;
-    assert(is.ok());
-    W16 namelen;
     is >> namelen;
-    assert(is.ok());
+    pos += sizeof(W64) + sizeof(W16) + namelen;
+
+    if ((!is.ok()) | (uuid >= header.record_count) | (pos > filesize)) {
+      name_to_uuid.clear();
+      return false;
+    }
+
     if (namelen) {
       char* name = new char[namelen];
       is.read(name, namelen);
+      name[namelen-1] = 0;
       name_to_uuid.add(name, uuid);
       delete[] name;
     }
+  }
 
-    assert(is.ok());
+  if ((!is.ok()) | (pos != filesize)) {
+    name_to_uuid.clear();
+    return false;
   }
 
+  names_loaded = 1;
   return true;
 }
 
+//
+// Recover a file without a current index: records are valid while
+// their snapshot_uuid matches their position, and are named by
+// their snapshot_name. Templates without those fields keep only the
+// records up to the header's last checkpoint, without names.
+//
+void StatsFileReader::recover(W64 filesize, const char* filename, bool quiet) {
+  W64 maxcount = (filesize > header.record_offset) ? ((filesize - header.record_offset) / header.record_size) : 0;
+  W64 count = min(header.record_count, maxcount);
+
+  DataStorePath uuidpath;
+  DataStorePath namepath;
+
+  bool have_uuids = (compile(uuidpath, "snapshot_uuid") && (uuidpath.type == DataStoreNodeTemplate::DS_NODE_TYPE_INT) && (uuidpath.count == 1));
+  bool have_names = (compile(namepath, "snapshot_name") && (namepath.type == DataStoreNodeTemplate::DS_NODE_TYPE_STRING) && (namepath.size > 0));
+
+  if (have_uuids) {
+    while (count < maxcount) {
+      W64 uuid;
+      is.seek(header.record_offset + (count * header.record_size) + uuidpath.offset);
+      if ((is.read(&uuid, sizeof(uuid)) != sizeof(uuid)) || (uuid != count)) break;
+      count++;
+    }
+  }
+
+  header.record_count = count;
+  header.index_offset = 0;
+  header.index_count = 0;
+  names_loaded = 1;
+
+  if (have_names) {
+    char* name = new char[namepath.size + 1];
+
+    foreach (uuid, count) {
+      is.seek(header.record_offset + (uuid * header.record_size) + namepath.offset);
+      if (is.read(name, namepath.size) != namepath.size) break;
+      name[namepath.size] = 0;
+      if ((!name[0]) || name_to_uuid(name)) continue;
+      name_to_uuid.add(name, uuid);
+      header.index_count++;
+    }
+
+    delete[] name;
+  }
+
+  if (!quiet) {
+    cerr << "StatsFileReader: ", filename, " has no current index (the run may have been killed); recovered ",
+      count, " snapshots";
+    if (have_names) cerr << " and ", header.index_count, " names";
+    cerr << " by scanning", endl;
+  }
+}
+
+//
+// Load every name into name_to_uuid, for listing. Lookups by name
+// do not need this when the file has a sorted index.
+//
+bool StatsFileReader::load_names() {
+  if (names_loaded) return true;
+
+  is.seek(header.index_offset);
+
+  foreach (i, header.index_count) {
+    W64 uuid = 0;
+    W16 namelen = 0;
+    is >> uuid;
+    is >> namelen;
+    if (!is.ok()) return false;
+    if (namelen) {
+      char* name = new char[namelen];
+      is.read(name, namelen);
+      name[namelen-1] = 0;
+      name_to_uuid.add(name, uuid);
+      delete[] name;
+    }
+  }
+
+  names_loaded = 1;
+  return is.ok();
+}
+
+//
+// Binary search of the on-disk sorted index, reading O(log n) entries
+//
+W64s StatsFileReader::search_sorted_index(const char* name) {
+  W64s lower = 0;
+  W64s upper = W64s(sorted_count) - 1;
+  char* entryname = null;
+  W64s uuid = -1;
+
+  while (lower <= upper) {
+    W64s middle = (lower + upper) / 2;
+    StatsIndexEntry entry;
+    W16 namelen = 0;
+
+    is.seek(sorted_offset + (middle * sizeof(StatsIndexEntry)));
+    if (is.read(&entry, sizeof(entry)) != sizeof(entry)) break;
+    is.seek(entry.name);
+    is >> namelen;
+    if ((!is.ok()) | (!namelen)) break;
+
+    entryname = new char[namelen];
+    if (is.read(entryname, namelen) != namelen) break;
+    entryname[namelen-1] = 0;
+
+    int r = strcmp(name, entryname);
+    delete[] entryname;
+    entryname = null;
+
+    if (!r) { uuid = entry.uuid; break; }
+    if (r < 0) upper = middle - 1; else lower = middle + 1;
+  }
+
+  if (entryname) delete[] entryname;
+  return uuid;
+}
+
 DataStoreNode* StatsFileReader::get(W64 uuid) {
   if unlikely (uuid >= header.record_count) return null;
   W64 offset = header.record_offset + (header.record_size * uuid);
@@ -1333,6 +1929,101 @@ DataStoreNode* StatsFileReader::getdelta(W64 uuid, W64 uuidsub) {
   return dsn;
 }
 
+bool StatsFileReader::getraw(W64 uuid, void* record) {
+  if unlikely (uuid >= header.record_count) return false;
+  W64 offset = header.record_offset + (header.record_size * uuid);
+
+  is.seek(offset);
+  return (is.read(record, header.record_size) == header.record_size);
+}
+
+//
+// Raw record of snapshot name minus snapshot namesub (if any)
+//
+bool StatsFileReader::getrawdelta(const char* name, const char* namesub, void* record) {
+  W64s uuid = uuid_of_name(name);
+  if unlikely (uuid < 0) return false;
+  if unlikely (!getraw(uuid, record)) return false;
+  if (!namesub) return true;
+
+  W64s uuidsub = uuid_of_name(namesub);
+  if unlikely (uuidsub < 0) return false;
+  if unlikely (!getraw(uuidsub, bufsub)) return false;
+
+  W64* p = (W64*)record;
+  W64* psub = (W64*)bufsub;
+  dst->subtract(p, psub);
+
+  return true;
+}
+
+//
+// Subtree at path of record uuid (minus record uuidsub, if any):
+// only the bytes of that subtree are read and reconstructed. Paths
+// resolve as in DataStorePath::compile(), and a histogram label
+// gives a single int node. Paths the template cannot resolve, such
+// as [total], fall back to searching the full tree.
+//
+DataStoreNode* StatsFileReader::getpath(const char* path, W64 uuid, W64s uuidsub) {
+  if unlikely (uuid >= header.record_count) return null;
+  if unlikely ((uuidsub >= 0) && (uuidsub >= header.record_count)) return null;
+
+  DataStorePath dp;
+
+  if unlikely (!compile(dp, path)) {
+    DataStoreNode* root = (uuidsub >= 0) ? getdelta(uuid, uuidsub) : get(uuid);
+    if unlikely (!root) return null;
+
+    DataStoreNode* ds = root->searchpath(path);
+    if (ds && ds->dynamic) {
+      // Cached sums belong to their node:
+      ds = ds->clone();
+    } else if (ds && ds->parent) {
+      ds->parent->remove(ds->name);
+      ds->parent = null;
+    }
+
+    if (ds != root) delete root;
+    return ds;
+  }
+
+  const DataStoreNodeTemplate* t = null;
+
+  if (!dp.label) {
+    W32 index = dp.node;
+    t = dst->node(index);
+    if unlikely (!t) return null;
+  }
+
+  is.seek(header.record_offset + (header.record_size * uuid) + dp.offset);
+  if unlikely (is.read(buf, dp.size) != dp.size) return null;
+
+  if (uuidsub >= 0) {
+    is.seek(header.record_offset + (header.record_size * uuidsub) + dp.offset);
+    if unlikely (is.read(bufsub, dp.size) != dp.size) return null;
+  }
+
+  if (dp.label) {
+    const char* label = path;
+    for (const char* q = path; *q; q++) {
+      if ((*q == '/') | (*q == '.')) label = q + 1;
+    }
+
+    W64s value = *(W64s*)buf;
+    if (uuidsub >= 0) value -= *(W64s*)bufsub;
+    return new DataStoreNode(label, value);
+  }
+
+  if (uuidsub >= 0) {
+    W64* porig = (W64*)buf;
+    W64* psub = (W64*)bufsub;
+    t->subtract(porig, psub);
+  }
+
+  const W64* p = (const W64*)buf;
+  return t->reconstruct(p);
+}
+
 W64s StatsFileReader::uuid_of_name(const char* name) {
   bool all_nums = 1;
   W64 id = 0;
@@ -1345,6 +2036,8 @@ W64s StatsFileReader::uuid_of_name(const char* name) {
     return id;
   }
 
+  if (!names_loaded) return search_sorted_index(name);
+
   W64* uuidp = name_to_uuid(name);
   if unlikely (!uuidp) return -1;
 
@@ -1368,20 +2061,26 @@ DataStoreNode* StatsFileReader::getdelta(const char* name, const char* namesub)
 
 void StatsFileReader::close() {
   if (dst) { delete dst; dst = null; }
+  if (dstraw) { delete[] dstraw; dstraw = null; }
   if (buf) { delete[] buf; buf = null; }
   if (bufsub) { delete[] bufsub; bufsub = null; }
 
   name_to_uuid.clear();
+  sorted_offset = 0;
+  sorted_count = 0;
+  names_loaded = 0;
 
   if (is) is.close();
 }
 
-ostream& StatsFileReader::print(ostream& os) const {
+ostream& StatsFileReader::print(ostream& os) {
   if unlikely (!is.ok()) {
     os << "Data store is not open", endl;
     return os;
   }
 
+  load_names();
+
   char magic[9];
   *((W64*)&magic) = header.magic;
   magic[8] = 0;
@@ -1391,6 +2090,7 @@ ostream& StatsFileReader::print(ostream& os) const {
   os << "  Records at:   ", intstring(header.record_offset, 16), ", ", intstring(header.record_size, 16), " bytes", endl;
   os << "  Index at:     ", intstring(header.index_offset, 16), ", ", intstring(header.index_count, 16), " entries", endl;
   os << "  Record count: ", intstring(header.record_count, 16), " records", endl;
+  if (sorted_count) os << "  Sorted index: ", intstring(sorted_offset, 16), ", ", intstring(sorted_count, 16), " entries", endl;
   os << endl;
   os << "Index:", endl;
   os << name_to_uuid;
@@ -1398,3 +2098,346 @@ ostream& StatsFileReader::print(ostream& os) const {
 
   return os;
 }
+
+//
+// Merge stats files that share the same template, such as the
+// per-sample files written by parallel sampled simulation. The
+// delta between snapshots name and namesub in each input is
+// written to outfilename as a snapshot named after that input,
+// followed by the sum of all deltas as snapshot "final". Strings
+// in the sum are taken from the first input.
+//
+bool merge_stats_files(const char* outfilename, char** infilenames, int count, const char* name, const char* namesub) {
+  StatsFileReader reader;
+  StatsFileWriter writer;
+  byte* dstbuf = null;
+  byte* record = null;
+  byte* sum = null;
+  W64 template_size = 0;
+  W64 record_size = 0;
+  int merged = 0;
+
+  foreach (i, count) {
+    const char* filename = infilenames[i];
+
+    if (!reader.open(filename)) continue;
+
+    if (!dstbuf) {
+      template_size = reader.header.template_size;
+      record_size = reader.header.record_size;
+      dstbuf = new byte[template_size];
+      record = new byte[record_size];
+      sum = new byte[record_size];
+      reader.is.seek(reader.header.template_offset);
+      if (reader.is.read(dstbuf, template_size) != template_size) {
+        cerr << "merge_stats_files: cannot read template from ", filename, endl;
+        break;
+      }
+      writer.open(outfilename, dstbuf, template_size, record_size);
+      if (!writer) {
+        cerr << "merge_stats_files: cannot create ", outfilename, endl;
+        break;
+      }
+    } else if ((reader.header.template_size != template_size) | (reader.header.record_size != record_size)) {
+      cerr << "merge_stats_files: ", filename, " does not match the template of the other stats files; skipping", endl;
+      reader.close();
+      continue;
+    }
+
+    if (!reader.getrawdelta(name, namesub, record)) {
+      cerr << "merge_stats_files: ", filename, " has no snapshot '", name, "'";
+      if (namesub) cerr << " or '", namesub, "'";
+      cerr << "; skipping", endl;
+      reader.close();
+      continue;
+    }
+
+    writer.write(record, filename);
+
+    if (merged) {
+      W64* p = (W64*)sum;
+      W64* padd = (W64*)record;
+      reader.dst->accumulate(p, padd);
+    } else {
+      memcpy(sum, record, record_size);
+    }
+
+    merged++;
+    reader.close();
+  }
+
+  if (merged) writer.write(sum, "final");
+  writer.close();
+  reader.close();
+
+  delete[] dstbuf;
+  delete[] record;
+  delete[] sum;
+
+  return (merged > 0);
+}
+
+//
+// Columnar export
+//
+
+static inline int put_varint(byte* p, W64 v) {
+  int n = 0;
+  while (v >= 0x80) {
+    p[n++] = (v & 0x7f) | 0x80;
+    v >>= 7;
+  }
+  p[n++] = v;
+  return n;
+}
+
+//
+// Encode n words into out, which must have room for 10 bytes
+// per word; returns the length and sets the encoding used.
+//
+static int encode_stats_column(const W64* v, int n, bool isfloat, byte* out, byte& encoding) {
+  bool constant = 1;
+  foreach (i, n) constant &= (v[i] == v[0]);
+
+  if (constant) {
+    encoding = STATS_COLUMN_CONSTANT;
+    *(W64*)out = v[0];
+    return sizeof(W64);
+  }
+
+  int length = 0;
+  W64 prev = 0;
+
+  foreach (i, n) {
+    W64 d;
+    if (isfloat) {
+      d = v[i] ^ prev;
+    } else {
+      W64s delta = v[i] - prev;
+      d = (delta << 1) ^ (delta >> 63);
+    }
+    length += put_varint(out + length, d);
+    prev = v[i];
+  }
+
+  if (length < (n * sizeof(W64))) {
+    encoding = (isfloat) ? STATS_COLUMN_XOR : STATS_COLUMN_DELTA;
+    return length;
+  }
+
+  encoding = STATS_COLUMN_RAW;
+  memcpy(out, v, n * sizeof(W64));
+  return n * sizeof(W64);
+}
+
+struct StatsColumnWriter {
+  odstream& os;
+  int block_rows;
+  int column_count;
+  const StatsColumn* columns;
+  W64* data;    // column major: column c of row r is data[(c * block_rows) + r]
+  W64* keys;    // run id, uuid and name id columns, in the same layout
+  byte* encoded;
+  int rows;
+  dynarray<W64> block_offsets;
+
+  StatsColumnWriter(odstream& os_, int block_rows_, const StatsColumn* columns_, int column_count_): os(os_) {
+    block_rows = block_rows_;
+    column_count = column_count_;
+    columns = columns_;
+    data = new W64[block_rows * column_count];
+    keys = new W64[block_rows * 3];
+    encoded = new byte[block_rows * 10];
+    rows = 0;
+  }
+
+  ~StatsColumnWriter() {
+    delete[] data;
+    delete[] keys;
+    delete[] encoded;
+  }
+
+  void column(const W64* v, bool isfloat) {
+    byte encoding;
+    W32 length = encode_stats_column(v, rows, isfloat, encoded, encoding);
+    os << encoding << length;
+    os.write(encoded, length);
+  }
+
+  void flush() {
+    if (!rows) return;
+    block_offsets.push(os.where());
+    W32 n = rows;
+    os << n;
+    foreach (k, 3) column(keys + (k * block_rows), false);
+    foreach (c, column_count) column(data + (c * block_rows), (columns[c].type == DataStoreNodeTemplate::DS_NODE_TYPE_FLOAT));
+    rows = 0;
+  }
+};
+
+//
+// Export every snapshot of every input file with the same template
+// as the first readable one; see StatsColumnFileHeader for the format.
+//
+bool export_stats_columns(const char* outfilename, char** infilenames, int count, int block_rows) {
+  StatsFileReader reader;
+  odstream os;
+  StatsColumnFileHeader header;
+  StatsColumnWriter* writer = null;
+  dynarray<StatsColumn> columns;
+  byte* dstbuf = null;
+  byte* dstcmp = null;
+  W64* record = null;
+  W64 template_size = 0;
+  W64 record_size = 0;
+
+  dynarray<const char*> runs;
+  dynarray<char*> snapshot_names;
+  Hashtable<const char*, W64, 256> snapshot_name_to_id;
+
+  block_rows = max(block_rows, 1);
+  setzero(header);
+
+  foreach (i, count) {
+    const char* filename = infilenames[i];
+
+    if (!reader.open(filename)) continue;
+
+    if (!dstbuf) {
+      template_size = reader.header.template_size;
+      record_size = reader.header.record_size;
+      dstbuf = new byte[template_size];
+      dstcmp = new byte[template_size];
+      record = new W64[ceil(record_size, 8) / 8];
+      reader.is.seek(reader.header.template_offset);
+      if (reader.is.read(dstbuf, template_size) != template_size) {
+        cerr << "export_stats_columns: cannot read template from ", filename, endl;
+        break;
+      }
+
+      W64 word = 0;
+      reader.dst->columns(columns, word);
+
+      os.open(outfilename);
+      if (!os) {
+        cerr << "export_stats_columns: cannot create ", outfilename, endl;
+        break;
+      }
+
+      header.magic = StatsColumnFileHeader::MAGIC;
+      header.column_count = columns.length;
+      header.block_rows = block_rows;
+      os << header;
+
+      writer = new StatsColumnWriter(os, block_rows, columns.data, columns.length);
+    } else {
+      bool match = ((reader.header.template_size == template_size) & (reader.header.record_size == record_size));
+      if (match) {
+        reader.is.seek(reader.header.template_offset);
+        match = ((reader.is.read(dstcmp, template_size) == template_size) && (!memcmp(dstbuf, dstcmp, template_size)));
+      }
+      if (!match) {
+        cerr << "export_stats_columns: ", filename, " does not match the template of the other stats files; skipping", endl;
+        reader.close();
+        continue;
+      }
+    }
+
+    // Names by uuid:
+    reader.load_names();
+    dynarray<const char*> names;
+    names.resize(reader.header.record_count);
+    names.fill(null);
+    {
+      Hashtable<const char*, W64, 256>::Iterator iter(reader.name_to_uuid);
+      KeyValuePair<const char*, W64>* kvp;
+      while ((kvp = iter.next())) {
+        if (kvp->value < reader.header.record_count) names[kvp->value] = kvp->key;
+      }
+    }
+
+    W64 run = runs.length;
+    runs.push(strdup(filename));
+
+    foreach (uuid, reader.header.record_count) {
+      if (!reader.getraw(uuid, record)) {
+        cerr << "export_stats_columns: ", filename, " is truncated at snapshot ", uuid, endl;
+        break;
+      }
+
+      W64 nameid = 0;
+      if (names[uuid]) {
+        W64* id = snapshot_name_to_id(names[uuid]);
+        if (!id) {
+          char* name = strdup(names[uuid]);
+          snapshot_names.push(name);
+          snapshot_name_to_id.add(name, snapshot_names.length);
+          id = snapshot_name_to_id(name);
+        }
+        nameid = *id;
+      }
+
+      int r = writer->rows;
+      writer->keys[r] = run;
+      writer->keys[block_rows + r] = uuid;
+      writer->keys[(2 * block_rows) + r] = nameid;
+      foreach (c, columns.length) writer->data[(c * block_rows) + r] = record[columns[c].word];
+
+      writer->rows++;
+      header.row_count++;
+      if (writer->rows == block_rows) writer->flush();
+    }
+
+    reader.close();
+  }
+
+  bool ok = (writer && os.ok());
+
+  if (ok) {
+    writer->flush();
+
+    header.block_count = writer->block_offsets.length;
+    header.run_count = runs.length;
+    header.snapshot_name_count = snapshot_names.length;
+    header.schema_offset = os.where();
+
+    foreach (c, columns.length) {
+      W16 n = strlen(columns[c].path);
+      os << n;
+      os.write(columns[c].path, n);
+      os << columns[c].type;
+    }
+
+    foreach (i, runs.length) {
+      W16 n = strlen(runs[i]);
+      os << n;
+      os.write(runs[i], n);
+    }
+
+    foreach (i, snapshot_names.length) {
+      W16 n = strlen(snapshot_names[i]);
+      os << n;
+      os.write(snapshot_names[i], n);
+    }
+
+    foreach (i, writer->block_offsets.length) os << writer->block_offsets[i];
+
+    os.seek(0);
+    os << header;
+    os.flush();
+  }
+
+  if (os.ok()) os.close();
+  reader.close();
+
+  foreach (c, columns.length) free(columns[c].path);
+  foreach (i, runs.length) free((void*)runs[i]);
+  foreach (i, snapshot_names.length) free(snapshot_names[i]);
+
+  delete writer;
+  delete[] dstbuf;
+  delete[] dstcmp;
+  delete[] record;
+
+  return ok;
+}
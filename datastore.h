@@ -464,6 +464,13 @@ inline odstream& operator <<(odstream& os, const DataStoreNode& node) {
   return node.write(os);
 }
 
+// One int or float word of the raw data (see DataStoreNodeTemplate::columns()):
+struct StatsColumn {
+  char* path;
+  W32 word;   // index of the 64-bit word in the raw record
+  W16 type;   // DataStoreNodeTemplate::DS_NODE_TYPE_INT or DS_NODE_TYPE_FLOAT
+};
+
 //
 // Data store node templates provide a means for storing
 // and retrieving symbolic type information about an opaque
@@ -590,6 +597,65 @@ struct DataStoreNodeTemplate: public DataStoreNodeTemplateBase {
   // the raw data. Subtraction is only done on W64 and double types.
   //
   void subtract(W64*& p, W64*& psub) const;
+
+  //
+  // Add the raw data array padd into p, with the same type rules
+  // as subtract(): strings in p are left as is.
+  //
+  void accumulate(W64*& p, W64*& padd) const;
+
+  //
+  // The node index places after this one in depth first order
+  // (see DataStorePath::node), or null if there are fewer nodes.
+  //
+  const DataStoreNodeTemplate* node(W32& index) const;
+
+  //
+  // List every int and float word of the raw data as one column,
+  // named by its path: arrays become "path[i]" and labeled
+  // histograms "path.label". Strings are skipped.
+  //
+  void columns(dynarray<StatsColumn>& list, W64& word, const char* prefix = null) const;
+};
+
+//
+// A path compiled against the binary form of a template (as written
+// by DataStoreNodeTemplate::write()) into the offset, type and count
+// of its data, so values can be read straight from raw records, or
+// from the live stats structure inside the simulator, without
+// building any trees. A path may end in a histogram label.
+//
+struct DataStorePath {
+  W64 offset;   // byte offset of the data in a raw record
+  W64 size;     // bytes of raw data (for null nodes, the whole subtree)
+  W32 count;    // element count
+  W32 node;     // depth first index of the template node (0 = root)
+  W16 type;     // DataStoreNodeTemplate::NodeType
+  W16 compiled:1, label:1;
+
+  DataStorePath() { reset(); }
+  void reset() { offset = 0; size = 0; count = 0; node = 0; type = 0; compiled = 0; label = 0; }
+
+  bool compile(const void* dst, W64 dstsize, const char* path);
+
+  bool numeric() const {
+    return compiled && ((type == DataStoreNodeTemplate::DS_NODE_TYPE_INT) | (type == DataStoreNodeTemplate::DS_NODE_TYPE_FLOAT));
+  }
+
+  const W64* words(const void* record) const { return (const W64*)(((const byte*)record) + offset); }
+
+  W64s getint(const void* record, int i = 0) const { return (W64s)words(record)[i]; }
+
+  // Int or float element i as a double:
+  double get(const void* record, int i = 0) const {
+    const W64* p = words(record);
+    return (type == DataStoreNodeTemplate::DS_NODE_TYPE_FLOAT) ? ((const double*)p)[i] : (double)(W64s)p[i];
+  }
+
+  // Element i of record minus that of base:
+  double delta(const void* record, const void* base, int i = 0) const {
+    return (type == DataStoreNodeTemplate::DS_NODE_TYPE_FLOAT) ? (get(record, i) - get(base, i)) : (double)(getint(record, i) - getint(base, i));
+  }
 };
 
 static inline odstream& operator <<(odstream& os, const DataStoreNodeTemplate& node) {
@@ -613,9 +679,53 @@ struct StatsFileHeader {
   static const W64 MAGIC = 0x31307473644c5450ULL; // 'PTLdst01'
 };
 
+//
+// flush() appends the index after the last record as:
+//
+//   StatsIndexCheckpoint
+//   index_count unsorted (W64 uuid, W16 namelen, name) entries
+//   sorted_count StatsIndexEntry entries, sorted by name
+//   StatsFileFooter
+//
+// then the header is updated to point at it. The next record
+// overwrites the checkpoint marker first, so a reader finding the
+// footer can check it is still current without reading the index.
+//
+// Periodic checkpoints between flushes only append the marker and
+// a footer without an index (sorted_offset = 0), located through
+// the header, so their cost does not grow with the number of names.
+// They fix the record count of a killed run, whose names (and any
+// later records) the reader then recovers by scanning (see
+// StatsFileReader::recover()).
+//
+struct StatsIndexCheckpoint {
+  W64 magic;
+  W64 offset; // file offset of this checkpoint
+
+  static const W64 MAGIC = 0x3130706b634c5450ULL; // 'PTLckp01'
+};
+
+struct StatsIndexEntry {
+  W64 uuid;
+  W64 name; // file offset of (W16 namelen, name) in the unsorted index
+};
+
+struct StatsFileFooter {
+  W64 magic;
+  W64 checkpoint_offset;
+  W64 record_count;
+  W64 index_offset;
+  W64 index_count;
+  W64 sorted_offset;
+  W64 sorted_count;
+
+  static const W64 MAGIC = 0x31307864694c5450ULL; // 'PTLidx01'
+};
+
 struct StatsIndexRecordLink: public selflistlink {
   W64 uuid;
   char* name;
+  W64 nameoffset;
 
   StatsIndexRecordLink() { }
 
@@ -629,8 +739,10 @@ struct StatsFileWriter {
   odstream os;
   StatsFileHeader header;
   StatsIndexRecordLink* namelist;
+  W64 checkpoint_interval; // records between index checkpoints (0 = only on flush)
+  W64 records_since_checkpoint;
 
-  StatsFileWriter() { }
+  StatsFileWriter() { namelist = null; checkpoint_interval = 0; records_since_checkpoint = 0; }
 
   void open(const char* filename, const void* dst, size_t dstsize, int record_size);
 
@@ -638,8 +750,10 @@ struct StatsFileWriter {
   W64 next_uuid() const { return header.record_count; }
 
   void write(const void* record, const char* name = null);
-  void flush();
+  void checkpoint(); // record count only
+  void flush(); // full index
   void close();
+  void discard();
 };
 
 struct StatsFileReader {
@@ -648,14 +762,20 @@ struct StatsFileReader {
   byte* buf;
   byte* bufsub;
   DataStoreNodeTemplate* dst;
-  Hashtable<const char*, W64, 256> name_to_uuid;
+  byte* dstraw; // template in binary form, for DataStorePath::compile()
+  Hashtable<const char*, W64, 256> name_to_uuid; // complete only after load_names()
+  W64 sorted_offset;
+  W64 sorted_count;
+  bool names_loaded;
 
-  StatsFileReader() { dst = null; buf = null; bufsub = null; }
+  StatsFileReader() { dst = null; dstraw = null; buf = null; bufsub = null; sorted_offset = 0; sorted_count = 0; names_loaded = 0; }
 
-  bool open(const char* filename);
+  bool open(const char* filename, bool quiet = false);
 
   void close();
 
+  bool load_names();
+
   W64s uuid_of_name(const char* name);
 
   DataStoreNode* get(W64 uuid);
@@ -664,11 +784,65 @@ struct StatsFileReader {
   DataStoreNode* get(const char* name);
   DataStoreNode* getdelta(const char* name, const char* namesub);
 
-  ostream& print(ostream& os) const;
+  bool getraw(W64 uuid, void* record);
+  bool getrawdelta(const char* name, const char* namesub, void* record);
+
+  DataStoreNode* getpath(const char* path, W64 uuid, W64s uuidsub = -1);
+
+  bool compile(DataStorePath& path, const char* name) const { return path.compile(dstraw, header.template_size, name); }
+
+  ostream& print(ostream& os);
+
+protected:
+  bool read_footer(W64 offset, W64 filesize, bool& indexed);
+  bool read_index(W64 filesize);
+  void recover(W64 filesize, const char* filename, bool quiet);
+  W64s search_sorted_index(const char* name);
 };
 
-static inline ostream& print(ostream& os, const StatsFileReader& reader) {
+static inline ostream& print(ostream& os, StatsFileReader& reader) {
   return reader.print(os);
 }
 
+bool merge_stats_files(const char* outfilename, char** infilenames, int count, const char* name, const char* namesub = null);
+
+//
+// Columnar export of all snapshots in one or more stats files with
+// the same template, for loading into external analysis tools.
+//
+// The file starts with a StatsColumnFileHeader, followed by blocks of
+// up to block_rows snapshots. Each block holds a W32 row count, then
+// the run id (index of the input file), snapshot uuid and snapshot
+// name id (0 = unnamed, else name dictionary index + 1) columns, then
+// one column per StatsColumn. Every column is a byte encoding, a W32
+// length and the encoded data, where the encoding is whichever of the
+// StatsColumnEncoding types is smallest for that column in that block.
+//
+// The footer at schema_offset holds the column paths and types (each
+// a W16 length, the path and a W16 type), the run and snapshot name
+// dictionaries (each entry a W16 length and the name) and the W64
+// file offset of every block.
+//
+struct StatsColumnFileHeader {
+  W64 magic;
+  W64 column_count;
+  W64 row_count;
+  W64 block_rows;
+  W64 block_count;
+  W64 run_count;
+  W64 snapshot_name_count;
+  W64 schema_offset;
+
+  static const W64 MAGIC = 0x31306c6f434c5450ULL; // 'PTLCol01'
+};
+
+enum StatsColumnEncoding {
+  STATS_COLUMN_RAW,       // W64 per row
+  STATS_COLUMN_CONSTANT,  // one W64 for all rows
+  STATS_COLUMN_DELTA,     // zigzag varint difference from the previous row (ints)
+  STATS_COLUMN_XOR,       // varint XOR with the previous row's bits (floats)
+};
+
+bool export_stats_columns(const char* outfilename, char** infilenames, int count, int block_rows = 256);
+
 #endif // _DATASTORE_H_
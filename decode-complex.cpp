@@ -45,7 +45,7 @@ void assist_int(Context& ctx) {
   ctx.propagate_x86_exception(intid, 0);
 #else
   if (intid == 0x80) {
-    handle_syscall_32bit(SYSCALL_SEMANTICS_INT80);
+    handle_syscall_32bit(ctx, SYSCALL_SEMANTICS_INT80);
   } else {
     logfile << "Unknown int 0x", hexstring(intid, 8), "; aborting", endl, flush;
     assert(false);
@@ -77,10 +77,10 @@ void assist_syscall(Context& ctx) {
 #else
   if (ctx.use64) {
 #ifdef __x86_64__
-    handle_syscall_64bit();
+    handle_syscall_64bit(ctx);
 #endif
   } else {
-    handle_syscall_32bit(SYSCALL_SEMANTICS_SYSCALL);
+    handle_syscall_32bit(ctx, SYSCALL_SEMANTICS_SYSCALL);
   }
 #endif
   // REG_rip is filled out for us
@@ -108,7 +108,7 @@ void assist_sysenter(Context& ctx) {
   cerr << "assist_sysenter()", endl, flush;
   assert(false);
 #else
-  handle_syscall_32bit(SYSCALL_SEMANTICS_SYSENTER);
+  handle_syscall_32bit(ctx, SYSCALL_SEMANTICS_SYSENTER);
 #endif
   // REG_rip is filled out for us
 }
@@ -331,6 +331,7 @@ void assist_rdtsc(Context& ctx) {
   W64 tsc = ctx.base_tsc + sim_cycle; 
 #else
   W64 tsc = sim_cycle;
+  if unlikely (replay_log_mode) tsc = replay_log_rdtsc(tsc);
 #endif
   rax = LO32(tsc);
   rdx = HI32(tsc);
@@ -1250,6 +1251,12 @@ bool TraceDecoder::decode_complex() {
         */
         if (rep) assert(rep == PFX_REPZ); // only rep is allowed for movs and rep == repz here
 
+        if (rep) {
+          bb.reptype = REPTYPE_MOVS;
+          bb.repsizeshift = sizeshift;
+          bb.repaddrsizeshift = addrsizeshift;
+        }
+
         this << TransOp(OP_ld,     REG_temp0, REG_rsi,    REG_imm,  REG_zero,  sizeshift, 0);
         this << TransOp(OP_st,     REG_mem,   REG_rdi,    REG_imm,  REG_temp0, sizeshift, 0);
         this << TransOp(OP_add,    REG_rsi,   REG_rsi,    REG_imm,   REG_zero,  addrsizeshift, increment);
@@ -1320,6 +1327,11 @@ bool TraceDecoder::decode_complex() {
       case 0xaa: case 0xab: {
         // stos
         if (rep) assert(rep == PFX_REPZ); // only rep is allowed for movs and rep == repz here
+        if (rep) {
+          bb.reptype = REPTYPE_STOS;
+          bb.repsizeshift = sizeshift;
+          bb.repaddrsizeshift = addrsizeshift;
+        }
         this << TransOp(OP_st,   REG_mem,   REG_rdi,    REG_imm,  REG_rax, sizeshift, 0);
         this << TransOp(OP_add,  REG_rdi,   REG_rdi,    REG_imm,   REG_zero, addrsizeshift, increment);
         if (rep) {
@@ -34,6 +34,7 @@ BasicBlockPageCache bbpages;
 CycleTimer translate_timer("translate");
 
 odstream bbcache_dump_file;
+ostream invalid_opcode_dump_file;
 
 //
 // Calling convention:
@@ -90,6 +91,7 @@ const assist_func_t assistid_to_func[ASSIST_COUNT] = {
   assist_syscall,
   assist_hypercall,
   assist_ptlcall,
+  assist_vdso_time,
   assist_sysenter,
   assist_iret16,
   assist_iret32,
@@ -385,7 +387,16 @@ static const byte twobyte_uses_SSE_prefix[256] = {
 // This determines if the insn is handled by the
 // fast decoder or the complex microcode decoder.
 // The expanded x86 opcodes are from 0x000 to 0x1ff,
-// i.e. normal ones and those with the 0x0f prefix:
+// i.e. normal ones and those with the 0x0f prefix.
+//
+// This must exactly match the cases in decode_fast():
+// translate() uses it to dispatch directly to the
+// correct decoder, so opcodes marked '_' never visit
+// decode_fast() at all. The few opcodes marked '1'
+// that decode_fast() only handles in some forms
+// (e.g. 0xf6/0xf7 with modrm.reg >= 4, or bt with
+// a memory operand) still fall back to decode_complex()
+// before consuming any operand bytes.
 //
 static const byte insn_is_simple[512] = {
   /*       0 1 2 3 4 5 6 7 8 9 a b c d e f        */
@@ -398,16 +409,16 @@ static const byte insn_is_simple[512] = {
   /* 50 */ 1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, /* 5f */
   /* 60 */ _,_,_,1,_,_,_,_,1,1,1,1,_,_,_,_, /* 6f */
   /* 70 */ 1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, /* 7f */
-  /* 80 */ 1,1,1,1,1,1,_,_,1,1,1,1,_,1,_,1, /* 8f */
-  /* 90 */ 1,_,_,_,_,_,_,_,1,1,_,_,_,_,1,1, /* 9f */
+  /* 80 */ 1,1,1,1,1,1,_,_,1,1,1,1,_,1,_,_, /* 8f */
+  /* 90 */ 1,_,_,_,_,_,_,_,1,1,_,_,_,_,_,_, /* 9f */
   /* a0 */ 1,1,1,1,_,_,_,_,1,1,_,_,_,_,_,_, /* af */
   /* b0 */ 1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, /* bf */
   /* c0 */ 1,1,1,1,_,_,1,1,1,1,_,_,_,_,_,_, /* cf */
   /* d0 */ 1,1,1,1,_,_,_,_,_,_,_,_,_,_,_,_, /* df */
   /* e0 */ _,_,_,_,_,_,_,_,1,1,_,1,_,_,_,_, /* ef */
-  /* f0 */ _,_,_,_,_,1,1,1,1,1,_,_,0,0,1,1, /* ff */
-  /*100 */ _,_,_,_,_,_,_,_,_,_,_,_,_,1,_,_, /*10f */
-  /*110 */ _,_,_,_,_,_,_,_,1,_,_,_,_,_,_,_, /*11f */
+  /* f0 */ _,_,_,_,_,_,1,1,_,_,_,_,_,_,1,1, /* ff */
+  /*100 */ _,_,_,_,_,_,_,_,_,_,_,_,_,_,_,_, /*10f */
+  /*110 */ _,_,_,_,_,_,_,_,1,1,1,1,1,1,1,1, /*11f */
   /*120 */ _,_,_,_,_,_,_,_,_,_,_,_,_,_,_,_, /*12f */
   /*130 */ _,_,_,_,_,_,_,_,_,_,_,_,_,_,_,_, /*13f */
   /*140 */ 1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, /*14f */
@@ -421,7 +432,7 @@ static const byte insn_is_simple[512] = {
   /*1c0 */ _,_,_,_,_,_,_,_,1,1,1,1,1,1,1,1, /*1cf */
   /*1d0 */ _,_,_,_,_,_,_,_,_,_,_,_,_,_,_,_, /*1df */
   /*1e0 */ _,_,_,_,_,_,_,_,_,_,_,_,_,_,_,_, /*1ef */
-  /*1f0 */ _,_,_,_,_,_,_,_,_,_,_,_,_,_,_,_, /*1ff */
+  /*1f0 */ _,_,_,_,_,_,_,_,_,_,_,_,_,_,_,_  /*1ff */
   /*       -------------------------------        */
   /*       0 1 2 3 4 5 6 7 8 9 a b c d e f        */
 };
@@ -755,7 +766,7 @@ bool DecodedOperand::eform(TraceDecoder& state, int bytemode) {
   mem.riprel = 0;
   mem.size = 0;
 
-  const int mod_and_rexextbase_and_rm_to_basereg_x86_64[4][2][8] = {
+  static const int mod_and_rexextbase_and_rm_to_basereg_x86_64[4][2][8] = {
     {
       // mod = 00
       {APR_rax, APR_rcx, APR_rdx, APR_rbx, -1, APR_rip, APR_rsi, APR_rdi}, // rex.extbase = 0
@@ -775,7 +786,7 @@ bool DecodedOperand::eform(TraceDecoder& state, int bytemode) {
     }
   };
 
-  const int mod_and_rm_to_basereg_x86[4][8] = {
+  static const int mod_and_rm_to_basereg_x86[4][8] = {
     {APR_eax, APR_ecx, APR_edx, APR_ebx, -1, APR_zero, APR_esi, APR_edi},
     {APR_eax, APR_ecx, APR_edx, APR_ebx, -1, APR_ebp,  APR_esi, APR_edi},
     {APR_eax, APR_ecx, APR_edx, APR_ebx, -1, APR_ebp, APR_esi, APR_edi},
@@ -791,7 +802,7 @@ bool DecodedOperand::eform(TraceDecoder& state, int bytemode) {
     sib = SIBByte(state.fetch1());
   }
 
-  const byte mod_and_rm_to_immsize[4][8] = {
+  static const byte mod_and_rm_to_immsize[4][8] = {
     {0, 0, 0, 0, 0, 4, 0, 0},
     {1, 1, 1, 1, 1, 1, 1, 1},
     {4, 4, 4, 4, 4, 4, 4, 4},
@@ -804,14 +815,14 @@ bool DecodedOperand::eform(TraceDecoder& state, int bytemode) {
 
   if (mem.basereg < 0) {
     // Have sib
-    const int rexextbase_and_base_to_basereg[2][8] = {
+    static const int rexextbase_and_base_to_basereg[2][8] = {
       {APR_rax, APR_rcx, APR_rdx, APR_rbx, APR_rsp, -1, APR_rsi, APR_rdi}, // rex.extbase = 0
       {APR_r8,  APR_r9,  APR_r10, APR_r11, APR_r12, -1, APR_r14, APR_r15}, // rex.extbase = 1
     };
 
     mem.basereg = rexextbase_and_base_to_basereg[state.rex.extbase][sib.base];
     if (mem.basereg < 0) {
-      const int rexextbase_and_mod_to_basereg[2][4] = {
+      static const int rexextbase_and_mod_to_basereg[2][4] = {
         {APR_zero, APR_rbp, APR_rbp, -1}, // rex.extbase = 0
         {APR_zero, APR_r13, APR_r13, -1}, // rex.extbase = 1
       };
@@ -833,7 +844,7 @@ bool DecodedOperand::eform(TraceDecoder& state, int bytemode) {
       }
     }
 
-    const int rexextindex_and_index_to_indexreg[2][8] = {
+    static const int rexextindex_and_index_to_indexreg[2][8] = {
       {APR_rax, APR_rcx, APR_rdx, APR_rbx, APR_zero, APR_rbp, APR_rsi, APR_rdi}, // rex.extindex = 0
       {APR_r8,  APR_r9,  APR_r10, APR_r11, APR_r12,  APR_r13, APR_r14, APR_r15}, // rex.extindex = 1
     };
@@ -1381,6 +1392,21 @@ void print_invalid_insns(int op, const byte* ripstart, const byte* rip, int vali
   }
 }
 
+//
+// Record an opcode the decoder could not translate, along with
+// its rip and raw bytes, in the -invalid-opcode-dump file. The
+// file is plain text (one opcode per line), so dumps from many
+// runs can simply be concatenated and sorted.
+//
+void TraceDecoder::dump_invalid_opcode(ostream& os) {
+  int offset = ripstart - bb.rip;
+  int bytes = clipto(min(int(rip - ripstart), valid_byte_count - offset), 0, 15);
+
+  os << "rip ", (void*)(Waddr)ripstart, " op 0x", hexstring(op, 12), " bytes";
+  foreach (i, bytes) os << " ", hexstring(insnbytes[offset + i], 8);
+  os << endl;
+}
+
 void assist_invalid_opcode(Context& ctx) {
   ctx.commitarf[REG_rip] = ctx.commitarf[REG_selfrip];
   ctx.propagate_x86_exception(EXCEPTION_x86_invalid_opcode);
@@ -1389,6 +1415,8 @@ void assist_invalid_opcode(Context& ctx) {
 static const bool log_code_page_ops = 0;
 
 bool BasicBlockCache::invalidate(BasicBlock* bb, int reason) {
+  ScopedLock<RecursiveMutex> scope(lock);
+
   BasicBlockChunkList* pagelist;
   if unlikely (bb->refcount) {
     logfile << "Warning: basic block ", bb, " ", *bb, " is still in use somewhere (refcount ", bb->refcount, ")", endl;
@@ -1417,7 +1445,11 @@ bool BasicBlockCache::invalidate(BasicBlock* bb, int reason) {
   stats.decoder.bbcache.count = bbcache.count;
   stats.decoder.bbcache.invalidates[reason]++;
 
+  // Any superblock may now point to this block
+  generation++;
+
   bb->free();
+
   return true;
 }
 
@@ -1446,6 +1478,8 @@ int BasicBlockCache::get_page_bb_count(Waddr mfn) {
 // when we run out of memory (it may will allocate any memory).
 //
 bool BasicBlockCache::invalidate_page(Waddr mfn, int reason) {
+  ScopedLock<RecursiveMutex> scope(lock);
+
   //
   // We may try to invalidate the special invalid mfn if SMC
   // occurs on a page where the high virtual page is invalid. 
@@ -1490,6 +1524,8 @@ bool BasicBlockCache::invalidate_page(Waddr mfn, int reason) {
 // recently used BBs.
 //
 int BasicBlockCache::reclaim(size_t bytesreq, int urgency) {
+  ScopedLock<RecursiveMutex> scope(lock);
+
   bool DEBUG = 1; // logable(1);
 
   if (!count) return 0;
@@ -1608,6 +1644,8 @@ int BasicBlockCache::reclaim(size_t bytesreq, int urgency) {
 // references are allowed.
 //
 void BasicBlockCache::flush() {
+  ScopedLock<RecursiveMutex> scope(lock);
+
   bool DEBUG = 1;
 
   if (DEBUG) logfile << "Flushing basic block cache at ", sim_cycle, " cycles, ", total_user_insns_committed, " commits:", endl;
@@ -1734,6 +1772,10 @@ bool TraceDecoder::invalidate() {
     } else {
       switch (outcome) {
       case DECODE_OUTCOME_INVALID_OPCODE:
+#ifdef ENABLE_OPCODE_STATS
+        if unlikely (config.decoder_opcode_stats && (op < DECODER_OPCODE_COUNT)) stats.decoder.opcodes.invalid[op]++;
+#endif
+        if unlikely (invalid_opcode_dump_file) dump_invalid_opcode(invalid_opcode_dump_file);
         microcode_assist(ASSIST_INVALID_OPCODE, ripstart, rip);
         break;
       case DECODE_OUTCOME_GP_FAULT:
@@ -1917,13 +1959,33 @@ bool TraceDecoder::translate() {
     return false;
   }
 
+#ifndef PTLSIM_HYPERVISOR
+  //
+  // Emulated vDSO time function: the whole call, up to and
+  // including its ret, is a single assist.
+  //
+  if unlikely ((ripstart == bb.rip) && vdso_fast_path_entry(ripstart)) {
+    microcode_assist(ASSIST_VDSO_TIME, ripstart, rip);
+    user_insn_count++;
+    end_of_block = 1;
+    flush();
+    return false;
+  }
+#endif
+
+  bool iscomplex = 0;
+
   switch (op >> 8) {
   case 0:
   case 1: {
-    rc = decode_fast();
+    iscomplex = 1;
+
+    if likely (insn_is_simple[op]) {
+      rc = decode_fast();
+      // Try again with the complex decoder if needed
+      iscomplex = ((rc == 0) & (!invalid));
+    }
 
-    // Try again with the complex decoder if needed
-    bool iscomplex = ((rc == 0) & (!invalid));
     some_insns_complex |= iscomplex;
     if (iscomplex) rc = decode_complex();
 
@@ -1952,6 +2014,15 @@ bool TraceDecoder::translate() {
 
   if (!rc) return rc;
 
+#ifdef ENABLE_OPCODE_STATS
+  if unlikely (config.decoder_opcode_stats) {
+    stats.decoder.opcodes.insns[op]++;
+    stats.decoder.opcodes.complex_insns[op] += iscomplex;
+    stats.decoder.opcodes.assists[op] += used_microcode_assist;
+    stats.decoder.opcodes.uops[op] += transbufcount;
+  }
+#endif
+
   user_insn_count++;
 
   assert(!invalid);
@@ -1998,6 +2069,9 @@ ostream& printflags(ostream& os, W64 flags) {
   return os;
 }
 
+// Set while translate_ahead() is running, so its own translations do not recurse
+static bool translating_ahead = 0;
+
 //
 // Translate one basic block. This function always returns
 // a BasicBlock, except in the very rare case where one or
@@ -2023,6 +2097,9 @@ BasicBlock* BasicBlockCache::translate(Context& ctx, const RIPVirtPhys& rvp) {
   }
   */
 
+  ScopedLock<RecursiveMutex> scope(lock);
+
+  // Never translate a block twice, even if the caller looked it up without the lock
   BasicBlock* bb = get(rvp);
   if likely (bb) return bb;
 
@@ -2049,6 +2126,7 @@ BasicBlock* BasicBlockCache::translate(Context& ctx, const RIPVirtPhys& rvp) {
   trans.bb.hitcount = 0;
   trans.bb.predcount = 0;
   bb = trans.bb.clone();
+  bb->bind_synthops();
   //
   // Acquire a reference to the new basic block right away,
   // since we make allocations below that might reclaim it
@@ -2114,11 +2192,214 @@ BasicBlock* BasicBlockCache::translate(Context& ctx, const RIPVirtPhys& rvp) {
 
   translate_timer.stop();
 
+  //
+  // Keep our reference to the new block while translating ahead,
+  // since that may allocate memory and reclaim unreferenced blocks.
+  //
+  if unlikely (config.translate_ahead_blocks && (!translating_ahead)) {
+    translate_ahead(ctx, *bb, config.translate_ahead_blocks);
+  }
+
   bb->release();
 
   return bb;
 }
 
+//
+// Find the statically known successors of a basic block:
+// both directions of a conditional branch, the target of
+// a direct jump or call, and the return point of any call.
+// Indirect branches and assists have no known successors.
+//
+static int get_static_successors(const BasicBlock& bb, Waddr* targets) {
+  int n = 0;
+
+  switch (bb.type) {
+  case BB_TYPE_COND:
+    targets[n++] = bb.rip_taken;
+    targets[n++] = bb.rip_not_taken;
+    break;
+  case BB_TYPE_UNCOND:
+    targets[n++] = bb.rip_taken;
+    break;
+  default:
+    break;
+  }
+
+  if (bb.call) targets[n++] = bb.rip.rip + bb.bytes;
+
+  return n;
+}
+
+//
+// Translate ahead of execution: starting from a block that was
+// just translated on demand, walk the static control flow graph
+// breadth first and translate up to <limit> more blocks, so a
+// cold code region takes its translation misses in one batch
+// rather than one block at a time from the core's fetch loop.
+//
+// Blocks translated here go through the normal translate() path,
+// so they are entered on the page lists and invalidated by SMC
+// exactly like demand translated blocks. Targets on pages that
+// are not executable or are already dirty (pending invalidation)
+// are skipped, as are targets already in the cache.
+//
+// Returns the number of blocks translated.
+//
+int BasicBlockCache::translate_ahead(Context& ctx, const BasicBlock& startbb, int limit) {
+  Waddr queue[64];
+  int head = 0;
+  int tail = get_static_successors(startbb, queue);
+  int translated = 0;
+
+  translating_ahead = 1;
+
+  while ((head < tail) && (translated < limit)) {
+    RIPVirtPhys rvp(queue[head++]);
+    rvp.update(ctx);
+
+    if (get(rvp)) {
+      stats.decoder.translate_ahead.already_cached++;
+      continue;
+    }
+
+#ifdef PTLSIM_HYPERVISOR
+    bool executable = (rvp.mfnlo != RIPVirtPhys::INVALID);
+#else
+    bool executable = asp.fastcheck(rvp.rip, asp.execmap);
+#endif
+    if unlikely (!executable) {
+      stats.decoder.translate_ahead.invalid_page++;
+      continue;
+    }
+
+    if unlikely (smc_isdirty(rvp.mfnlo) | ((rvp.mfnhi != RIPVirtPhys::INVALID) && smc_isdirty(rvp.mfnhi))) {
+      stats.decoder.translate_ahead.dirty_page++;
+      continue;
+    }
+
+    BasicBlock* bb = translate(ctx, rvp);
+    if unlikely (!bb) continue;
+
+    translated++;
+    stats.decoder.translate_ahead.translated++;
+
+    if (logable(5) | log_code_page_ops) logfile << "Translated ahead ", rvp, " (", bb->bytes, " bytes) from ", startbb.rip, endl;
+
+    //
+    // Queue the new block's successors before translating anything
+    // else: bb has no references, so the next translate() may
+    // reclaim it.
+    //
+    if ((tail + 3) <= lengthof(queue)) tail += get_static_successors(*bb, queue + tail);
+  }
+
+  translating_ahead = 0;
+
+  return translated;
+}
+
+//
+// Superblock formation
+//
+// Every cached block counts how many times the sequential core
+// entered it (hitcount) and how many times its final branch went
+// to the taken target, or for indirect branches to the same target
+// as the previous time (predcount). Once a block is hot, the chain
+// of successors it reaches through edges followed at least 15/16
+// of the time is linked into a superblock, so the sequential core
+// can run the whole chain per dispatch, checking only that each
+// block actually exits to the next one (otherwise it leaves the
+// superblock through a side exit).
+//
+// Only blocks that are already cached and profiled are linked, so
+// nothing is translated or allocated while a superblock executes.
+// The chain stops at assists, rep blocks, weakly biased branches
+// and when it loops back into itself.
+//
+#define SUPERBLOCK_MIN_PROFILE 16
+
+static Waddr get_biased_successor(const BasicBlock& bb) {
+  if unlikely (bb.repblock | (bb.brtype == BRTYPE_BARRIER)) return 0;
+
+  W64 hits = bb.hitcount;
+  W64 taken = min(bb.predcount, bb.hitcount);
+  W64 slack = hits >> 4;
+
+  switch (bb.type) {
+  case BB_TYPE_UNCOND:
+    return bb.rip_taken;
+  case BB_TYPE_COND:
+    if unlikely (hits < SUPERBLOCK_MIN_PROFILE) return 0;
+    if (taken >= (hits - slack)) return bb.rip_taken;
+    if (taken <= slack) return bb.rip_not_taken;
+    return 0;
+  case BB_TYPE_INDIR:
+    if unlikely (hits < SUPERBLOCK_MIN_PROFILE) return 0;
+    return (taken >= (hits - slack)) ? bb.lasttarget : 0;
+  default:
+    return 0;
+  }
+}
+
+//
+// Return the superblock starting at bb, forming it first if it
+// does not exist yet, if any of its blocks may have been freed
+// since it was formed, or if it has been leaving through side
+// exits more than a quarter of the time (i.e. the profile it was
+// formed from has changed). A superblock of only one block means
+// bb has no biased successor.
+//
+SuperBlock* BasicBlockCache::get_superblock(Context& ctx, BasicBlock* bb) {
+  SuperBlock* sb = bb->superblock;
+
+  if likely (sb && (sb->generation == generation) && ((sb->hits < 64) || ((sb->side_exits << 2) <= sb->hits))) return sb;
+
+  ScopedLock<RecursiveMutex> scope(lock);
+
+  // Allocate first: this may reclaim blocks, but never bb itself
+  bb->acquire();
+  if (!sb) sb = new SuperBlock();
+  bb->release();
+
+  bb->superblock = sb;
+  sb->hits = 0;
+  sb->side_exits = 0;
+  sb->bbs[0] = bb;
+  sb->count = 1;
+  sb->user_insn_count = bb->user_insn_count;
+
+  BasicBlock* prev = bb;
+
+  while (sb->count < MAX_SUPERBLOCK_BBS) {
+    Waddr target = get_biased_successor(*prev);
+    if unlikely (!target) break;
+
+    RIPVirtPhys rvp(target);
+    rvp.update(ctx);
+
+    BasicBlock* next = get(rvp);
+    if unlikely ((!next) || (!next->hitcount)) break;
+
+    bool loop = 0;
+    foreach (i, sb->count) loop |= (sb->bbs[i] == next);
+    if unlikely (loop) break;
+
+    sb->bbs[sb->count++] = next;
+    sb->user_insn_count += next->user_insn_count;
+    prev = next;
+  }
+
+  sb->generation = generation;
+
+  stats.decoder.superblock.formed++;
+  stats.decoder.superblock.blocks += sb->count;
+
+  if (logable(5)) logfile << "Formed superblock at ", bb->rip, " with ", sb->count, " blocks, ", sb->user_insn_count, " insns", endl;
+
+  return sb;
+}
+
 #ifdef __x86_64__
 # define MAX_RIP 0xffffffffffffffffULL
 #else
@@ -2191,6 +2472,7 @@ BasicBlock* BasicBlockCache::translate_and_clone(Context& ctx, Waddr rip) {
   }
 
   BasicBlock* bb = trans.bb.clone();
+  bb->bind_synthops();
 
   return bb;
 }
@@ -2234,4 +2516,5 @@ void init_decode() {
 void shutdown_decode() {
   bbcache.flush();
   if (bbcache_dump_file) bbcache_dump_file.close();
+  if (invalid_opcode_dump_file) invalid_opcode_dump_file.close();
 }
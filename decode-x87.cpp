@@ -131,12 +131,70 @@ make_two_input_x87_func_with_pop(fyl2xp1, st1u.d = x87_fyl2xp1(st1u.d, st0u.d));
 // st(1) = arctan(st(1) / st(0))
 make_two_input_x87_func_with_pop(fpatan, st1u.d = x87_fpatan(st1u.d, st0u.d));
 
+//
+// Host x87 fast path for transcendentals
+//
+// The simulated x87 stack holds doubles, so fsin, fcos, fsincos,
+// fptan, f2xm1 and fscale can run the host's own x87 instruction
+// on the operand (under the guest's rounding and precision
+// control, with all exceptions masked) instead of evaluating
+// the much slower software math library.
+//
+// The fast path is only taken for finite operands inside the
+// architected input range of each instruction: outside it, the
+// host x87 leaves the operand unreduced (setting C2) or returns
+// an undefined result, so mathlib handles those operands. The
+// -x87-exact option forces mathlib for every operand, for runs
+// that must match results computed with the software library.
+//
+static const double X87_TRIG_INPUT_LIMIT = 9223372036854775808.0; // 2^63
+static const double X87_F2XM1_INPUT_LIMIT = 1.0;
+static const double X87_FSCALE_INPUT_LIMIT = 65536.0;
+
+static inline bool x87_use_host(double x, double limit) {
+  return (!config.x87_exact_math) & (math::fabs(x) < limit);
+}
+
+#define make_host_x87_unary_func(name, insn) \
+static double x87_host_##name(const Context& ctx, double x) { \
+  W16 oldfpcw = cpu_get_fpcw(); \
+  cpu_set_fpcw(ctx.fpcw | 0x3f); \
+  asm("fldl %[x]; " insn "; fstpl %[x];" : [x] "+m" (x)); \
+  cpu_set_fpcw(oldfpcw); \
+  return x; \
+}
+
+make_host_x87_unary_func(fsin, "fsin");
+make_host_x87_unary_func(fcos, "fcos");
+make_host_x87_unary_func(f2xm1, "f2xm1");
+// fptan pushes 1.0 above the result: discard it
+make_host_x87_unary_func(fptan, "fptan; fstp %%st(0)");
+
+// Returns sin(x) and sets c = cos(x)
+static double x87_host_fsincos(const Context& ctx, double x, double& c) {
+  W16 oldfpcw = cpu_get_fpcw();
+  cpu_set_fpcw(ctx.fpcw | 0x3f);
+  asm("fldl %[x]; fsincos; fstpl %[c]; fstpl %[x];" : [x] "+m" (x), [c] "=m" (c));
+  cpu_set_fpcw(oldfpcw);
+  return x;
+}
+
+static double x87_host_fscale(const Context& ctx, double st0, double st1) {
+  W16 oldfpcw = cpu_get_fpcw();
+  cpu_set_fpcw(ctx.fpcw | 0x3f);
+  asm("fldl %[st1]; fldl %[st0]; fscale; fstpl %[st0]; fstp %%st(0);" : [st0] "+m" (st0) : [st1] "m" (st1));
+  cpu_set_fpcw(oldfpcw);
+  return st0;
+}
+
 void assist_x87_fscale(Context& ctx) {
   W64& tos = ctx.commitarf[REG_fptos];
   W64& st0 = ctx.fpstack[tos >> 3];
   W64& st1 = ctx.fpstack[((tos >> 3) + 1) & 0x7];
   SSEType st0u(st0); SSEType st1u(st1);
-  st0u.d = st0u.d * math::exp2(math::trunc(st1u.d));
+  if (x87_use_host(st1u.d, X87_FSCALE_INPUT_LIMIT) & math::finite(st0u.d))
+    st0u.d = x87_host_fscale(ctx, st0u.d, st1u.d);
+  else st0u.d = st0u.d * math::exp2(math::trunc(st1u.d));
   st0 = st0u.w64;
   X87StatusWord* sw = (X87StatusWord*)&ctx.commitarf[REG_fpsw];
   sw->c1 = 0; sw->c2 = 0;
@@ -155,9 +213,9 @@ void assist_x87_##name(Context& ctx) { \
 }
 
 make_unary_x87_func(fsqrt, math::sqrt(ra.d));
-make_unary_x87_func(fsin, math::sin(ra.d));
-make_unary_x87_func(fcos, math::cos(ra.d));
-make_unary_x87_func(f2xm1, math::exp2(ra.d) - 1);
+make_unary_x87_func(fsin, (x87_use_host(ra.d, X87_TRIG_INPUT_LIMIT)) ? x87_host_fsin(ctx, ra.d) : math::sin(ra.d));
+make_unary_x87_func(fcos, (x87_use_host(ra.d, X87_TRIG_INPUT_LIMIT)) ? x87_host_fcos(ctx, ra.d) : math::cos(ra.d));
+make_unary_x87_func(f2xm1, (x87_use_host(ra.d, X87_F2XM1_INPUT_LIMIT)) ? x87_host_f2xm1(ctx, ra.d) : math::exp2(ra.d) - 1);
 
 void assist_x87_frndint(Context& ctx) {
   W64& r = ctx.fpstack[ctx.commitarf[REG_fptos] >> 3];
@@ -210,10 +268,12 @@ void assist_x87_##name(Context& ctx) { \
 }
 
 // st(0) = sin(st(0)) and push cos(orig st(0))
-make_two_output_x87_func_with_push(fsincos, (st1u.d = math::cos(st0u.d), st0u.d = math::sin(st0u.d)));
+make_two_output_x87_func_with_push(fsincos, ((x87_use_host(st0u.d, X87_TRIG_INPUT_LIMIT)) ?
+  (st0u.d = x87_host_fsincos(ctx, st0u.d, st1u.d)) :
+  (st1u.d = math::cos(st0u.d), st0u.d = math::sin(st0u.d))));
 
 // st(0) = tan(st(0)) and push value 1.0
-make_two_output_x87_func_with_push(fptan, (st1u.d = 1.0, st0u.d = math::tan(st0u.d)));
+make_two_output_x87_func_with_push(fptan, (st1u.d = 1.0, st0u.d = (x87_use_host(st0u.d, X87_TRIG_INPUT_LIMIT)) ? x87_host_fptan(ctx, st0u.d) : math::tan(st0u.d)));
 
 make_two_output_x87_func_with_push(fxtract, (st1u.d = math::significand(st0u.d), st0u.d = math::ilogb(st0u.d)));
 
@@ -223,6 +223,7 @@ struct TraceDecoder {
   inline W64 fetch8() { W64 r = *((W64*)&insnbytes[byteoffset]); rip += 8; byteoffset += 8; return r; }
 
   bool invalidate();
+  void dump_invalid_opcode(ostream& os);
   bool decode_fast();
   bool decode_complex();
   bool decode_sse();
@@ -253,6 +254,21 @@ enum {
   DECODE_TYPE_FAST, DECODE_TYPE_COMPLEX, DECODE_TYPE_X87, DECODE_TYPE_SSE, DECODE_TYPE_ASSIST, DECODE_TYPE_COUNT,
 };
 
+//
+// Opcode numbering used by the decoder (TraceDecoder::op):
+// 0x0xx one byte, 0x1xx two byte (0f xx), 0x2xx-0x5xx SSE
+// (0f xx with prefix f3, none, f2 or 66, respectively) and
+// 0x6xx x87 (escape d8-df and modrm.reg):
+//
+#define DECODER_OPCODE_COUNT 0x700
+
+//
+// The per-opcode profile (-opcode-stats, decodebench -opcodes) adds
+// five histograms of DECODER_OPCODE_COUNT words, around 70 KB, to
+// every stats snapshot, so it is only built in when enabled here:
+//
+//#define ENABLE_OPCODE_STATS
+
 #define DECODE(form, decbuf, mode) invalid |= (!decbuf.form(*this, mode));
 #define EndOfDecode() { \
   invalid |= ((rip - (Waddr)bb.rip) > valid_byte_count); \
@@ -312,6 +328,7 @@ enum {
   ASSIST_SYSCALL,
   ASSIST_HYPERCALL,
   ASSIST_PTLCALL,
+  ASSIST_VDSO_TIME,
   ASSIST_SYSENTER,
   ASSIST_IRET16,
   ASSIST_IRET32,
@@ -392,6 +409,7 @@ static const char* assist_names[ASSIST_COUNT] = {
   "syscall",
   "hypercall",
   "ptlcall",
+  "vdso_time",
   "sysenter",
   "iret16",
   "iret32",
@@ -464,6 +482,7 @@ void assist_int(Context& ctx);
 void assist_syscall(Context& ctx);
 void assist_hypercall(Context& ctx);
 void assist_ptlcall(Context& ctx);
+void assist_vdso_time(Context& ctx);
 void assist_sysenter(Context& ctx);
 void assist_iret16(Context& ctx);
 void assist_iret32(Context& ctx);
@@ -486,6 +505,11 @@ void assist_write_debug_reg(Context& ctx);
 void assist_ioport_in(Context& ctx);
 void assist_ioport_out(Context& ctx);
 
+#ifndef PTLSIM_HYPERVISOR
+// Entry points of the emulated vDSO time functions (see kernel.cpp):
+bool vdso_fast_path_entry(Waddr rip);
+#endif
+
 //
 // Global functions
 //
@@ -536,10 +560,29 @@ enum {
   INVALIDATE_REASON_COUNT
 };
 
+//
+// Concurrent access to the basic block cache
+//
+// Everything that touches the cache (lookups through get(), translate,
+// invalidate, reclaim and flush) is serialized by one recursive lock,
+// owned by a host thread, since allocations made inside translate()
+// may call back into reclaim(). Removed blocks are freed at once, so
+// a core must acquire() any block it keeps using after it drops the
+// lock (the out of order fetch unit), or hold the lock until it is
+// done with the block (the sequential core). invalidate() refuses to
+// free a block that still has references.
+//
 struct BasicBlockCache: public SelfHashtable<RIPVirtPhys, BasicBlock, BB_CACHE_SIZE, BasicBlockHashtableLinkManager> {
-  BasicBlockCache(): SelfHashtable<RIPVirtPhys, BasicBlock, BB_CACHE_SIZE, BasicBlockHashtableLinkManager>() { }
+  // Incremented whenever any block is freed (see SuperBlock)
+  W64 generation;
+
+  RecursiveMutex lock;
+
+  BasicBlockCache(): SelfHashtable<RIPVirtPhys, BasicBlock, BB_CACHE_SIZE, BasicBlockHashtableLinkManager>() { generation = 0; }
 
   BasicBlock* translate(Context& ctx, const RIPVirtPhys& rvp);
+  int translate_ahead(Context& ctx, const BasicBlock& startbb, int limit);
+  SuperBlock* get_superblock(Context& ctx, BasicBlock* bb);
   void translate_in_place(BasicBlock& targetbb, Context& ctx, Waddr rip);
   BasicBlock* translate_and_clone(Context& ctx, Waddr rip);
   bool invalidate(const RIPVirtPhys& rvp, int reason);
@@ -555,6 +598,7 @@ struct BasicBlockCache: public SelfHashtable<RIPVirtPhys, BasicBlock, BB_CACHE_S
 extern BasicBlockCache bbcache;
 
 extern odstream bbcache_dump_file;
+extern ostream invalid_opcode_dump_file;
 
 //
 // This part is used when parsing stats.h to build the
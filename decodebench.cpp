@@ -0,0 +1,367 @@
+//
+// PTLsim: Cycle Accurate x86-64 Simulator
+// Standalone Decoder Benchmark
+//
+// This tool links the x86 to uop decoders (decode-core, decode-fast,
+// decode-complex, decode-sse and decode-x87) against a minimal mock
+// of the PTLsim kernel interface, so the decoder can be timed and
+// regression tested in isolation without starting a simulation.
+//
+// The input is a raw instruction byte corpus, typically extracted
+// from a real binary with:
+//
+//   objcopy -O binary -j .text <binary> <binary>.text
+//
+// The corpus is decoded as a linear sweep of basic blocks: each new
+// block starts at the first byte not covered by the previous one.
+//
+// Alternatively the -random option synthesizes a corpus of random
+// bytes, which is useful for fuzzing the decoder for crashes and
+// assertion failures.
+//
+// After the timed passes, one untimed pass renders every basic block
+// in the standard BasicBlock listing format and prints a checksum of
+// the listing. Comparing the checksum (or the -dump file) between two
+// builds shows whether a decoder change altered the uops generated.
+//
+
+#include <globals.h>
+#include <superstl.h>
+#include <ptlsim.h>
+#include <decode.h>
+#include <stats.h>
+
+struct DecodeBenchConfig {
+  W64 base;
+  bool decode32;
+  W64 passes;
+  W64 random_bytes;
+  W64 random_seed;
+  stringbuf dump_filename;
+  stringbuf log_filename;
+  bool quiet;
+  W64 top_opcodes;
+
+  void reset();
+};
+
+void DecodeBenchConfig::reset() {
+  base = 0x400000;
+  decode32 = 0;
+  passes = 10;
+  random_bytes = 0;
+  random_seed = 123;
+  dump_filename.reset();
+  log_filename.reset();
+  quiet = 0;
+  top_opcodes = 0;
+}
+
+DecodeBenchConfig benchconfig;
+ConfigurationParser<DecodeBenchConfig> benchconfigparser;
+
+template <>
+void ConfigurationParser<DecodeBenchConfig>::setup() {
+  section("Corpus");
+  add(base,                             "base",                      "Virtual address of the first byte in the corpus");
+  add(decode32,                         "32bit",                     "Decode the corpus as 32-bit code instead of 64-bit code");
+  add(random_bytes,                     "random",                    "Ignore any corpus file and decode this many random bytes instead");
+  add(random_seed,                      "seed",                      "Random number generator seed for -random");
+
+  section("Benchmark");
+  add(passes,                           "passes",                    "Number of timed passes over the corpus");
+  add(quiet,                            "quiet",                     "Only print the summary line");
+  add(top_opcodes,                      "opcodes",                   "List the N most frequently decoded opcodes (needs ENABLE_OPCODE_STATS in decode.h)");
+
+  section("Output");
+  add(dump_filename,                    "dump",                      "Write the uops for every basic block to this file (for diffing)");
+  add(log_filename,                     "logfile",                   "Decoder log file (invalid opcodes, etc)");
+};
+
+//
+// Mock PTLsim kernel interface
+//
+// The decoders reference these globals and functions, but none of
+// them are ever called on the pure decode path: microcode assists
+// and page table walks only happen when uops actually execute.
+//
+
+PTLsimConfig config;
+PTLsimStats stats;
+ostream logfile;
+bool logenable = 0;
+W64 sim_cycle = 0;
+W64 iterations = 0;
+W64 total_user_insns_committed = 0;
+
+AddressSpace::AddressSpace() { }
+AddressSpace::~AddressSpace() { }
+
+byte& AddressSpace::pageid_to_map_byte(spat_t top, Waddr pageid) {
+  static byte dummy;
+  dummy = 0;
+  return dummy;
+}
+
+AddressSpace asp;
+
+void Context::propagate_x86_exception(byte exception, W32 errorcode, Waddr virtaddr) {
+  assert(false);
+}
+
+int Context::write_segreg(unsigned int segid, W16 selector) {
+  assert(false);
+  return 0;
+}
+
+int current_vcpuid() { return 0; }
+int current_lock_owner() { return 0; }
+
+void handle_syscall_32bit(Context& ctx, int semantics) { assert(false); }
+void handle_syscall_64bit(Context& ctx) { assert(false); }
+void assist_ptlcall(Context& ctx) { assert(false); }
+void assist_vdso_time(Context& ctx) { assert(false); }
+bool vdso_fast_path_entry(Waddr rip) { return false; }
+
+int replay_log_mode = 0;
+W64 replay_log_rdtsc(W64 tsc) { return tsc; }
+
+//
+// Basic blocks are only allocated by BasicBlock::clone() for the
+// cache, so the reclaim path (which needs the real allocator)
+// is never used here.
+//
+size_t ptl_mm_getsize(void* p) { return 0; }
+bool ptl_mm_register_reclaim_handler(mm_reclaim_handler_t handler) { return true; }
+
+static const char* decode_type_names[DECODE_TYPE_COUNT] = {
+  "fast", "complex", "x87", "sse", "assist"
+};
+
+//
+// Render a basic block in a compact, deterministic listing format:
+// only fields produced by the decoder itself are included.
+//
+stringbuf& print_bb_listing(stringbuf& sb, const BasicBlock& bb) {
+  sb << "bb ", (void*)(Waddr)bb.rip, ": ", bb.bytes, " bytes, ", bb.count, " uops, ", bb.user_insn_count, " insns, ",
+    "taken ", (void*)(Waddr)bb.rip_taken, ", not taken ", (void*)(Waddr)bb.rip_not_taken, endl;
+
+  foreach (i, bb.count) {
+    sb << "  ", bb.transops[i], endl;
+  }
+
+  return sb;
+}
+
+//
+// Decode the entire corpus as a linear sweep of basic blocks.
+// If crc is given, each block is rendered by print_bb_listing()
+// and added to the checksum (and written to os, if any).
+// Returns the number of basic blocks.
+//
+W64 decode_corpus(const byte* corpus, W64 size, Waddr base, bool use64, CRC32* crc = null, ostream* os = null) {
+  byte insnbuf[MAX_BB_BYTES + 16];
+  stringbuf sb;
+  W64 offset = 0;
+  W64 bbcount = 0;
+
+  while (offset < size) {
+    TraceDecoder trans(base + offset, use64, 0, 0);
+
+    //
+    // Equivalent to TraceDecoder::fillbuf(), except the bytes
+    // come from the corpus instead of the guest address space.
+    // The extra zero padding keeps the multi-byte fetchN()
+    // functions from reading past the end of the buffer.
+    //
+    int n = min(size - offset, (W64)MAX_BB_BYTES);
+    memcpy(insnbuf, corpus + offset, n);
+    memset(insnbuf + n, 0, sizeof(insnbuf) - n);
+
+    trans.insnbytes = insnbuf;
+    trans.insnbytes_bufsize = MAX_BB_BYTES;
+    trans.byteoffset = 0;
+    trans.faultaddr = 0;
+    trans.pfec = 0;
+    trans.invalid = 0;
+    trans.valid_byte_count = n;
+
+    for (;;) {
+      if (!trans.translate()) break;
+    }
+
+    if unlikely (crc) {
+      // Render one block at a time so the listing is never held in memory
+      sb.reset();
+      print_bb_listing(sb, trans.bb);
+      crc->update((byte*)(char*)sb, strlen(sb));
+      if (os) *os << sb;
+    }
+
+    // Always make forward progress, even on undecodable bytes
+    offset += max((int)trans.bb.bytes, 1);
+    bbcount++;
+  }
+
+  return bbcount;
+}
+
+//
+// List the most frequently decoded opcodes (-opcodes N), using
+// the per-opcode profile in stats.decoder.opcodes.
+//
+void print_top_opcodes(int n, W64 total) {
+#ifdef ENABLE_OPCODE_STATS
+  const W64* insns = stats.decoder.opcodes.insns;
+  bool listed[DECODER_OPCODE_COUNT];
+  setzero(listed);
+
+  cout << "Top opcodes:", endl;
+  cout << "  ", padstring("opcode", -8), padstring("insns", 16), padstring("%", 9), padstring("complex", 12), padstring("assists", 12), padstring("uops/insn", 11), endl;
+
+  foreach (i, n) {
+    int best = -1;
+    foreach (op, DECODER_OPCODE_COUNT) {
+      if ((!listed[op]) && insns[op] && ((best < 0) || (insns[op] > insns[best]))) best = op;
+    }
+    if (best < 0) break;
+    listed[best] = 1;
+
+    W64 c = insns[best];
+    cout << "  0x", hexstring(best, 12), "   ", intstring(c, 16), floatstring(percent(c, total), 8, 2), "%",
+      intstring(stats.decoder.opcodes.complex_insns[best], 12), intstring(stats.decoder.opcodes.assists[best], 12),
+      floatstring((double)stats.decoder.opcodes.uops[best] / (double)c, 11, 2), endl;
+  }
+#else
+  cout << "Top opcodes: not available (build with ENABLE_OPCODE_STATS in decode.h)", endl;
+#endif
+}
+
+void printbanner() {
+  cerr << "//  ", endl;
+  cerr << "//  decodebench: PTLsim x86 decoder benchmark and regression tool", endl;
+  cerr << "//  ", endl;
+  cerr << endl;
+}
+
+int main(int argc, char* argv[]) {
+  benchconfigparser.setup();
+  benchconfig.reset();
+
+  argc--; argv++;
+
+  int n = benchconfigparser.parse(benchconfig, argc, argv);
+
+  if ((n < 0) & (!benchconfig.random_bytes)) {
+    printbanner();
+    cerr << "Syntax is:", endl;
+    cerr << "  decodebench [-options] corpus.text", endl, endl;
+    benchconfigparser.printusage(cerr, benchconfig);
+    return 1;
+  }
+
+  if (benchconfig.log_filename.set()) {
+    logfile.open(benchconfig.log_filename);
+  }
+
+  byte* corpus;
+  W64 size;
+
+  if (benchconfig.random_bytes) {
+    size = benchconfig.random_bytes;
+    corpus = new byte[size];
+    RandomNumberGenerator random(benchconfig.random_seed);
+    random.fill(corpus, size);
+  } else {
+    char* filename = argv[n];
+    idstream is(filename);
+    if (!is) {
+      cerr << "decodebench: Cannot open '", filename, "'", endl, endl;
+      return 2;
+    }
+
+    size = is.size();
+    corpus = new byte[size];
+
+    if (is.read(corpus, size) != size) {
+      cerr << "decodebench: Cannot read ", size, " bytes from '", filename, "'", endl, endl;
+      return 2;
+    }
+  }
+
+  bool use64 = (!benchconfig.decode32);
+  config.decoder_opcode_stats = (benchconfig.top_opcodes > 0);
+
+  //
+  // Timed passes
+  //
+  setzero(stats);
+  CycleTimer timer("decode");
+  W64 bbcount = 0;
+
+  foreach (i, benchconfig.passes) {
+    timer.start();
+    bbcount += decode_corpus(corpus, size, benchconfig.base, use64);
+    timer.stop();
+  }
+
+  double seconds = ticks_to_seconds(timer.cycles());
+  W64 x86_insns = stats.decoder.throughput.x86_insns;
+  W64 uops = stats.decoder.throughput.uops;
+  W64 bytes = stats.decoder.throughput.bytes;
+  W64 total_decoded = 0;
+  foreach (i, DECODE_TYPE_COUNT) total_decoded += stats.decoder.x86_decode_type[i];
+
+  if (!benchconfig.quiet) {
+    cout << "Corpus:             ", size, " bytes at ", (void*)(Waddr)benchconfig.base, " (", ((use64) ? "64-bit" : "32-bit"), ")", endl;
+    cout << "Passes:             ", benchconfig.passes, endl;
+    cout << "Basic blocks:       ", bbcount, endl;
+    cout << "x86 insns:          ", x86_insns, endl;
+    cout << "Uops:               ", uops, endl;
+    cout << "Uops per insn:      ", floatstring((double)uops / (double)max(x86_insns, W64(1)), 0, 3), endl;
+    cout << "Bytes per insn:     ", floatstring((double)bytes / (double)max(x86_insns, W64(1)), 0, 3), endl;
+    cout << "Decode time:        ", floatstring(seconds, 0, 6), " seconds (", timer.cycles(), " cycles)", endl;
+    cout << "Cycles per insn:    ", floatstring((double)timer.cycles() / (double)max(x86_insns, W64(1)), 0, 1), endl;
+    cout << "x86 insns/second:   ", floatstring((double)x86_insns / seconds, 0, 0), endl;
+    cout << "Decode type split:", endl;
+    foreach (i, DECODE_TYPE_COUNT) {
+      W64 c = stats.decoder.x86_decode_type[i];
+      cout << "  ", padstring(decode_type_names[i], -16), intstring(c, 16), "  ",
+        floatstring(percent(c, total_decoded), 6, 2), "%", endl;
+    }
+    cout << "Basic block types:", endl;
+    cout << "  ", padstring("all fast", -16), intstring(stats.decoder.bb_decode_type.all_insns_fast, 16), endl;
+    cout << "  ", padstring("some complex", -16), intstring(stats.decoder.bb_decode_type.some_complex_insns, 16), endl;
+
+    if (benchconfig.top_opcodes) print_top_opcodes(benchconfig.top_opcodes, total_decoded);
+  }
+
+  //
+  // Untimed listing pass: compute a checksum of the uop listing
+  // for quick equivalence checks, and optionally dump it.
+  //
+  ostream* dumpos = null;
+  ostream dumpfile;
+
+  if (benchconfig.dump_filename.set()) {
+    dumpfile.open(benchconfig.dump_filename);
+    if (!dumpfile) {
+      cerr << "decodebench: Cannot open dump file '", benchconfig.dump_filename, "'", endl, endl;
+      return 2;
+    }
+    dumpos = &dumpfile;
+  }
+
+  CRC32 crc;
+  decode_corpus(corpus, size, benchconfig.base, use64, &crc, dumpos);
+
+  if (dumpos) dumpfile.close();
+
+  cout << "decodebench: ", bbcount, " basic blocks, ", x86_insns, " insns, ", uops, " uops in ",
+    floatstring(seconds, 0, 6), " sec = ", floatstring((double)x86_insns / seconds, 0, 0), " insns/sec; uop listing checksum ",
+    hexstring(crc.crc, 32), endl;
+
+  delete[] corpus;
+
+  return 0;
+}
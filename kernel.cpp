@@ -29,6 +29,15 @@
 // Userspace PTLsim only supports one VCPU:
 int current_vcpuid() { return 0; }
 
+// ...but PTLsim's own host threads must still exclude each other.
+// The tid is cached in our ThreadState rather than in a __thread
+// variable, since FS holds the user thread's TLS base, not ours:
+int current_lock_owner() {
+  ThreadState* tls = getcurrent();
+  if unlikely (!tls->tid) tls->tid = sys_gettid();
+  return tls->tid;
+}
+
 static inline W64 do_syscall_64bit(W64 syscallid, W64 arg1, W64 arg2, W64 arg3, W64 arg4, W64 arg5, W64 arg6) {
   W64 rc;
   asm volatile ("movq %5,%%r10\n"
@@ -165,6 +174,18 @@ void Context::update_shadow_segment_descriptors() {
   gs.limit = limit;
 }
 
+//
+// Syscall names, by number (declared in kernel.h). The Makefile
+// also copies these two tables into the stats template builder.
+//
+const char* syscall_names_64bit[SYSCALL_NAME_COUNT_64BIT] = {
+  "read", "write", "open", "close", "stat", "fstat", "lstat", "poll", "lseek", "mmap", "mprotect", "munmap", "brk", "rt_sigaction", "rt_sigprocmask", "rt_sigreturn", "ioctl", "pread64", "pwrite64", "readv", "writev", "access", "pipe", "select", "sched_yield", "mremap", "msync", "mincore", "madvise", "shmget", "shmat", "shmctl", "dup", "dup2", "pause", "nanosleep", "getitimer", "alarm", "setitimer", "getpid", "sendfile", "socket", "connect", "accept", "sendto", "recvfrom", "sendmsg", "recvmsg", "shutdown", "bind", "listen", "getsockname", "getpeername", "socketpair", "setsockopt", "getsockopt", "clone", "fork", "vfork", "execve", "exit", "wait4", "kill", "uname", "semget", "semop", "semctl", "shmdt", "msgget", "msgsnd", "msgrcv", "msgctl", "fcntl", "flock", "fsync", "fdatasync", "truncate", "ftruncate", "getdents", "getcwd", "chdir", "fchdir", "rename", "mkdir", "rmdir", "creat", "link", "unlink", "symlink", "readlink", "chmod", "fchmod", "chown", "fchown", "lchown", "umask", "gettimeofday", "getrlimit", "getrusage", "sysinfo", "times", "ptrace", "getuid", "syslog", "getgid", "setuid", "setgid", "geteuid", "getegid", "setpgid", "getppid", "getpgrp", "setsid", "setreuid", "setregid", "getgroups", "setgroups", "setresuid", "getresuid", "setresgid", "getresgid", "getpgid", "setfsuid", "setfsgid", "getsid", "capget", "capset", "rt_sigpending", "rt_sigtimedwait", "rt_sigqueueinfo", "rt_sigsuspend", "sigaltstack", "utime", "mknod", "uselib", "personality", "ustat", "statfs", "fstatfs", "sysfs", "getpriority", "setpriority", "sched_setparam", "sched_getparam", "sched_setscheduler", "sched_getscheduler", "sched_get_priority_max", "sched_get_priority_min", "sched_rr_get_interval", "mlock", "munlock", "mlockall", "munlockall", "vhangup", "modify_ldt", "pivot_root", "_sysctl", "prctl", "arch_prctl", "adjtimex", "setrlimit", "chroot", "sync", "acct", "settimeofday", "mount", "umount2", "swapon", "swapoff", "reboot", "sethostname", "setdomainname", "iopl", "ioperm", "create_module", "init_module", "delete_module", "get_kernel_syms", "query_module", "quotactl", "nfsservctl", "getpmsg", "putpmsg", "afs_syscall", "tuxcall", "security", "gettid", "readahead", "setxattr", "lsetxattr", "fsetxattr", "getxattr", "lgetxattr", "fgetxattr", "listxattr", "llistxattr", "flistxattr", "removexattr", "lremovexattr", "fremovexattr", "tkill", "time", "futex", "sched_setaffinity", "sched_getaffinity", "set_thread_area", "io_setup", "io_destroy", "io_getevents", "io_submit", "io_cancel", "get_thread_area", "lookup_dcookie", "epoll_create", "epoll_ctl_old", "epoll_wait_old", "remap_file_pages", "getdents64", "set_tid_address", "restart_syscall", "semtimedop", "fadvise64", "timer_create", "timer_settime", "timer_gettime", "timer_getoverrun", "timer_delete", "clock_settime", "clock_gettime", "clock_getres", "clock_nanosleep", "exit_group", "epoll_wait", "epoll_ctl", "tgkill", "utimes", "vserver", "vserver", "mbind", "set_mempolicy", "get_mempolicy", "mq_open", "mq_unlink", "mq_timedsend", "mq_timedreceive", "mq_notify", "mq_getsetattr", "kexec_load", "waitid"
+};
+
+const char* syscall_names_32bit[SYSCALL_NAME_COUNT_32BIT] = {
+  "restart_syscall", "exit", "fork", "read", "write", "open", "close", "waitpid", "creat", "link", "unlink", "execve", "chdir", "time", "mknod", "chmod", "lchown", "break", "oldstat", "lseek", "getpid", "mount", "umount", "setuid", "getuid", "stime", "ptrace", "alarm", "oldfstat", "pause", "utime", "stty", "gtty", "access", "nice", "ftime", "sync", "kill", "rename", "mkdir", "rmdir", "dup", "pipe", "times", "prof", "brk", "setgid", "getgid", "signal", "geteuid", "getegid", "acct", "umount2", "lock", "ioctl", "fcntl", "mpx", "setpgid", "ulimit", "oldolduname", "umask", "chroot", "ustat", "dup2", "getppid", "getpgrp", "setsid", "sigaction", "sgetmask", "ssetmask", "setreuid", "setregid", "sigsuspend", "sigpending", "sethostname", "setrlimit", "getrlimit", "getrusage", "gettimeofday", "settimeofday", "getgroups", "setgroups", "select", "symlink", "oldlstat", "readlink", "uselib", "swapon", "reboot", "readdir", "mmap", "munmap", "truncate", "ftruncate", "fchmod", "fchown", "getpriority", "setpriority", "profil", "statfs", "fstatfs", "ioperm", "socketcall", "syslog", "setitimer", "getitimer", "stat", "lstat", "fstat", "olduname", "iopl", "vhangup", "idle", "vm86old", "wait4", "swapoff", "sysinfo", "ipc", "fsync", "sigreturn", "clone", "setdomainname", "uname", "modify_ldt", "adjtimex", "mprotect", "sigprocmask", "create_module", "init_module", "delete_module", "get_kernel_syms", "quotactl", "getpgid", "fchdir", "bdflush", "sysfs", "personality", "afs_syscall", "setfsuid", "setfsgid", "_llseek", "getdents", "_newselect", "flock", "msync", "readv", "writev", "getsid", "fdatasync", "_sysctl", "mlock", "munlock", "mlockall", "munlockall", "sched_setparam", "sched_getparam", "sched_setscheduler", "sched_getscheduler", "sched_yield", "sched_get_priority_max", "sched_get_priority_min", "sched_rr_get_interval", "nanosleep", "mremap", "setresuid", "getresuid", "vm86", "query_module", "poll", "nfsservctl", "setresgid", "getresgid", "prctl", "rt_sigreturn", "rt_sigaction", "rt_sigprocmask", "rt_sigpending", "rt_sigtimedwait", "rt_sigqueueinfo", "rt_sigsuspend", "pread64", "pwrite64", "chown", "getcwd", "capget", "capset", "sigaltstack", "sendfile", "getpmsg", "putpmsg", "vfork", "ugetrlimit", "mmap2", "truncate64", "ftruncate64", "stat64", "lstat64", "fstat64", "lchown32", "getuid32", "getgid32", "geteuid32", "getegid32", "setreuid32", "setregid32", "getgroups32", "setgroups32", "fchown32", "setresuid32", "getresuid32", "setresgid32", "getresgid32", "chown32", "setuid32", "setgid32", "setfsuid32", "setfsgid32", "pivot_root", "mincore", "madvise", "madvise1", "getdents64", "fcntl64", "<unused>", "<unused>", "gettid", "readahead", "setxattr", "lsetxattr", "fsetxattr", "getxattr", "lgetxattr", "fgetxattr", "listxattr", "llistxattr", "flistxattr", "removexattr", "lremovexattr", "fremovexattr", "tkill", "sendfile64", "futex", "sched_setaffinity", "sched_getaffinity", "set_thread_area", "get_thread_area", "io_setup", "io_destroy", "io_getevents", "io_submit", "io_cancel", "fadvise64", "<unused>", "exit_group", "lookup_dcookie", "epoll_create", "epoll_ctl", "epoll_wait", "remap_file_pages", "set_tid_address", "timer_create", "statfs64", "fstatfs64", "tgkill", "utimes", "fadvise64_64", "vserver", "mbind", "get_mempolicy", "set_mempolicy", "mq_open", "sys_kexec_load", "waitid"
+};
+
 // Based on /usr/include/asm-i386/unistd.h:
 #define __NR_32bit_mmap 90
 #define __NR_32bit_mmap2 192
@@ -178,6 +199,18 @@ void Context::update_shadow_segment_descriptors() {
 #define __NR_32bit_set_thread_area 243
 #define __NR_32bit_rt_sigaction 174
 #define __NR_32bit_alarm 27
+#define __NR_32bit_clone 120
+#define __NR_32bit_futex 240
+#define __NR_32bit_gettid 224
+#define __NR_32bit_set_tid_address 258
+#define __NR_32bit_sched_yield 158
+#define __NR_32bit_nanosleep 162
+#define __NR_32bit_poll 168
+#define __NR_32bit_epoll_wait 256
+#define __NR_32bit_clock_nanosleep 267
+#define __NR_32bit_clock_gettime 265
+#define __NR_32bit_gettimeofday 78
+#define __NR_32bit_time 13
 
 #define __NR_64bit_mmap 9
 #define __NR_64bit_munmap 11
@@ -189,6 +222,33 @@ void Context::update_shadow_segment_descriptors() {
 #define __NR_64bit_exit_group 231
 #define __NR_64bit_rt_sigaction 13
 #define __NR_64bit_alarm 37
+#define __NR_64bit_clone 56
+#define __NR_64bit_futex 202
+#define __NR_64bit_gettid 186
+#define __NR_64bit_set_tid_address 218
+#define __NR_64bit_sched_yield 24
+#define __NR_64bit_nanosleep 35
+#define __NR_64bit_poll 7
+#define __NR_64bit_epoll_wait 232
+#define __NR_64bit_clock_nanosleep 230
+#define __NR_64bit_clock_gettime 228
+#define __NR_64bit_gettimeofday 96
+#define __NR_64bit_time 201
+
+#ifndef CLOCK_REALTIME
+#define CLOCK_REALTIME 0
+#define CLOCK_MONOTONIC 1
+#endif
+#ifndef CLOCK_MONOTONIC_RAW
+#define CLOCK_MONOTONIC_RAW 4
+#endif
+#ifndef CLOCK_REALTIME_COARSE
+#define CLOCK_REALTIME_COARSE 5
+#define CLOCK_MONOTONIC_COARSE 6
+#endif
+#ifndef CLOCK_BOOTTIME
+#define CLOCK_BOOTTIME 7
+#endif
 
 void early_printk(const char* text) {
   sys_write(2, text, strlen(text));
@@ -220,6 +280,49 @@ extern "C" void assert_fail(const char *__assertion, const char *__file, unsigne
   abort();
 }
 
+/*
+ * Memory map query support
+ *
+ * The prot field supports the same PROT_READ, PROT_WRITE, PROT_EXEC bits
+ * used in the mmap() system call.
+ *
+ * The flags field may have the following standard mmap()-style bits set:
+ *
+ * MAP_SHARED       Shared (writes to map update the file)
+ * MAP_PRIVATE      Private copy on write
+ * MAP_ANONYMOUS    Anonymous (no file) mapping
+ * MAP_GROWSDOWN    Stack
+ *
+ * Additionally, these additional bits may be present:
+ *
+ * MAP_ZERO         Inheritable shared memory on /dev/zero
+ * MAP_HEAP         Heap terminated by brk
+ * MAP_VDSO         VDSO (vsyscall) gateway page
+ * MAP_KERNEL       special mapping reserved by kernel
+ *
+ */
+
+#undef  MAP_STACK
+#define MAP_STACK   MAP_GROWSDOWN
+#define MAP_ZERO    0x01000000
+#define MAP_HEAP    0x02000000
+#define MAP_VDSO    0x04000000
+
+struct MemoryMapExtent {
+  void* start;
+  unsigned long length;
+  unsigned int prot;
+  unsigned int flags;
+  unsigned long long offset;
+  unsigned long long inode;
+  unsigned short devmajor;
+  unsigned short devminor;
+};
+
+int mqueryall(MemoryMapExtent* startmap, size_t count);
+
+ostream& operator <<(ostream& os, const MemoryMapExtent& map);
+
 //
 // Shadow page accessibility table format (x86-64 only): 
 // Top level:  1048576 bytes: 131072 64-bit pointers to chunks
@@ -230,6 +333,10 @@ extern "C" void assert_fail(const char *__assertion, const char *__file, unsigne
 //
 // In 32-bit version, SPAT is a flat 131072-byte bit vector.
 //
+// The attribute map has the same two-level layout, but with one byte
+// of PROT_READ|PROT_WRITE|PROT_EXEC bits per page (512 KB per chunk,
+// or a flat 1 MB array in the 32-bit version).
+//
 
 byte& AddressSpace::pageid_to_map_byte(spat_t top, Waddr pageid) {
 #ifdef __x86_64__
@@ -247,6 +354,75 @@ byte& AddressSpace::pageid_to_map_byte(spat_t top, Waddr pageid) {
 #endif
 }
 
+//
+// Set or clear the bits for pages [first, end) of one bitmap: the
+// partial bytes at either end go bit by bit, everything in between
+// is a single memset.
+//
+static void update_bitmap_range(byte* map, Waddr first, Waddr end, bool set) {
+  while ((first < end) && lowbits(first, 3)) {
+    if (set) setbit(map[first >> 3], lowbits(first, 3)); else clearbit(map[first >> 3], lowbits(first, 3));
+    first++;
+  }
+
+  Waddr bytes = (end - first) >> 3;
+  if (bytes) {
+    memset(map + (first >> 3), (set) ? 0xff : 0x00, bytes);
+    first += (bytes << 3);
+  }
+
+  while (first < end) {
+    if (set) setbit(map[first >> 3], lowbits(first, 3)); else clearbit(map[first >> 3], lowbits(first, 3));
+    first++;
+  }
+}
+
+//
+// Range updates work a chunk at a time. Clearing never allocates
+// a chunk, since an unallocated chunk already reads as all zeros.
+//
+void AddressSpace::update_range(spat_t top, Waddr firstpage, Waddr lastpage, bool set) {
+#ifdef __x86_64__
+  Waddr page = firstpage;
+  while (page <= lastpage) {
+    W64 chunkid = page >> log2(SPAT_PAGES_PER_CHUNK);
+    Waddr first = lowbits(page, log2(SPAT_PAGES_PER_CHUNK));
+    Waddr end = min(lastpage - (page - first) + 1, (Waddr)SPAT_PAGES_PER_CHUNK);
+
+    if (top[chunkid]) {
+      update_bitmap_range(*top[chunkid], first, end, set);
+    } else if (set) {
+      top[chunkid] = (SPATChunk*)ptl_mm_alloc_private_pages(SPAT_BYTES_PER_CHUNK);
+      update_bitmap_range(*top[chunkid], first, end, set);
+    }
+
+    page += (end - first);
+  }
+#else
+  update_bitmap_range(top, firstpage, lastpage + 1, set);
+#endif
+}
+
+void AddressSpace::update_attr_range(Waddr firstpage, Waddr lastpage, int prot) {
+#ifdef __x86_64__
+  Waddr page = firstpage;
+  while (page <= lastpage) {
+    W64 chunkid = page >> log2(SPAT_PAGES_PER_CHUNK);
+    Waddr first = lowbits(page, log2(SPAT_PAGES_PER_CHUNK));
+    Waddr end = min(lastpage - (page - first) + 1, (Waddr)SPAT_PAGES_PER_CHUNK);
+
+    if ((!attrmap[chunkid]) && prot) {
+      attrmap[chunkid] = (AttrChunk*)ptl_mm_alloc_private_pages(SPAT_PAGES_PER_CHUNK);
+    }
+    if (attrmap[chunkid]) memset(*attrmap[chunkid] + first, prot, end - first);
+
+    page += (end - first);
+  }
+#else
+  memset(attrmap + firstpage, prot, (lastpage - firstpage) + 1);
+#endif
+}
+
 void AddressSpace::make_accessible(void* p, Waddr size, spat_t top) {
   Waddr address = lowbits((Waddr)p, ADDRESS_SPACE_BITS);
   Waddr firstpage = (Waddr)address >> log2(PAGE_SIZE);
@@ -258,7 +434,7 @@ void AddressSpace::make_accessible(void* p, Waddr size, spat_t top) {
       endl, flush;
   }
   assert(ceil((W64)address + size, PAGE_SIZE) <= ADDRESS_SPACE_SIZE);
-  for (W64 i = firstpage; i <= lastpage; i++) { setbit(pageid_to_map_byte(top, i), lowbits(i, 3)); }
+  update_range(top, firstpage, lastpage, true);
 }
 
 void AddressSpace::make_inaccessible(void* p, Waddr size, spat_t top) {
@@ -272,7 +448,7 @@ void AddressSpace::make_inaccessible(void* p, Waddr size, spat_t top) {
       endl, flush;
   }
   assert(ceil((W64)address + size, PAGE_SIZE) <= ADDRESS_SPACE_SIZE);
-  for (Waddr i = firstpage; i <= lastpage; i++) { clearbit(pageid_to_map_byte(top, i), lowbits(i, 3)); }
+  update_range(top, firstpage, lastpage, false);
 }
 
 AddressSpace::AddressSpace() { }
@@ -301,6 +477,29 @@ void AddressSpace::freemap(AddressSpace::spat_t top) {
 #endif
 }
 
+AddressSpace::attrmap_t AddressSpace::allocattrmap() {
+#ifdef __x86_64__
+  return (attrmap_t)ptl_mm_alloc_private_pages(SPAT_TOPLEVEL_CHUNKS * sizeof(AttrChunk*));
+#else 
+  return (attrmap_t)ptl_mm_alloc_private_pages(SPAT_PAGES);
+#endif
+}
+
+void AddressSpace::freeattrmap(AddressSpace::attrmap_t top) {
+#ifdef __x86_64__
+  if (top) {
+    foreach (i, SPAT_TOPLEVEL_CHUNKS) {
+      if (top[i]) ptl_mm_free_private_pages(top[i], SPAT_PAGES_PER_CHUNK);
+    }
+    ptl_mm_free_private_pages(top, SPAT_TOPLEVEL_CHUNKS * sizeof(AttrChunk*));
+  }
+#else
+  if (top) {
+    ptl_mm_free_private_pages(top, SPAT_PAGES);
+  }
+#endif
+}
+
 void AddressSpace::reset() {
   brkbase = sys_brk(0);
   brk = brkbase;
@@ -312,6 +511,12 @@ void AddressSpace::reset() {
   freemap(itlbmap);
   freemap(transmap);
   freemap(dirtymap);
+  freeattrmap(attrmap);
+
+  if (lastmaps) ptl_mm_free_private_pages(lastmaps, lastmapcount * sizeof(MemoryMapExtent));
+  lastmaps = null;
+  lastmapcount = 0;
+  changed_range_count = 0;
 
   readmap  = allocmap();
   writemap = allocmap();
@@ -320,9 +525,25 @@ void AddressSpace::reset() {
   itlbmap  = allocmap();
   transmap = allocmap();
   dirtymap = allocmap();
+  attrmap  = allocattrmap();
 }
 
 void AddressSpace::setattr(void* start, Waddr length, int prot) {
+  //
+  // Remember what the simulator remapped, so the next resync knows
+  // to rebuild these ranges even if /proc/self/maps looks unchanged.
+  // Past MAX_CHANGED_RANGES, it just rebuilds everything.
+  //
+  if (changed_range_count < MAX_CHANGED_RANGES) {
+    changed_range_start[changed_range_count] = (Waddr)start;
+    changed_range_length[changed_range_count] = length;
+  }
+  if (changed_range_count <= MAX_CHANGED_RANGES) changed_range_count++;
+
+  update_attr(start, length, prot);
+}
+
+void AddressSpace::update_attr(void* start, Waddr length, int prot) {
   //
   // Check first if it's been assigned a non-stdin (> 0) filehandle,
   // since this may get called from ptlsim_preinit_entry before streams
@@ -344,19 +565,14 @@ void AddressSpace::setattr(void* start, Waddr length, int prot) {
   if (prot & PROT_EXEC)
     allow_exec(start, length);
   else disallow_exec(start, length);
+
+  if (!length) return;
+  Waddr address = lowbits((Waddr)start, ADDRESS_SPACE_BITS);
+  update_attr_range(address >> log2(PAGE_SIZE), (address + length - 1) >> log2(PAGE_SIZE), prot & (PROT_READ|PROT_WRITE|PROT_EXEC));
 }
 
 int AddressSpace::getattr(void* addr) {
-  Waddr address = lowbits((Waddr)addr, ADDRESS_SPACE_BITS);
-
-  Waddr page = pageid(address);
-
-  int prot = 
-    (bit(pageid_to_map_byte(readmap, page), lowbits(page, 3)) ? PROT_READ : 0) |
-    (bit(pageid_to_map_byte(writemap, page), lowbits(page, 3)) ? PROT_WRITE : 0) |
-    (bit(pageid_to_map_byte(execmap, page), lowbits(page, 3)) ? PROT_EXEC : 0);
-
-  return prot;
+  return fastattr((Waddr)addr);
 }
  
 int AddressSpace::mprotect(void* start, Waddr length, int prot) {
@@ -458,49 +674,6 @@ void* AddressSpace::setbrk(void* reqbrk) {
 Waddr stack_min_addr;
 Waddr stack_max_addr;
 
-/*
- * Memory map query support
- *
- * The prot field supports the same PROT_READ, PROT_WRITE, PROT_EXEC bits
- * used in the mmap() system call.
- *
- * The flags field may have the following standard mmap()-style bits set:
- *
- * MAP_SHARED       Shared (writes to map update the file)
- * MAP_PRIVATE      Private copy on write
- * MAP_ANONYMOUS    Anonymous (no file) mapping
- * MAP_GROWSDOWN    Stack
- *
- * Additionally, these additional bits may be present:
- *
- * MAP_ZERO         Inheritable shared memory on /dev/zero
- * MAP_HEAP         Heap terminated by brk
- * MAP_VDSO         VDSO (vsyscall) gateway page
- * MAP_KERNEL       special mapping reserved by kernel
- *
- */
-
-#undef  MAP_STACK
-#define MAP_STACK   MAP_GROWSDOWN
-#define MAP_ZERO    0x01000000
-#define MAP_HEAP    0x02000000
-#define MAP_VDSO    0x04000000
-
-struct MemoryMapExtent {
-  void* start;
-  unsigned long length;
-  unsigned int prot;
-  unsigned int flags;
-  unsigned long long offset;
-  unsigned long long inode;
-  unsigned short devmajor;
-  unsigned short devminor;
-};
-
-int mqueryall(MemoryMapExtent* startmap, size_t count);
-
-ostream& operator <<(ostream& os, const MemoryMapExtent& map);
-
 int mqueryall(MemoryMapExtent* startmap, size_t count) {
   MemoryMapExtent* map = startmap;
 
@@ -641,10 +814,20 @@ ostream& operator <<(ostream& os, const MemoryMapExtent& map) {
 
 #define MAX_MAPS_PER_PROCESS 65536
 
+static inline bool same_extent(const MemoryMapExtent& a, const MemoryMapExtent& b) {
+  return ((a.start == b.start) && (a.length == b.length) && (a.prot == b.prot) && (a.flags == b.flags));
+}
+
 void AddressSpace::resync_with_process_maps() {
   bool DEBUG = 1;
 
-  asp.reset();
+  //
+  // Without a previous snapshot, or if the simulator remapped too
+  // many ranges since then, start over from empty maps: every
+  // extent then shows up below as new.
+  //
+  bool incremental = (lastmaps && (changed_range_count <= MAX_CHANGED_RANGES));
+  if (!incremental) asp.reset();
 
   MemoryMapExtent* mapstart = (MemoryMapExtent*)ptl_mm_alloc_private_pages(MAX_MAPS_PER_PROCESS * sizeof(MemoryMapExtent));
   int n = mqueryall(mapstart, MAX_MAPS_PER_PROCESS);
@@ -660,12 +843,56 @@ void AddressSpace::resync_with_process_maps() {
   }
   logfile << flush;
 
+  //
+  // Both lists are sorted by start address, so matching extents
+  // are found in a single merge pass over each. Extents that are
+  // gone or changed are cleared first, along with anything the
+  // simulator remapped itself, then new or changed extents are set.
+  //
+  int removed = 0;
+  int j = 0;
+  foreach (i, lastmapcount) {
+    const MemoryMapExtent& old = lastmaps[i];
+    while ((j < n) && (mapstart[j].start < old.start)) j++;
+    if ((j < n) && same_extent(old, mapstart[j])) continue;
+    update_attr(old.start, old.length, PROT_NONE);
+    removed++;
+  }
+
+  foreach (i, changed_range_count) {
+    update_attr((void*)changed_range_start[i], changed_range_length[i], PROT_NONE);
+  }
+
+  int added = 0;
+  j = 0;
   foreach (i, n) {
     if (map->flags & MAP_STACK) stackbase = (Waddr)map->start;
-    setattr(map->start, map->length, (map->flags & MAP_ZERO) ? 0 : map->prot);
+
+    while ((j < lastmapcount) && (lastmaps[j].start < map->start)) j++;
+    bool unchanged = ((j < lastmapcount) && same_extent(lastmaps[j], *map));
+
+    foreach (k, changed_range_count) {
+      Waddr start = changed_range_start[k];
+      Waddr end = start + changed_range_length[k];
+      if (((Waddr)map->start < end) && (start < ((Waddr)map->start + map->length))) unchanged = false;
+    }
+
+    if (!unchanged) {
+      update_attr(map->start, map->length, (map->flags & MAP_ZERO) ? 0 : map->prot);
+      added++;
+    }
     map++;
   }
 
+  if (DEBUG) logfile << "resync_with_process_maps: ", (incremental ? "incremental" : "full"), " update: ", removed, " extents removed, ", 
+               changed_range_count, " simulator ranges rebuilt, ", added, " of ", n, " extents updated", endl;
+
+  if (lastmaps) ptl_mm_free_private_pages(lastmaps, lastmapcount * sizeof(MemoryMapExtent));
+  lastmaps = (n) ? ptl_mm_alloc_private_pages_for_objects<MemoryMapExtent>(n) : null;
+  if (n) arraycopy(lastmaps, mapstart, n);
+  lastmapcount = n;
+  changed_range_count = 0;
+
   ptl_mm_free_private_pages(mapstart, MAX_MAPS_PER_PROCESS * sizeof(MemoryMapExtent));
 
   // Find current brk value kernel thinks we are using:
@@ -698,7 +925,7 @@ void AddressSpace::resync_with_process_maps() {
   //
   // Hence, using this simplistic approach works fine on 2.6.x kernels.
   //
-  setattr((void*)PTL_IMAGE_BASE, PTL_IMAGE_SIZE, PROT_NONE);
+  update_attr((void*)PTL_IMAGE_BASE, PTL_IMAGE_SIZE, PROT_NONE);
 }
 
 AddressSpace asp;
@@ -961,6 +1188,7 @@ void switch_to_native_restore_context() {
   logfile << ctx;
 
   logfile << endl, "=== Switching to native mode at rip ", (void*)(Waddr)ctx.commitarf[REG_rip], " ===", endl, endl, flush;
+  start_native_counter();
   switch_to_native_restore_context_lowlevel(ctx.commitarf, !ctx.use64);
 }
 
@@ -969,6 +1197,8 @@ void switch_to_sim();
 
 // Called by save_context_switch_to_sim_lowlevel
 extern "C" void save_context_switch_to_sim() {
+  disarm_native_counter();
+
   if (!remove_switch_to_sim_breakpoint()) {
     logfile << endl, "=== Trigger request ===", endl, flush;
     // REG_rip set from first word on stack, but REG_rsp needs to be incremented
@@ -1025,73 +1255,1271 @@ void Context::propagate_x86_exception(byte exception, W32 errorcode, Waddr virta
   assert(false);
 }
 
-#ifdef __x86_64__
-
-const char* syscall_names_64bit[] = {
-  "read", "write", "open", "close", "stat", "fstat", "lstat", "poll", "lseek", "mmap", "mprotect", "munmap", "brk", "rt_sigaction", "rt_sigprocmask", "rt_sigreturn", "ioctl", "pread64", "pwrite64", "readv", "writev", "access", "pipe", "select", "sched_yield", "mremap", "msync", "mincore", "madvise", "shmget", "shmat", "shmctl", "dup", "dup2", "pause", "nanosleep", "getitimer", "alarm", "setitimer", "getpid", "sendfile", "socket", "connect", "accept", "sendto", "recvfrom", "sendmsg", "recvmsg", "shutdown", "bind", "listen", "getsockname", "getpeername", "socketpair", "setsockopt", "getsockopt", "clone", "fork", "vfork", "execve", "exit", "wait4", "kill", "uname", "semget", "semop", "semctl", "shmdt", "msgget", "msgsnd", "msgrcv", "msgctl", "fcntl", "flock", "fsync", "fdatasync", "truncate", "ftruncate", "getdents", "getcwd", "chdir", "fchdir", "rename", "mkdir", "rmdir", "creat", "link", "unlink", "symlink", "readlink", "chmod", "fchmod", "chown", "fchown", "lchown", "umask", "gettimeofday", "getrlimit", "getrusage", "sysinfo", "times", "ptrace", "getuid", "syslog", "getgid", "setuid", "setgid", "geteuid", "getegid", "setpgid", "getppid", "getpgrp", "setsid", "setreuid", "setregid", "getgroups", "setgroups", "setresuid", "getresuid", "setresgid", "getresgid", "getpgid", "setfsuid", "setfsgid", "getsid", "capget", "capset", "rt_sigpending", "rt_sigtimedwait", "rt_sigqueueinfo", "rt_sigsuspend", "sigaltstack", "utime", "mknod", "uselib", "personality", "ustat", "statfs", "fstatfs", "sysfs", "getpriority", "setpriority", "sched_setparam", "sched_getparam", "sched_setscheduler", "sched_getscheduler", "sched_get_priority_max", "sched_get_priority_min", "sched_rr_get_interval", "mlock", "munlock", "mlockall", "munlockall", "vhangup", "modify_ldt", "pivot_root", "_sysctl", "prctl", "arch_prctl", "adjtimex", "setrlimit", "chroot", "sync", "acct", "settimeofday", "mount", "umount2", "swapon", "swapoff", "reboot", "sethostname", "setdomainname", "iopl", "ioperm", "create_module", "init_module", "delete_module", "get_kernel_syms", "query_module", "quotactl", "nfsservctl", "getpmsg", "putpmsg", "afs_syscall", "tuxcall", "security", "gettid", "readahead", "setxattr", "lsetxattr", "fsetxattr", "getxattr", "lgetxattr", "fgetxattr", "listxattr", "llistxattr", "flistxattr", "removexattr", "lremovexattr", "fremovexattr", "tkill", "time", "futex", "sched_setaffinity", "sched_getaffinity", "set_thread_area", "io_setup", "io_destroy", "io_getevents", "io_submit", "io_cancel", "get_thread_area", "lookup_dcookie", "epoll_create", "epoll_ctl_old", "epoll_wait_old", "remap_file_pages", "getdents64", "set_tid_address", "restart_syscall", "semtimedop", "fadvise64", "timer_create", "timer_settime", "timer_gettime", "timer_getoverrun", "timer_delete", "clock_settime", "clock_gettime", "clock_getres", "clock_nanosleep", "exit_group", "epoll_wait", "epoll_ctl", "tgkill", "utimes", "vserver", "vserver", "mbind", "set_mempolicy", "get_mempolicy", "mq_open", "mq_unlink", "mq_timedsend", "mq_timedreceive", "mq_notify", "mq_getsetattr", "kexec_load", "waitid"};
-
 //
-// SYSCALL instruction from x86-64 mode
+// Guest threads
+//
+// Threads created with clone(CLONE_VM|CLONE_THREAD) never exist on
+// the host: each one gets its own saved Context, and a round-robin
+// scheduler multiplexes the runnable threads onto the hardware
+// contexts the core models simulate (contexts[0] is the global ctx).
+// Futexes are emulated here, so a blocked thread consumes no cycles
+// and a thread that waits for another one never blocks the host.
+//
+// The first guest thread keeps the real host tid; all others get
+// virtual tids, so they cannot be signalled with tgkill().
+//
+// With -virtual-sleep, nanosleep, clock_nanosleep, poll and epoll_wait
+// timeouts block the thread in the same way, and when every thread is
+// blocked, sim_cycle jumps straight to the earliest timeout instead of
+// stepping idle cycles, so the host never sleeps for the guest.
 //
 
-void handle_syscall_64bit() {
-  bool DEBUG = 1; //analyze_in_detail();
+enum {
+  GUEST_CLONE_VM             = 0x00000100,
+  GUEST_CLONE_THREAD         = 0x00010000,
+  GUEST_CLONE_SETTLS         = 0x00080000,
+  GUEST_CLONE_PARENT_SETTID  = 0x00100000,
+  GUEST_CLONE_CHILD_CLEARTID = 0x00200000,
+  GUEST_CLONE_CHILD_SETTID   = 0x01000000,
+};
+
+enum {
+  GUEST_FUTEX_WAIT           = 0,
+  GUEST_FUTEX_WAKE           = 1,
+  GUEST_FUTEX_REQUEUE        = 3,
+  GUEST_FUTEX_CMP_REQUEUE    = 4,
+  GUEST_FUTEX_WAKE_OP        = 5,
+  GUEST_FUTEX_WAIT_BITSET    = 9,
+  GUEST_FUTEX_WAKE_BITSET    = 10,
+  GUEST_FUTEX_PRIVATE_FLAG   = 128,
+  GUEST_FUTEX_CLOCK_REALTIME = 256,
+};
+
+enum { GUEST_THREAD_RUNNABLE, GUEST_THREAD_BLOCKED, GUEST_THREAD_EXITED };
+
+// What a blocked thread returns when its timeout expires:
+enum { GUEST_SLEEP_FUTEX, GUEST_SLEEP_NANOSLEEP, GUEST_SLEEP_POLL, GUEST_SLEEP_EPOLL };
+
+struct GuestThread {
+  Context state;          // architectural state while not on a hardware context
+  W32 tid;
+  int status;
+  int hwctx;              // hardware context running this thread, or -1
+  Waddr futex_addr;       // futex word this thread is blocked on
+  W32 futex_bitset;
+  W64 futex_seq;          // wakeup order (FIFO)
+  W64 timeout_cycle;      // infinity unless blocked with a timeout in simulated time
+  bool timed;             // without -virtual-sleep, absolute timeouts only expire to break a deadlock
+  int sleep_type;
+  bool sleep_compat;      // 32-bit syscall ABI
+  Waddr sleep_args[3];    // poll or epoll_wait arguments, rechecked at the timeout
+  Waddr clear_child_tid;
+};
+
+#define MAX_GUEST_THREADS 64
+#define GUEST_THREAD_VIRTUAL_TID_BASE 0x40000000
+
+static GuestThread guest_threads[MAX_GUEST_THREADS];
+static int guest_thread_count = 0;
+static int live_guest_threads = 0;
+static W32 next_virtual_tid = GUEST_THREAD_VIRTUAL_TID_BASE;
+static W64 guest_futex_seq = 0;
+static bool guest_thread_switch_pending = 0;
+
+static GuestThread* hwctx_thread[MAX_CONTEXTS];
+static W64 quantum_end_cycle[MAX_CONTEXTS];
+
+Context* contexts[MAX_CONTEXTS] = {&ctx};
+int hardware_context_count = 1;
+W64 guest_thread_event_cycle[MAX_CONTEXTS];
+
+static void update_guest_thread_events() {
+  int waiting = 0;
+  W64 timeout = infinity;
+
+  foreach (i, guest_thread_count) {
+    GuestThread& t = guest_threads[i];
+    waiting += ((t.status == GUEST_THREAD_RUNNABLE) & (t.hwctx < 0));
+    if (t.status == GUEST_THREAD_BLOCKED) timeout = min(timeout, t.timeout_cycle);
+  }
+
   //
-  // Handle an x86-64 syscall:
-  // (This is called from the assist_syscall ucode assist)
+  // Idle contexts pick up waiting threads right away; busy
+  // ones only when their quantum expires. With one thread,
+  // no events are ever raised.
   //
+  foreach (i, contextcount) {
+    W64 cycle = (waiting) ? (hwctx_thread[i] ? quantum_end_cycle[i] : sim_cycle) : infinity;
+    guest_thread_event_cycle[i] = min(cycle, timeout);
+  }
+}
 
-  int syscallid = ctx.commitarf[REG_rax];
-  W64 arg1 = ctx.commitarf[REG_rdi];
-  W64 arg2 = ctx.commitarf[REG_rsi];
-  W64 arg3 = ctx.commitarf[REG_rdx];
-  W64 arg4 = ctx.commitarf[REG_r10];
-  W64 arg5 = ctx.commitarf[REG_r8];
-  W64 arg6 = ctx.commitarf[REG_r9];
+static void bind_guest_thread(int hw, GuestThread* t) {
+  Context& hwctx = contextof(hw);
+  hwctx = t->state;
+  hwctx.vcpuid = hw;
+  hwctx.running = 1;
+  hwctx.commitarf[REG_ctx] = (Waddr)&hwctx;
+  hwctx.commitarf[REG_fpstack] = (Waddr)&hwctx.fpstack;
+  t->hwctx = hw;
+  hwctx_thread[hw] = t;
+  quantum_end_cycle[hw] = sim_cycle + config.thread_quantum;
+}
 
-  if (DEBUG) 
-    logfile << "handle_syscall -> (#", syscallid, " ", ((syscallid < lengthof(syscall_names_64bit)) ? syscall_names_64bit[syscallid] : "???"), 
-      ") from ", (void*)ctx.commitarf[REG_rcx], " args ", " (", (void*)arg1, ", ", (void*)arg2, ", ", (void*)arg3, ", ", (void*)arg4, ", ",
-      (void*)arg5, ", ", (void*)arg6, ") at iteration ", iterations, endl, flush;
+static void unbind_guest_thread(int hw) {
+  GuestThread* t = hwctx_thread[hw];
+  if (!t) return;
+  t->state = contextof(hw);
+  t->hwctx = -1;
+  hwctx_thread[hw] = null;
+}
 
-  switch (syscallid) {
-  case __NR_64bit_mmap:
-    ctx.commitarf[REG_rax] = (W64)asp.mmap((void*)arg1, arg2, arg3, arg4, arg5, arg6);
-    break;
-  case __NR_64bit_munmap:
-    ctx.commitarf[REG_rax] = asp.munmap((void*)arg1, arg2);
-    break;
-  case __NR_64bit_mprotect:
-    ctx.commitarf[REG_rax] = asp.mprotect((void*)arg1, arg2, arg3);
-    break;
-  case __NR_64bit_brk:
-    ctx.commitarf[REG_rax] = (W64)asp.setbrk((void*)arg1);
-    break;
-  case __NR_64bit_mremap: {
-    ctx.commitarf[REG_rax] = (W64)asp.mremap((void*)arg1, arg2, arg3, arg4);
-    break;
-  }
-  case __NR_64bit_arch_prctl: {
-    // We need to trap this so we can virtualize ARCH_SET_FS and ARCH_SET_GS:
-    ctx.commitarf[REG_rax] = sys_arch_prctl(arg1, (void*)arg2);
-    ctx.update_shadow_segment_descriptors();
-    switch (arg1) {
-    case ARCH_SET_FS:
-      ctx.seg[SEGID_FS].base = arg2;
-      logfile << "arch_prctl: set FS base to ", (void*)ctx.seg[SEGID_FS].base, endl;
-      break;
-    case ARCH_SET_GS:
-      ctx.seg[SEGID_GS].base = arg2;
-      logfile << "arch_prctl: set GS base to ", (void*)ctx.seg[SEGID_GS].base, endl;
-      break;
-    }
-    break;
+// Pick the next runnable unscheduled thread after <prev>, or <prev> itself if nothing else can run:
+static GuestThread* pick_guest_thread(GuestThread* prev) {
+  int start = (prev) ? (prev - guest_threads) : 0;
+  foreach (i, guest_thread_count) {
+    GuestThread* t = &guest_threads[(start + 1 + i) % guest_thread_count];
+    if ((t->status == GUEST_THREAD_RUNNABLE) & (t->hwctx < 0)) return t;
   }
-  case __NR_64bit_exit: {
-    logfile << "handle_syscall at iteration ", iterations, ": exit(): exiting with arg ", (W64s)arg1, "...", endl, flush;
-    user_process_terminated((int)arg1);
+  return null;
+}
+
+static void wake_guest_thread(GuestThread& t, W64 rc) {
+  t.status = GUEST_THREAD_RUNNABLE;
+  t.futex_addr = 0;
+  t.timeout_cycle = infinity;
+  t.timed = 0;
+  t.sleep_type = GUEST_SLEEP_FUTEX;
+  // Blocked threads are never bound, so the syscall result goes into the saved state:
+  t.state.commitarf[REG_rax] = rc;
+}
+
+static inline bool virtual_sleep_enabled() {
+  // Sleeps never reach the host, so they would be missing from a record or replay log:
+  return (config.virtual_sleep && (!replay_log_mode));
+}
+
+// Zero timeout poll or epoll_wait on the host descriptors:
+static W64 poll_guest_descriptors(int type, const Waddr* args, bool compat) {
+  bool poll = (type == GUEST_SLEEP_POLL);
+  if (compat) {
+    return (poll) ? do_syscall_32bit(__NR_32bit_poll, args[0], args[1], 0, 0, 0, 0)
+      : do_syscall_32bit(__NR_32bit_epoll_wait, args[0], args[1], args[2], 0, 0, 0);
   }
-  case __NR_64bit_exit_group: {
+#ifdef __x86_64__
+  return (poll) ? do_syscall_64bit(__NR_64bit_poll, args[0], args[1], 0, 0, 0, 0)
+    : do_syscall_64bit(__NR_64bit_epoll_wait, args[0], args[1], args[2], 0, 0, 0);
+#else
+  return (W64)(-ENOSYS);
+#endif
+}
+
+static void expire_guest_thread_timeout(GuestThread& t) {
+  W64 rc = (W64)(-ETIMEDOUT);
+
+  switch (t.sleep_type) {
+  case GUEST_SLEEP_FUTEX:
+    stats.external.threads.futex_timeouts++; break;
+  case GUEST_SLEEP_NANOSLEEP:
+    rc = 0; break;
+  case GUEST_SLEEP_POLL:
+  case GUEST_SLEEP_EPOLL:
+    // Readiness is only rechecked once the timeout is up:
+    rc = poll_guest_descriptors(t.sleep_type, t.sleep_args, t.sleep_compat); break;
+  }
+
+  wake_guest_thread(t, rc);
+}
+
+static void expire_guest_futex_timeouts() {
+  foreach (i, guest_thread_count) {
+    GuestThread& t = guest_threads[i];
+    if likely ((t.status != GUEST_THREAD_BLOCKED) | (t.timeout_cycle > sim_cycle)) continue;
+    expire_guest_thread_timeout(t);
+  }
+}
+
+static bool expire_earliest_guest_futex_timeout() {
+  GuestThread* earliest = null;
+  foreach (i, guest_thread_count) {
+    GuestThread& t = guest_threads[i];
+    if ((t.status != GUEST_THREAD_BLOCKED) | (!t.timed)) continue;
+    if ((!earliest) || (t.timeout_cycle < earliest->timeout_cycle)) earliest = &t;
+  }
+
+  if (!earliest) return false;
+
+  //
+  // Nothing can run until the earliest timeout, so skip the idle cycles
+  // in bulk: this also expires any other timeouts due by then.
+  //
+  if (virtual_sleep_enabled() && (earliest->timeout_cycle != infinity)) {
+    W64 skipped = (earliest->timeout_cycle > sim_cycle) ? (earliest->timeout_cycle - sim_cycle) : 0;
+    sim_cycle += skipped;
+    stats.summary.cycles += skipped;
+    stats.external.threads.skipped_cycles += skipped;
+    if (logable(4)) logfile << "Guest threads: all threads sleeping; skipped ", skipped, " idle cycles to cycle ", sim_cycle, endl;
+    expire_guest_futex_timeouts();
+    return true;
+  }
+
+  expire_guest_thread_timeout(*earliest);
+  return true;
+}
+
+//
+// Called at the end of a syscall that blocked, exited or yielded
+// the current thread, or from event_upcall() when an event is due.
+//
+static void reschedule_guest_threads(Context& hwctx, bool yield) {
+  int hw = hwctx.vcpuid;
+  expire_guest_futex_timeouts();
+
+  GuestThread* current = hwctx_thread[hw];
+  bool leave = ((!current) || (current->status != GUEST_THREAD_RUNNABLE) || yield || (sim_cycle >= quantum_end_cycle[hw]));
+
+  if (leave) {
+    unbind_guest_thread(hw);
+    GuestThread* next = pick_guest_thread(current);
+
+    if unlikely (!next) {
+      bool idle = 1;
+      foreach (i, contextcount) idle &= (hwctx_thread[i] == null);
+
+      if (idle && expire_earliest_guest_futex_timeout()) next = pick_guest_thread(current);
+
+      if (idle && (!next)) {
+        logfile << "Guest threads: all ", live_guest_threads, " live threads are blocked in futex waits at cycle ", sim_cycle, "; deadlock", endl, flush;
+        cerr << "Guest threads: all ", live_guest_threads, " live threads are blocked in futex waits; deadlock", endl, flush;
+        user_process_terminated(1);
+      }
+    }
+
+    if likely (next) {
+      if (next != current) {
+        if (logable(4)) logfile << "Guest threads: switch hw context ", hw, " from tid ", (current ? (int)current->tid : -1), " to tid ", next->tid, " at cycle ", sim_cycle, endl;
+        stats.external.threads.switches++;
+      }
+      bind_guest_thread(hw, next);
+    } else {
+      hwctx.running = 0;
+    }
+  }
+
+  update_guest_thread_events();
+}
+
+bool Context::event_upcall() {
+  reschedule_guest_threads(*this, false);
+  return true;
+}
+
+static void start_guest_threads() {
+  if unlikely (!guest_thread_count) {
+    hardware_context_count = clipto((int)config.hardware_contexts, 1, MAX_CONTEXTS);
+
+    foreach (i, hardware_context_count) {
+      if (i) contexts[i] = new Context(ctx);
+      Context& hwctx = contextof(i);
+      hwctx.vcpuid = i;
+      hwctx.running = 0;
+      hwctx.commitarf[REG_ctx] = (Waddr)&hwctx;
+      hwctx.commitarf[REG_fpstack] = (Waddr)&hwctx.fpstack;
+    }
+
+    GuestThread& t = guest_threads[guest_thread_count++];
+    t.tid = sys_gettid();
+    t.status = GUEST_THREAD_RUNNABLE;
+    t.timeout_cycle = infinity;
+    t.timed = 0;
+    t.sleep_type = GUEST_SLEEP_FUTEX;
+    t.futex_addr = 0;
+    t.clear_child_tid = 0;
+    t.hwctx = 0;
+    hwctx_thread[0] = &t;
+    live_guest_threads = 1;
+
+    if (hardware_context_count > 1) logfile << "Guest threads: scheduling onto ", hardware_context_count, " hardware contexts", endl;
+  }
+
+  // ctx holds the (possibly updated) native state of the thread bound to it:
+  ctx.running = 1;
+  foreach (i, contextcount) quantum_end_cycle[i] = sim_cycle + config.thread_quantum;
+  update_guest_thread_events();
+}
+
+//
+// Only one thread can return to native mode: this is the host
+// thread itself if still alive. The others stay suspended in
+// the table and resume on the next switch to simulation.
+//
+static void stop_guest_threads() {
+  if likely ((live_guest_threads <= 1) && (hwctx_thread[0] == &guest_threads[0])) return;
+
+  foreach (i, contextcount) unbind_guest_thread(i);
+  foreach (i, contextcount) contextof(i).running = 0;
+
+  GuestThread* t = null;
+  foreach (i, guest_thread_count) {
+    if (guest_threads[i].status == GUEST_THREAD_EXITED) continue;
+    t = &guest_threads[i];
+    break;
+  }
+  assert(t);
+
+  // A futex wait may return 0 spuriously:
+  if (t->status == GUEST_THREAD_BLOCKED) wake_guest_thread(*t, 0);
+  bind_guest_thread(0, t);
+
+  logfile << "Guest threads: tid ", t->tid, " returns to native mode; ", (live_guest_threads - 1), " other threads stay suspended", endl;
+  if (live_guest_threads > 1) cerr << "Warning: ", (live_guest_threads - 1), " guest threads stay suspended in native mode", endl, flush;
+
+#ifdef __x86_64__
+  if unlikely ((t != &guest_threads[0]) && ctx.use64) sys_arch_prctl(ARCH_SET_FS, (void*)ctx.seg[SEGID_FS].base);
+#endif
+}
+
+static GuestThread& current_guest_thread(Context& ctx) {
+  GuestThread* t = hwctx_thread[ctx.vcpuid];
+  assert(t);
+  return *t;
+}
+
+static bool guest_thread_write_tid(Waddr addr, W32 tid) {
+  if unlikely (!asp.check((void*)addr, PROT_WRITE)) return false;
+  *(W32*)addr = tid;
+  return true;
+}
+
+//
+// clone() of a new thread in the same address space: the child starts as a
+// copy of the parent returning 0 from the syscall at <retaddr> on <newsp>.
+//
+static W64 clone_guest_thread(Context& ctx, W64 flags, Waddr newsp, Waddr ptid, Waddr ctid, Waddr tls, Waddr retaddr) {
+  GuestThread* t = null;
+  foreach (i, MAX_GUEST_THREADS) {
+    if ((i < guest_thread_count) && (guest_threads[i].status != GUEST_THREAD_EXITED)) continue;
+    t = &guest_threads[i];
+    guest_thread_count = max(guest_thread_count, (int)i+1);
+    break;
+  }
+
+  if unlikely (!t) {
+    logfile << "Guest threads: cannot create more than ", MAX_GUEST_THREADS, " threads", endl;
+    return (W64)(-EAGAIN);
+  }
+
+  t->state = ctx;
+  t->tid = next_virtual_tid++;
+  t->status = GUEST_THREAD_RUNNABLE;
+  t->hwctx = -1;
+  t->futex_addr = 0;
+  t->timeout_cycle = infinity;
+  t->timed = 0;
+  t->sleep_type = GUEST_SLEEP_FUTEX;
+  t->clear_child_tid = (flags & GUEST_CLONE_CHILD_CLEARTID) ? ctid : 0;
+
+  Context& child = t->state;
+  child.commitarf[REG_rax] = 0;
+  child.commitarf[REG_rip] = retaddr;
+  if (newsp) child.commitarf[REG_rsp] = newsp;
+
+  if (flags & GUEST_CLONE_SETTLS) {
+    if (ctx.use64) {
+      child.seg[SEGID_FS].base = tls;
+    } else {
+      // 32-bit TLS is a user_desc for the (already installed) GDT entry in %gs:
+      user_desc_32bit* desc = (user_desc_32bit*)tls;
+      if (asp.check(desc, PROT_READ)) child.seg[SEGID_GS].base = desc->base_addr;
+    }
+  }
+
+  if (flags & GUEST_CLONE_PARENT_SETTID) guest_thread_write_tid(ptid, t->tid);
+  if (flags & GUEST_CLONE_CHILD_SETTID) guest_thread_write_tid(ctid, t->tid);
+
+  live_guest_threads++;
+  stats.external.threads.created++;
+
+  logfile << "Guest threads: tid ", current_guest_thread(ctx).tid, " created tid ", t->tid, " (flags 0x", hexstring(flags, 32), ") starting at rip ",
+    (void*)retaddr, " with stack ", (void*)newsp, "; ", live_guest_threads, " threads live", endl, flush;
+
+  update_guest_thread_events();
+  return t->tid;
+}
+
+static int wake_guest_futex(Waddr uaddr, int count, W32 bitset = 0xffffffff) {
+  int n = 0;
+  while (n < count) {
+    // FIFO: wake the longest waiting thread first
+    GuestThread* oldest = null;
+    foreach (i, guest_thread_count) {
+      GuestThread& t = guest_threads[i];
+      if ((t.status != GUEST_THREAD_BLOCKED) | (t.futex_addr != uaddr) | (!(t.futex_bitset & bitset))) continue;
+      if ((!oldest) || (t.futex_seq < oldest->futex_seq)) oldest = &t;
+    }
+    if (!oldest) break;
+    wake_guest_thread(*oldest, 0);
+    n++;
+  }
+
+  stats.external.threads.futex_wakeups += n;
+  return n;
+}
+
+static int requeue_guest_futex(Waddr uaddr, Waddr uaddr2, int count) {
+  int n = 0;
+  foreach (i, guest_thread_count) {
+    if (n >= count) break;
+    GuestThread& t = guest_threads[i];
+    if ((t.status != GUEST_THREAD_BLOCKED) | (t.futex_addr != uaddr)) continue;
+    t.futex_addr = uaddr2;
+    n++;
+  }
+  return n;
+}
+
+static bool guest_futex_op_compare(W32s oldval, int cmp, W32s cmparg) {
+  switch (cmp) {
+  case 0: return (oldval == cmparg);
+  case 1: return (oldval != cmparg);
+  case 2: return (oldval < cmparg);
+  case 3: return (oldval <= cmparg);
+  case 4: return (oldval > cmparg);
+  case 5: return (oldval >= cmparg);
+  }
+  return false;
+}
+
+// A guest timespec, with 32-bit fields if <compat>:
+static bool read_guest_timespec(Waddr p, bool compat, W64& sec, W64& nsec) {
+  if (compat) {
+    W32* ts = (W32*)p;
+    if unlikely (!asp.check(ts, PROT_READ)) return false;
+    sec = ts[0]; nsec = ts[1];
+  } else {
+    W64* ts = (W64*)p;
+    if unlikely (!asp.check(ts, PROT_READ)) return false;
+    sec = ts[0]; nsec = ts[1];
+  }
+  return true;
+}
+
+//
+// Simulated time runs at the host core frequency, or at one cycle
+// per nanosecond if that is unknown (get_core_freq_hz() returns 0).
+//
+static W64 sim_core_freq_hz() {
+  W64 hz = get_core_freq_hz();
+  return (hz) ? hz : 1000000000ULL;
+}
+
+static W64 timespec_to_sim_cycles(W64 sec, W64 nsec) {
+  double cycles = ((double)sec + ((double)nsec * 1e-9)) * (double)sim_core_freq_hz();
+  return (cycles < 1.8e19) ? (W64)cycles : infinity;
+}
+
+// Cycles until the absolute time <sec, nsec> on the simulated <clock>, or 0 if already past:
+static W64 deadline_to_sim_cycles(int clock, W64 sec, W64 nsec) {
+  W64 now;
+  get_simulated_time(clock, now);
+  W64 nowsec = now / 1000000000ULL;
+  W64 nownsec = now % 1000000000ULL;
+  if ((sec < nowsec) | ((sec == nowsec) & (nsec <= nownsec))) return 0;
+  return (nsec >= nownsec) ? timespec_to_sim_cycles(sec - nowsec, nsec - nownsec)
+    : timespec_to_sim_cycles(sec - nowsec - 1, nsec + 1000000000ULL - nownsec);
+}
+
+//
+// futex(uaddr, op, val, timeout or val2, uaddr2, val3); <compat> means
+// the timespec has 32-bit fields.
+//
+static W64 handle_guest_futex(Context& ctx, Waddr uaddr, int op, W32 val, Waddr timeout, Waddr uaddr2, W32 val3, bool compat) {
+  GuestThread& current = current_guest_thread(ctx);
+  int cmd = op & ~(GUEST_FUTEX_PRIVATE_FLAG | GUEST_FUTEX_CLOCK_REALTIME);
+  W32* p = (W32*)uaddr;
+
+  if unlikely ((uaddr & 3) | (!asp.check(p, PROT_READ))) return (W64)(-EFAULT);
+
+  W64 rc = 0;
+
+  switch (cmd) {
+  case GUEST_FUTEX_WAIT:
+  case GUEST_FUTEX_WAIT_BITSET: {
+    W32 bitset = (cmd == GUEST_FUTEX_WAIT_BITSET) ? val3 : 0xffffffff;
+    if unlikely (!bitset) return (W64)(-EINVAL);
+    if (*p != val) return (W64)(-EAGAIN);
+
+    current.timeout_cycle = infinity;
+    current.timed = 0;
+
+    if (timeout) {
+      W64 sec, nsec;
+      if unlikely (!read_guest_timespec(timeout, compat, sec, nsec)) return (W64)(-EFAULT);
+
+      current.timed = 1;
+      if (cmd == GUEST_FUTEX_WAIT) {
+        // Relative timeout in simulated cycles:
+        W64 cycles = timespec_to_sim_cycles(sec, nsec);
+        if (!cycles) return (W64)(-ETIMEDOUT);
+        current.timeout_cycle = sim_cycle + cycles;
+      } else if (virtual_sleep_enabled()) {
+        // Absolute timeout on the simulated clock:
+        W64 cycles = deadline_to_sim_cycles((op & GUEST_FUTEX_CLOCK_REALTIME) ? CLOCK_REALTIME : CLOCK_MONOTONIC, sec, nsec);
+        if (!cycles) return (W64)(-ETIMEDOUT);
+        current.timeout_cycle = sim_cycle + cycles;
+      }
+    }
+
+    current.status = GUEST_THREAD_BLOCKED;
+    current.futex_addr = uaddr;
+    current.futex_bitset = bitset;
+    current.futex_seq = guest_futex_seq++;
+    stats.external.threads.futex_waits++;
+    guest_thread_switch_pending = 1;
+    break;
+  }
+  case GUEST_FUTEX_WAKE:
+  case GUEST_FUTEX_WAKE_BITSET: {
+    W32 bitset = (cmd == GUEST_FUTEX_WAKE_BITSET) ? val3 : 0xffffffff;
+    if unlikely (!bitset) return (W64)(-EINVAL);
+    rc = wake_guest_futex(uaddr, val, bitset);
+    break;
+  }
+  case GUEST_FUTEX_REQUEUE:
+  case GUEST_FUTEX_CMP_REQUEUE: {
+    if ((cmd == GUEST_FUTEX_CMP_REQUEUE) && (*p != val3)) return (W64)(-EAGAIN);
+    int woken = wake_guest_futex(uaddr, val);
+    rc = woken + requeue_guest_futex(uaddr, uaddr2, (int)timeout);
+    break;
+  }
+  case GUEST_FUTEX_WAKE_OP: {
+    W32* p2 = (W32*)uaddr2;
+    if unlikely ((uaddr2 & 3) | (!asp.check(p2, PROT_WRITE))) return (W64)(-EFAULT);
+
+    int opcode = (val3 >> 28) & 0xf;
+    int cmp = (val3 >> 24) & 0xf;
+    W32s oparg = ((W32s)(val3 << 8)) >> 20;
+    W32s cmparg = ((W32s)(val3 << 20)) >> 20;
+    if (opcode & 8) oparg = 1 << oparg;
+
+    W32s oldval = *p2;
+    switch (opcode & 7) {
+    case 0: *p2 = oparg; break;
+    case 1: *p2 = oldval + oparg; break;
+    case 2: *p2 = oldval | oparg; break;
+    case 3: *p2 = oldval & ~oparg; break;
+    case 4: *p2 = oldval ^ oparg; break;
+    default: return (W64)(-ENOSYS);
+    }
+
+    rc = wake_guest_futex(uaddr, val);
+    if (guest_futex_op_compare(oldval, cmp, cmparg)) rc += wake_guest_futex(uaddr2, (int)timeout);
+    break;
+  }
+  default:
+    // PI futexes are not supported
+    logfile << "Guest threads: unsupported futex op ", op, endl;
+    return (W64)(-ENOSYS);
+  }
+
+  update_guest_thread_events();
+  return rc;
+}
+
+static inline bool guest_writable(Waddr p, int bytes) {
+  return (asp.check((void*)p, PROT_WRITE) && asp.check((void*)(p + bytes - 1), PROT_WRITE));
+}
+
+//
+// clock_gettime, gettimeofday and time with -virtual-sleep: the guest
+// must read the same simulated clock its absolute sleep and futex
+// deadlines are measured against, or those deadlines (taken from
+// host time) would recede as the simulation falls behind the host.
+// The emulated vDSO already does this for 64-bit guests, but 32-bit
+// guests and -fast-vdso 0 make the syscalls. Returns false to pass
+// the syscall through, i.e. for other syscalls and clocks simulated
+// time does not cover.
+//
+static bool handle_guest_clock(int syscallid, const W64* args, bool compat, W64& rc) {
+  bool is_clock_gettime = (syscallid == ((compat) ? __NR_32bit_clock_gettime : __NR_64bit_clock_gettime));
+  bool is_gettimeofday = (syscallid == ((compat) ? __NR_32bit_gettimeofday : __NR_64bit_gettimeofday));
+  bool is_time = (syscallid == ((compat) ? __NR_32bit_time : __NR_64bit_time));
+  int wordsize = (compat) ? 4 : 8;
+  W64 ns;
+
+  if likely (!(is_clock_gettime | is_gettimeofday | is_time)) return false;
+
+  if (is_clock_gettime) {
+    if (!get_simulated_time(args[0], ns)) return false;
+  } else {
+    get_simulated_time(CLOCK_REALTIME, ns);
+  }
+
+  W64 sec = ns / 1000000000ULL;
+  W64 frac = ns % 1000000000ULL;
+  Waddr p = (is_gettimeofday | is_time) ? args[0] : args[1];
+  rc = (is_time) ? sec : 0;
+
+  if (is_gettimeofday) {
+    // The timezone is not time dependent, so the host kernel fills it in:
+    if unlikely (args[1] && sys_gettimeofday(null, (struct timezone*)(Waddr)args[1])) { rc = (W64)(-EFAULT); return true; }
+    frac /= 1000;
+  }
+
+  if (!p) return true;
+
+  if unlikely (!guest_writable(p, (is_time) ? wordsize : 2*wordsize)) { rc = (W64)(-EFAULT); return true; }
+
+  if (compat) {
+    W32* q = (W32*)p;
+    q[0] = sec;
+    if (!is_time) q[1] = frac;
+  } else {
+    W64* q = (W64*)p;
+    q[0] = sec;
+    if (!is_time) q[1] = frac;
+  }
+
+  return true;
+}
+
+//
+// nanosleep, clock_nanosleep, poll and epoll_wait with -virtual-sleep:
+// the thread blocks until its timeout in simulated cycles. Returns
+// false to pass the syscall through to the host, i.e. for unrelated
+// syscalls, infinite poll timeouts and clocks simulated time does
+// not cover. The clock syscalls are served from simulated time too
+// (see handle_guest_clock()).
+//
+static bool handle_guest_sleep(Context& ctx, int syscallid, const W64* args, bool compat, W64& rc) {
+  int type;
+  W64 cycles = 0;
+  Waddr sleep_args[3] = {args[0], args[1], args[2]};
+
+  if (handle_guest_clock(syscallid, args, compat, rc)) return true;
+
+  if (compat) {
+    switch (syscallid) {
+    case __NR_32bit_nanosleep: type = GUEST_SLEEP_NANOSLEEP; break;
+    case __NR_32bit_clock_nanosleep: type = GUEST_SLEEP_NANOSLEEP; break;
+    case __NR_32bit_poll: type = GUEST_SLEEP_POLL; break;
+    case __NR_32bit_epoll_wait: type = GUEST_SLEEP_EPOLL; break;
+    default: return false;
+    }
+  } else {
+    switch (syscallid) {
+    case __NR_64bit_nanosleep: type = GUEST_SLEEP_NANOSLEEP; break;
+    case __NR_64bit_clock_nanosleep: type = GUEST_SLEEP_NANOSLEEP; break;
+    case __NR_64bit_poll: type = GUEST_SLEEP_POLL; break;
+    case __NR_64bit_epoll_wait: type = GUEST_SLEEP_EPOLL; break;
+    default: return false;
+    }
+  }
+
+  if (type == GUEST_SLEEP_NANOSLEEP) {
+    bool clocked = (syscallid == ((compat) ? __NR_32bit_clock_nanosleep : __NR_64bit_clock_nanosleep));
+    int clock = (clocked) ? (int)args[0] : CLOCK_MONOTONIC;
+    bool absolute = (clocked) && (args[1] & 1); // TIMER_ABSTIME
+    Waddr req = (clocked) ? args[2] : args[0];
+
+    W64 now;
+    if (!get_simulated_time(clock, now)) return false;
+
+    W64 sec, nsec;
+    if unlikely (!read_guest_timespec(req, compat, sec, nsec)) { rc = (W64)(-EFAULT); return true; }
+    if (compat) sec = (W64s)(W32s)sec;
+    if unlikely (((W64s)sec < 0) | (nsec >= 1000000000ULL)) { rc = (W64)(-EINVAL); return true; }
+
+    cycles = (absolute) ? deadline_to_sim_cycles(clock, sec, nsec) : timespec_to_sim_cycles(sec, nsec);
+    rc = 0;
+  } else {
+    int timeout_ms = (type == GUEST_SLEEP_POLL) ? (int)args[2] : (int)args[3];
+    if (timeout_ms < 0) return false;
+
+    rc = poll_guest_descriptors(type, sleep_args, compat);
+    if (rc != 0) return true;
+    cycles = timespec_to_sim_cycles(timeout_ms / 1000, (timeout_ms % 1000) * 1000000ULL);
+  }
+
+  if (!cycles) return true;
+
+  GuestThread& current = current_guest_thread(ctx);
+  current.status = GUEST_THREAD_BLOCKED;
+  current.futex_addr = 0;
+  current.timeout_cycle = sim_cycle + cycles;
+  current.timed = 1;
+  current.sleep_type = type;
+  current.sleep_compat = compat;
+  arraycopy(current.sleep_args, sleep_args, lengthof(sleep_args));
+  stats.external.threads.sleeps++;
+  guest_thread_switch_pending = 1;
+  update_guest_thread_events();
+  return true;
+}
+
+//
+// exit() of one thread: returns only if other threads are still alive.
+//
+static void exit_guest_thread(Context& ctx, int rc) {
+  GuestThread& current = current_guest_thread(ctx);
+
+  if (live_guest_threads <= 1) user_process_terminated(rc);
+
+  if (current.clear_child_tid && guest_thread_write_tid(current.clear_child_tid, 0))
+    wake_guest_futex(current.clear_child_tid, 1);
+
+  current.status = GUEST_THREAD_EXITED;
+  live_guest_threads--;
+  stats.external.threads.exited++;
+  guest_thread_switch_pending = 1;
+
+  logfile << "Guest threads: tid ", current.tid, " exited with rc ", rc, " at cycle ", sim_cycle, "; ", live_guest_threads, " threads live", endl, flush;
+}
+
+static void finish_guest_thread_syscall(Context& ctx) {
+  if likely (!guest_thread_switch_pending) return;
+  guest_thread_switch_pending = 0;
+  reschedule_guest_threads(ctx, true);
+}
+
+//
+// Syscall accounting and binary trace
+//
+// Every guest syscall is counted in stats.external.syscalls; with
+// -syscall-trace, a fixed-size SyscallTraceRecord is also buffered
+// and written out in bulk, so tracing costs no formatting or flushes.
+//
+
+static odstream syscall_trace_file;
+static SyscallTraceRecord* syscall_trace_buf = null;
+static int syscall_trace_count = 0;
+
+void flush_syscall_trace() {
+  if unlikely (!syscall_trace_buf) return;
+  if (syscall_trace_count) syscall_trace_file.write(syscall_trace_buf, syscall_trace_count * sizeof(SyscallTraceRecord));
+  syscall_trace_count = 0;
+  syscall_trace_file.flush();
+}
+
+// The trace is reopened under config.syscall_trace_filename on the next syscall:
+static void close_syscall_trace() {
+  if unlikely (!syscall_trace_buf) return;
+  flush_syscall_trace();
+  syscall_trace_file.close();
+  delete[] syscall_trace_buf;
+  syscall_trace_buf = null;
+}
+
+static void trace_syscall(Context& ctx, int semantics, bool use64, int id, const W64* args, Waddr retaddr, W64 host_ticks) {
+  W64 host_ns = (W64)(ticks_to_seconds(host_ticks) * 1000000000.0);
+
+  if (use64) {
+    if likely ((unsigned)id < SYSCALL_NAME_COUNT_64BIT) {
+      stats.external.syscalls.calls64[id]++;
+      stats.external.syscalls.host_ns64[id] += host_ns;
+    } else {
+      stats.external.syscalls.unknown++;
+    }
+  } else {
+    if likely ((unsigned)id < SYSCALL_NAME_COUNT_32BIT) {
+      stats.external.syscalls.calls32[id]++;
+      stats.external.syscalls.host_ns32[id] += host_ns;
+    } else {
+      stats.external.syscalls.unknown++;
+    }
+  }
+
+  if likely (!config.syscall_trace_filename.set()) return;
+
+  if unlikely (!syscall_trace_buf) {
+    if (!syscall_trace_file.open(config.syscall_trace_filename)) {
+      logfile << "Cannot open syscall trace file '", config.syscall_trace_filename, "'", endl;
+      config.syscall_trace_filename.reset();
+      return;
+    }
+    config.syscall_trace_buffer_size = max(config.syscall_trace_buffer_size, (W64)1);
+    syscall_trace_buf = new SyscallTraceRecord[config.syscall_trace_buffer_size];
+  }
+
+  SyscallTraceRecord& rec = syscall_trace_buf[syscall_trace_count++];
+  rec.cycle = sim_cycle;
+  rec.host_ns = host_ns;
+  rec.rip = retaddr;
+  foreach (i, 6) rec.args[i] = args[i];
+  rec.rc = ctx.commitarf[REG_rax];
+  rec.id = id;
+  rec.semantics = semantics;
+  rec.use64 = use64;
+  rec.tid = current_guest_thread(ctx).tid;
+
+  if unlikely (syscall_trace_count >= config.syscall_trace_buffer_size) flush_syscall_trace();
+}
+
+//
+// Syscall record and replay
+//
+// With -record-syscalls, the result of every passthrough syscall is
+// logged together with the guest memory it wrote, as are rdtsc
+// results and file mmap contents. With -replay-syscalls, those
+// syscalls are not executed at all: the logged results and memory
+// are fed back, so the same execution can be replayed under many
+// core configurations without touching the host. Syscalls PTLsim
+// emulates itself (brk, mprotect, futex, ...) run in both modes.
+//
+// Replay is strictly sequential: a guest that takes a different path
+// (e.g. a different thread interleaving) is reported as diverged.
+//
+
+int replay_log_mode = REPLAY_LOG_OFF;
+
+static odstream replay_log_out;
+static idstream replay_log_in;
+static W64 replay_log_entries = 0;
+
+#define REPLAY_LOG_MAGIC 0x474f4c5359534c50ULL // "PLSYSLOG"
+
+enum { REPLAY_LOG_ENTRY_SYSCALL, REPLAY_LOG_ENTRY_RDTSC, REPLAY_LOG_ENTRY_MMAP };
+
+struct ReplayLogEntry {
+  W16 type;       // REPLAY_LOG_ENTRY_*
+  W16 id;         // syscall number
+  W32 blocks;     // ReplayLogBlocks (each followed by its data) after this entry
+  W64 value;      // syscall result or rdtsc value
+};
+
+struct ReplayLogBlock {
+  W64 addr;
+  W64 bytes;
+};
+
+//
+// Guest memory written by each x86-64 syscall on success:
+//
+enum {
+  REPLAY_OUT_FIXED,       // <size> bytes at args[arg]
+  REPLAY_OUT_RC_BYTES,    // rc bytes at args[arg]
+  REPLAY_OUT_RC_ELEMS,    // rc elements of <size> bytes at args[arg]
+  REPLAY_OUT_ARG_ELEMS,   // args[countarg] elements of <size> bytes at args[arg]
+  REPLAY_OUT_SOCKADDR,    // value-result length at args[countarg] for buffer args[arg]
+  REPLAY_OUT_IOV,         // rc bytes scattered over iovec array args[arg] of length args[countarg]
+  REPLAY_OUT_MSGHDR,      // struct msghdr at args[arg]
+  REPLAY_OUT_FDSETS,      // select(): three fd_sets of args[0] bits and the timeout at args[4]
+  REPLAY_OUT_IOCTL,       // the few ioctls with known output sizes
+  REPLAY_OUT_GETGROUPS,   // getgroups(): rc elements of <size> bytes at args[arg], unless args[0] is 0 (a count query)
+};
+
+struct ReplayLogOutput {
+  W16 id;
+  byte kind;
+  byte arg;
+  byte countarg;
+  W16 size;
+};
+
+static const ReplayLogOutput replay_log_outputs[] = {
+  {0,   REPLAY_OUT_RC_BYTES,  1, 0, 0},   // read
+  {4,   REPLAY_OUT_FIXED,     1, 0, 144}, // stat
+  {5,   REPLAY_OUT_FIXED,     1, 0, 144}, // fstat
+  {6,   REPLAY_OUT_FIXED,     1, 0, 144}, // lstat
+  {7,   REPLAY_OUT_ARG_ELEMS, 0, 1, 8},   // poll
+  {14,  REPLAY_OUT_ARG_ELEMS, 2, 3, 1},   // rt_sigprocmask
+  {16,  REPLAY_OUT_IOCTL,     2, 0, 0},   // ioctl
+  {17,  REPLAY_OUT_RC_BYTES,  1, 0, 0},   // pread64
+  {19,  REPLAY_OUT_IOV,       1, 2, 0},   // readv
+  {22,  REPLAY_OUT_FIXED,     0, 0, 8},   // pipe
+  {23,  REPLAY_OUT_FDSETS,    0, 0, 0},   // select
+  {35,  REPLAY_OUT_FIXED,     1, 0, 16},  // nanosleep
+  {36,  REPLAY_OUT_FIXED,     1, 0, 32},  // getitimer
+  {43,  REPLAY_OUT_SOCKADDR,  1, 2, 0},   // accept
+  {45,  REPLAY_OUT_RC_BYTES,  1, 0, 0},   // recvfrom
+  {45,  REPLAY_OUT_SOCKADDR,  4, 5, 0},
+  {47,  REPLAY_OUT_MSGHDR,    1, 0, 0},   // recvmsg
+  {51,  REPLAY_OUT_SOCKADDR,  1, 2, 0},   // getsockname
+  {52,  REPLAY_OUT_SOCKADDR,  1, 2, 0},   // getpeername
+  {53,  REPLAY_OUT_FIXED,     3, 0, 8},   // socketpair
+  {55,  REPLAY_OUT_SOCKADDR,  3, 4, 0},   // getsockopt
+  {61,  REPLAY_OUT_FIXED,     1, 0, 4},   // wait4
+  {61,  REPLAY_OUT_FIXED,     3, 0, 144},
+  {63,  REPLAY_OUT_FIXED,     0, 0, 390}, // uname
+  {78,  REPLAY_OUT_RC_BYTES,  1, 0, 0},   // getdents
+  {79,  REPLAY_OUT_RC_BYTES,  0, 0, 0},   // getcwd
+  {89,  REPLAY_OUT_RC_BYTES,  1, 0, 0},   // readlink
+  {96,  REPLAY_OUT_FIXED,     0, 0, 16},  // gettimeofday
+  {96,  REPLAY_OUT_FIXED,     1, 0, 8},
+  {97,  REPLAY_OUT_FIXED,     1, 0, 16},  // getrlimit
+  {98,  REPLAY_OUT_FIXED,     1, 0, 144}, // getrusage
+  {99,  REPLAY_OUT_FIXED,     0, 0, 112}, // sysinfo
+  {100, REPLAY_OUT_FIXED,     0, 0, 32},  // times
+  {115, REPLAY_OUT_GETGROUPS, 1, 0, 4},   // getgroups
+  {118, REPLAY_OUT_FIXED,     0, 0, 4},   // getresuid
+  {118, REPLAY_OUT_FIXED,     1, 0, 4},
+  {118, REPLAY_OUT_FIXED,     2, 0, 4},
+  {120, REPLAY_OUT_FIXED,     0, 0, 4},   // getresgid
+  {120, REPLAY_OUT_FIXED,     1, 0, 4},
+  {120, REPLAY_OUT_FIXED,     2, 0, 4},
+  {127, REPLAY_OUT_ARG_ELEMS, 0, 1, 1},   // rt_sigpending
+  {128, REPLAY_OUT_FIXED,     1, 0, 128}, // rt_sigtimedwait
+  {137, REPLAY_OUT_FIXED,     1, 0, 120}, // statfs
+  {138, REPLAY_OUT_FIXED,     1, 0, 120}, // fstatfs
+  {201, REPLAY_OUT_FIXED,     0, 0, 8},   // time
+  {204, REPLAY_OUT_RC_BYTES,  2, 0, 0},   // sched_getaffinity
+  {217, REPLAY_OUT_RC_BYTES,  1, 0, 0},   // getdents64
+  {228, REPLAY_OUT_FIXED,     1, 0, 16},  // clock_gettime
+  {229, REPLAY_OUT_FIXED,     1, 0, 16},  // clock_getres
+  {230, REPLAY_OUT_FIXED,     3, 0, 16},  // clock_nanosleep
+  {232, REPLAY_OUT_RC_ELEMS,  1, 0, 12},  // epoll_wait
+  {262, REPLAY_OUT_FIXED,     2, 0, 144}, // newfstatat
+  {267, REPLAY_OUT_RC_BYTES,  2, 0, 0},   // readlinkat
+  {270, REPLAY_OUT_FDSETS,    0, 0, 0},   // pselect6
+  {271, REPLAY_OUT_ARG_ELEMS, 0, 1, 8},   // ppoll
+  {281, REPLAY_OUT_RC_ELEMS,  1, 0, 12},  // epoll_pwait
+  {288, REPLAY_OUT_SOCKADDR,  1, 2, 0},   // accept4
+  {293, REPLAY_OUT_FIXED,     0, 0, 8},   // pipe2
+  {295, REPLAY_OUT_IOV,       1, 2, 0},   // preadv
+  {302, REPLAY_OUT_FIXED,     3, 0, 16},  // prlimit64
+  {318, REPLAY_OUT_RC_BYTES,  0, 0, 0},   // getrandom
+};
+
+// Value-result lengths must be captured before the syscall overwrites them:
+static W32 replay_log_sockaddr_len[4];
+
+static void replay_log_prepare_syscall(int id, const W64* args) {
+  int n = 0;
+  foreach (i, lengthof(replay_log_outputs)) {
+    const ReplayLogOutput& out = replay_log_outputs[i];
+    if likely ((out.id != id) | (out.kind != REPLAY_OUT_SOCKADDR)) continue;
+    W32* lenp = (W32*)args[out.countarg];
+    replay_log_sockaddr_len[n++] = (lenp && asp.check(lenp, PROT_READ)) ? *lenp : 0;
+  }
+}
+
+static void replay_log_add_block(dynarray<ReplayLogBlock>& blocks, W64 addr, W64 bytes) {
+  if ((!addr) | (!bytes)) return;
+  ReplayLogBlock block;
+  block.addr = addr;
+  block.bytes = bytes;
+  blocks.push(block);
+}
+
+static void replay_log_add_iov(dynarray<ReplayLogBlock>& blocks, W64* iov, W64 count, W64 bytes) {
+  if unlikely (!asp.check(iov, PROT_READ)) return;
+  foreach (i, count) {
+    if (!bytes) break;
+    W64 n = min(bytes, iov[i*2 + 1]);
+    replay_log_add_block(blocks, iov[i*2 + 0], n);
+    bytes -= n;
+  }
+}
+
+static void replay_log_collect_outputs(dynarray<ReplayLogBlock>& blocks, int id, const W64* args, W64 rc) {
+  int n = 0;
+
+  foreach (i, lengthof(replay_log_outputs)) {
+    const ReplayLogOutput& out = replay_log_outputs[i];
+    if likely (out.id != id) continue;
+    W64 p = args[out.arg];
+
+    switch (out.kind) {
+    case REPLAY_OUT_FIXED:
+      replay_log_add_block(blocks, p, out.size); break;
+    case REPLAY_OUT_RC_BYTES:
+      replay_log_add_block(blocks, p, rc); break;
+    case REPLAY_OUT_RC_ELEMS:
+      replay_log_add_block(blocks, p, rc * out.size); break;
+    case REPLAY_OUT_ARG_ELEMS:
+      replay_log_add_block(blocks, p, args[out.countarg] * out.size); break;
+    case REPLAY_OUT_SOCKADDR: {
+      W32 prelen = replay_log_sockaddr_len[n++];
+      W32* lenp = (W32*)args[out.countarg];
+      if ((!lenp) || (!asp.check(lenp, PROT_READ))) break;
+      replay_log_add_block(blocks, p, min(prelen, *lenp));
+      replay_log_add_block(blocks, (Waddr)lenp, sizeof(W32));
+      break;
+    }
+    case REPLAY_OUT_IOV:
+      replay_log_add_iov(blocks, (W64*)p, args[out.countarg], rc); break;
+    case REPLAY_OUT_MSGHDR: {
+      W64* msg = (W64*)p;
+      if unlikely (!asp.check(msg, PROT_READ)) break;
+      // msg_name, msg_namelen, msg_iov, msg_iovlen, msg_control, msg_controllen, msg_flags
+      replay_log_add_block(blocks, msg[0], LO32(msg[1]));
+      replay_log_add_iov(blocks, (W64*)msg[2], msg[3], rc);
+      replay_log_add_block(blocks, msg[4], msg[5]);
+      replay_log_add_block(blocks, p, 7*8);
+      break;
+    }
+    case REPLAY_OUT_FDSETS: {
+      W64 bytes = ceil((args[0] + 7) / 8, 8);
+      foreach (j, 3) replay_log_add_block(blocks, args[1+j], bytes);
+      replay_log_add_block(blocks, args[4], 16);
+      break;
+    }
+    case REPLAY_OUT_IOCTL: {
+      switch (args[1]) {
+      case 0x5401: replay_log_add_block(blocks, p, 36); break; // TCGETS
+      case 0x540f: replay_log_add_block(blocks, p, 4); break;  // TIOCGPGRP
+      case 0x5413: replay_log_add_block(blocks, p, 8); break;  // TIOCGWINSZ
+      case 0x541b: replay_log_add_block(blocks, p, 4); break;  // FIONREAD
+      }
+      break;
+    }
+    case REPLAY_OUT_GETGROUPS:
+      if (args[0]) replay_log_add_block(blocks, p, rc * out.size);
+      break;
+    }
+  }
+}
+
+static void replay_log_write(int type, int id, W64 value, const dynarray<ReplayLogBlock>& blocks) {
+  ReplayLogEntry entry;
+  entry.type = type;
+  entry.id = id;
+  entry.blocks = blocks.length;
+  entry.value = value;
+  replay_log_out << entry;
+
+  foreach (i, blocks.length) {
+    const ReplayLogBlock& block = blocks.data[i];
+    replay_log_out << block;
+    replay_log_out.write((void*)block.addr, block.bytes);
+  }
+
+  replay_log_entries++;
+}
+
+static void replay_log_diverged(const char* why, int type, int id) {
+  logfile << "Replay diverged from the log at entry ", replay_log_entries, " (", why, ": type ", type, ", id ", id, ") at ",
+    total_user_insns_committed, " commits; aborting", endl, flush;
+  cerr << "Replay diverged from the log at entry ", replay_log_entries, " (", why, "); aborting", endl, flush;
+  replay_log_mode = REPLAY_LOG_OFF;
+  user_process_terminated(1);
+}
+
+// Read the next entry, which must match <type> and <id>, and copy its blocks into guest memory:
+static W64 replay_log_read(int type, int id) {
+  ReplayLogEntry entry;
+  if unlikely (replay_log_in.read(&entry, sizeof(entry)) != sizeof(entry)) replay_log_diverged("end of log", type, id);
+  if unlikely ((entry.type != type) | (entry.id != id)) replay_log_diverged("unexpected entry", entry.type, entry.id);
+
+  foreach (i, entry.blocks) {
+    ReplayLogBlock block;
+    replay_log_in >> block;
+    byte* p = (byte*)block.addr;
+    if unlikely ((!asp.check(p, PROT_WRITE)) | (!asp.check(p + block.bytes - 1, PROT_WRITE))) replay_log_diverged("unwritable block", type, id);
+    if unlikely (replay_log_in.read(p, block.bytes) != (int)block.bytes) replay_log_diverged("truncated block", type, id);
+  }
+
+  replay_log_entries++;
+  return entry.value;
+}
+
+static void init_replay_log() {
+  static bool initialized = 0;
+  if likely (initialized) return;
+  initialized = 1;
+
+  if (config.syscall_replay_filename.set()) {
+    W64 magic = 0;
+    if ((!replay_log_in.open(config.syscall_replay_filename)) || (replay_log_in.read(&magic, sizeof(magic)) != sizeof(magic)) || (magic != REPLAY_LOG_MAGIC)) {
+      logfile << "Cannot open syscall replay log '", config.syscall_replay_filename, "'", endl, flush;
+      cerr << "Cannot open syscall replay log '", config.syscall_replay_filename, "'", endl, flush;
+      user_process_terminated(1);
+    }
+    replay_log_mode = REPLAY_LOG_REPLAY;
+    logfile << "Replaying syscalls from ", config.syscall_replay_filename, endl;
+  } else if (config.syscall_record_filename.set()) {
+    if (!replay_log_out.open(config.syscall_record_filename)) {
+      logfile << "Cannot open syscall record log '", config.syscall_record_filename, "'", endl, flush;
+      return;
+    }
+    W64 magic = REPLAY_LOG_MAGIC;
+    replay_log_out << magic;
+    replay_log_mode = REPLAY_LOG_RECORD;
+    logfile << "Recording syscalls to ", config.syscall_record_filename, endl;
+  }
+
+  //
+  // The first guest thread keeps its host tid (the pid), which the
+  // guest sees through gettid() and set_tid_address(); later threads
+  // get virtual tids. Log it like a passthrough gettid() result:
+  //
+  if (replay_log_mode == REPLAY_LOG_REPLAY) {
+    guest_threads[0].tid = replay_log_read(REPLAY_LOG_ENTRY_SYSCALL, __NR_64bit_gettid);
+  } else if (replay_log_mode == REPLAY_LOG_RECORD) {
+    dynarray<ReplayLogBlock> noblocks;
+    replay_log_write(REPLAY_LOG_ENTRY_SYSCALL, __NR_64bit_gettid, guest_threads[0].tid, noblocks);
+  }
+}
+
+static void flush_replay_log() {
+  if (replay_log_mode == REPLAY_LOG_RECORD) replay_log_out.flush();
+}
+
+//
+// Sample children (see simulate_sampled) must not append to the
+// parent's log, nor move the parent's read offset in the replay log.
+//
+static void reopen_replay_log_after_fork() {
+  if (replay_log_mode == REPLAY_LOG_RECORD) {
+    // Already flushed before the fork; the child runs its syscalls for real:
+    replay_log_out.close();
+    replay_log_mode = REPLAY_LOG_OFF;
+  } else if (replay_log_mode == REPLAY_LOG_REPLAY) {
+    W64 offset = replay_log_in.where();
+    replay_log_in.close();
+    replay_log_in.open(config.syscall_replay_filename);
+    replay_log_in.seek(offset);
+  }
+}
+
+W64 replay_log_rdtsc(W64 tsc) {
+  static dynarray<ReplayLogBlock> noblocks;
+  if (replay_log_mode == REPLAY_LOG_REPLAY) return replay_log_read(REPLAY_LOG_ENTRY_RDTSC, 0);
+  replay_log_write(REPLAY_LOG_ENTRY_RDTSC, 0, tsc, noblocks);
+  return tsc;
+}
+
+#ifdef __x86_64__
+//
+// Passthrough x86-64 syscall: executed and logged, or replayed from the log.
+//
+static W64 replay_log_syscall_64bit(int id, const W64* args) {
+  if (replay_log_mode == REPLAY_LOG_REPLAY) return replay_log_read(REPLAY_LOG_ENTRY_SYSCALL, id);
+
+  replay_log_prepare_syscall(id, args);
+  W64 rc = do_syscall_64bit(id, args[0], args[1], args[2], args[3], args[4], args[5]);
+
+  dynarray<ReplayLogBlock> blocks;
+  if ((W64s)rc >= 0) replay_log_collect_outputs(blocks, id, args, rc);
+  replay_log_write(REPLAY_LOG_ENTRY_SYSCALL, id, rc, blocks);
+  return rc;
+}
+#endif
+
+//
+// mmap: anonymous mappings are re-created at the logged address;
+// file mappings are replaced by anonymous ones holding the logged
+// file contents, since replay never opens the file.
+//
+static W64 replay_log_mmap(void* addr, W64 length, int prot, int flags, int fd, W64 offset) {
+  static const int MAP_FIXED_NOREPLACE_FLAG = 0x100000;
+  dynarray<ReplayLogBlock> blocks;
+
+  if (replay_log_mode == REPLAY_LOG_RECORD) {
+    W64 rc = (W64)asp.mmap(addr, length, prot, flags, fd, offset);
+    if ((!(flags & MAP_ANONYMOUS)) && (!mmap_invalid((void*)rc))) {
+      //
+      // Only the part backed by the file is readable: pages past the
+      // end of the file (ld.so maps whole images this way) would fault
+      // with SIGBUS, so the log skips them and replay leaves them zero.
+      //
+      struct stat st;
+      W64 filebytes = ((sys_fstat(fd, &st) == 0) && ((W64)st.st_size > offset)) ? ceil((W64)st.st_size - offset, PAGE_SIZE) : 0;
+      W64 limit = min(filebytes, length);
+      W64 bytes = 0;
+      while ((bytes < limit) && asp.check((byte*)rc + bytes, PROT_READ)) bytes += PAGE_SIZE;
+      replay_log_add_block(blocks, rc, min(bytes, limit));
+    }
+    replay_log_write(REPLAY_LOG_ENTRY_MMAP, 0, rc, blocks);
+    return rc;
+  }
+
+  ReplayLogEntry entry;
+  if unlikely (replay_log_in.read(&entry, sizeof(entry)) != sizeof(entry)) replay_log_diverged("end of log", REPLAY_LOG_ENTRY_MMAP, 0);
+  if unlikely (entry.type != REPLAY_LOG_ENTRY_MMAP) replay_log_diverged("unexpected entry", entry.type, entry.id);
+  if (mmap_invalid((void*)entry.value)) {
+    replay_log_entries++;
+    return entry.value;
+  }
+
+  int anonflags = (flags & ~MAP_SHARED) | MAP_PRIVATE | MAP_ANONYMOUS;
+  if (!(flags & MAP_FIXED)) anonflags |= MAP_FIXED_NOREPLACE_FLAG;
+  W64 rc = (W64)asp.mmap((void*)entry.value, length, prot | PROT_READ | PROT_WRITE, anonflags, -1, 0);
+  if unlikely (rc != entry.value) replay_log_diverged("mmap address", REPLAY_LOG_ENTRY_MMAP, 0);
+
+  foreach (i, entry.blocks) {
+    ReplayLogBlock block;
+    replay_log_in >> block;
+    if unlikely (replay_log_in.read((void*)block.addr, block.bytes) != (int)block.bytes) replay_log_diverged("truncated block", entry.type, entry.id);
+  }
+
+  if ((prot & (PROT_READ|PROT_WRITE)) != (PROT_READ|PROT_WRITE)) asp.mprotect((void*)rc, length, prot);
+
+  replay_log_entries++;
+  return rc;
+}
+
+#ifdef __x86_64__
+
+//
+// SYSCALL instruction from x86-64 mode
+//
+
+void handle_syscall_64bit(Context& ctx) {
+  bool DEBUG = config.log_syscalls; //analyze_in_detail();
+  W64 host_start = rdtsc();
+  //
+  // Handle an x86-64 syscall:
+  // (This is called from the assist_syscall ucode assist)
+  //
+
+  int syscallid = ctx.commitarf[REG_rax];
+  W64 arg1 = ctx.commitarf[REG_rdi];
+  W64 arg2 = ctx.commitarf[REG_rsi];
+  W64 arg3 = ctx.commitarf[REG_rdx];
+  W64 arg4 = ctx.commitarf[REG_r10];
+  W64 arg5 = ctx.commitarf[REG_r8];
+  W64 arg6 = ctx.commitarf[REG_r9];
+
+  if (DEBUG) 
+    logfile << "handle_syscall -> (#", syscallid, " ", ((syscallid < lengthof(syscall_names_64bit)) ? syscall_names_64bit[syscallid] : "???"), 
+      ") from ", (void*)ctx.commitarf[REG_rcx], " args ", " (", (void*)arg1, ", ", (void*)arg2, ", ", (void*)arg3, ", ", (void*)arg4, ", ",
+      (void*)arg5, ", ", (void*)arg6, ") at iteration ", iterations, endl, flush;
+
+  switch (syscallid) {
+  case __NR_64bit_mmap:
+    if unlikely (replay_log_mode) {
+      ctx.commitarf[REG_rax] = replay_log_mmap((void*)arg1, arg2, arg3, arg4, arg5, arg6);
+      break;
+    }
+    ctx.commitarf[REG_rax] = (W64)asp.mmap((void*)arg1, arg2, arg3, arg4, arg5, arg6);
+    break;
+  case __NR_64bit_munmap:
+    ctx.commitarf[REG_rax] = asp.munmap((void*)arg1, arg2);
+    break;
+  case __NR_64bit_mprotect:
+    ctx.commitarf[REG_rax] = asp.mprotect((void*)arg1, arg2, arg3);
+    break;
+  case __NR_64bit_brk:
+    ctx.commitarf[REG_rax] = (W64)asp.setbrk((void*)arg1);
+    break;
+  case __NR_64bit_mremap: {
+    ctx.commitarf[REG_rax] = (W64)asp.mremap((void*)arg1, arg2, arg3, arg4);
+    break;
+  }
+  case __NR_64bit_arch_prctl: {
+    // We need to trap this so we can virtualize ARCH_SET_FS and ARCH_SET_GS:
+    ctx.commitarf[REG_rax] = sys_arch_prctl(arg1, (void*)arg2);
+    ctx.update_shadow_segment_descriptors();
+    switch (arg1) {
+    case ARCH_SET_FS:
+      ctx.seg[SEGID_FS].base = arg2;
+      logfile << "arch_prctl: set FS base to ", (void*)ctx.seg[SEGID_FS].base, endl;
+      break;
+    case ARCH_SET_GS:
+      ctx.seg[SEGID_GS].base = arg2;
+      logfile << "arch_prctl: set GS base to ", (void*)ctx.seg[SEGID_GS].base, endl;
+      break;
+    }
+    break;
+  }
+  case __NR_64bit_exit: {
+    logfile << "handle_syscall at iteration ", iterations, ": exit(): exiting with arg ", (W64s)arg1, "...", endl, flush;
+    exit_guest_thread(ctx, (int)arg1);
+    ctx.commitarf[REG_rax] = 0;
+    break;
+  }
+  case __NR_64bit_exit_group: {
     logfile << "handle_syscall at iteration ", iterations, ": exit_group(): exiting with arg ", (W64s)arg1, "...", endl, flush;
     user_process_terminated((int)arg1);
   }
@@ -1116,7 +2544,42 @@ void handle_syscall_64bit() {
 #endif
     break;
   }
+  case __NR_64bit_clone: {
+    if ((arg1 & (GUEST_CLONE_VM|GUEST_CLONE_THREAD)) == (GUEST_CLONE_VM|GUEST_CLONE_THREAD)) {
+      ctx.commitarf[REG_rax] = clone_guest_thread(ctx, arg1, arg2, arg3, arg4, arg5, ctx.commitarf[REG_rcx]);
+    } else {
+      ctx.commitarf[REG_rax] = do_syscall_64bit(syscallid, arg1, arg2, arg3, arg4, arg5, arg6);
+    }
+    break;
+  }
+  case __NR_64bit_futex:
+    ctx.commitarf[REG_rax] = handle_guest_futex(ctx, arg1, arg2, arg3, arg4, arg5, arg6, false);
+    break;
+  case __NR_64bit_gettid:
+    ctx.commitarf[REG_rax] = current_guest_thread(ctx).tid;
+    break;
+  case __NR_64bit_set_tid_address:
+    current_guest_thread(ctx).clear_child_tid = arg1;
+    ctx.commitarf[REG_rax] = current_guest_thread(ctx).tid;
+    break;
+  case __NR_64bit_sched_yield:
+    guest_thread_switch_pending = (live_guest_threads > 1);
+    ctx.commitarf[REG_rax] = 0;
+    break;
   default:
+    if unlikely (replay_log_mode) {
+      W64 args[6] = {arg1, arg2, arg3, arg4, arg5, arg6};
+      ctx.commitarf[REG_rax] = replay_log_syscall_64bit(syscallid, args);
+      break;
+    }
+    if (config.virtual_sleep) {
+      W64 args[4] = {arg1, arg2, arg3, arg4};
+      W64 rc;
+      if (handle_guest_sleep(ctx, syscallid, args, false, rc)) {
+        ctx.commitarf[REG_rax] = rc;
+        break;
+      }
+    }
     ctx.commitarf[REG_rax] = do_syscall_64bit(syscallid, arg1, arg2, arg3, arg4, arg5, arg6);
     break;
   }
@@ -1124,6 +2587,11 @@ void handle_syscall_64bit() {
   ctx.commitarf[REG_rip] = ctx.commitarf[REG_rcx];
 
   if (DEBUG) logfile << "handle_syscall: result ", ctx.commitarf[REG_rax], " (", (void*)ctx.commitarf[REG_rax], "); returning to ", (void*)ctx.commitarf[REG_rip], endl, flush;
+
+  W64 args[6] = {arg1, arg2, arg3, arg4, arg5, arg6};
+  trace_syscall(ctx, SYSCALL_SEMANTICS_SYSCALL, true, syscallid, args, ctx.commitarf[REG_rip], rdtsc() - host_start);
+
+  finish_guest_thread_syscall(ctx);
 }
 
 #endif // __x86_64__
@@ -1137,8 +2605,6 @@ struct old_mmap32_arg_struct {
   W32 offset;
 };
 
-const char* syscall_names_32bit[] = {"restart_syscall", "exit", "fork", "read", "write", "open", "close", "waitpid", "creat", "link", "unlink", "execve", "chdir", "time", "mknod", "chmod", "lchown", "break", "oldstat", "lseek", "getpid", "mount", "umount", "setuid", "getuid", "stime", "ptrace", "alarm", "oldfstat", "pause", "utime", "stty", "gtty", "access", "nice", "ftime", "sync", "kill", "rename", "mkdir", "rmdir", "dup", "pipe", "times", "prof", "brk", "setgid", "getgid", "signal", "geteuid", "getegid", "acct", "umount2", "lock", "ioctl", "fcntl", "mpx", "setpgid", "ulimit", "oldolduname", "umask", "chroot", "ustat", "dup2", "getppid", "getpgrp", "setsid", "sigaction", "sgetmask", "ssetmask", "setreuid", "setregid", "sigsuspend", "sigpending", "sethostname", "setrlimit", "getrlimit", "getrusage", "gettimeofday", "settimeofday", "getgroups", "setgroups", "select", "symlink", "oldlstat", "readlink", "uselib", "swapon", "reboot", "readdir", "mmap", "munmap", "truncate", "ftruncate", "fchmod", "fchown", "getpriority", "setpriority", "profil", "statfs", "fstatfs", "ioperm", "socketcall", "syslog", "setitimer", "getitimer", "stat", "lstat", "fstat", "olduname", "iopl", "vhangup", "idle", "vm86old", "wait4", "swapoff", "sysinfo", "ipc", "fsync", "sigreturn", "clone", "setdomainname", "uname", "modify_ldt", "adjtimex", "mprotect", "sigprocmask", "create_module", "init_module", "delete_module", "get_kernel_syms", "quotactl", "getpgid", "fchdir", "bdflush", "sysfs", "personality", "afs_syscall", "setfsuid", "setfsgid", "_llseek", "getdents", "_newselect", "flock", "msync", "readv", "writev", "getsid", "fdatasync", "_sysctl", "mlock", "munlock", "mlockall", "munlockall", "sched_setparam", "sched_getparam", "sched_setscheduler", "sched_getscheduler", "sched_yield", "sched_get_priority_max", "sched_get_priority_min", "sched_rr_get_interval", "nanosleep", "mremap", "setresuid", "getresuid", "vm86", "query_module", "poll", "nfsservctl", "setresgid", "getresgid", "prctl", "rt_sigreturn", "rt_sigaction", "rt_sigprocmask", "rt_sigpending", "rt_sigtimedwait", "rt_sigqueueinfo", "rt_sigsuspend", "pread64", "pwrite64", "chown", "getcwd", "capget", "capset", "sigaltstack", "sendfile", "getpmsg", "putpmsg", "vfork", "ugetrlimit", "mmap2", "truncate64", "ftruncate64", "stat64", "lstat64", "fstat64", "lchown32", "getuid32", "getgid32", "geteuid32", "getegid32", "setreuid32", "setregid32", "getgroups32", "setgroups32", "fchown32", "setresuid32", "getresuid32", "setresgid32", "getresgid32", "chown32", "setuid32", "setgid32", "setfsuid32", "setfsgid32", "pivot_root", "mincore", "madvise", "madvise1", "getdents64", "fcntl64", "<unused>", "<unused>", "gettid", "readahead", "setxattr", "lsetxattr", "fsetxattr", "getxattr", "lgetxattr", "fgetxattr", "listxattr", "llistxattr", "flistxattr", "removexattr", "lremovexattr", "fremovexattr", "tkill", "sendfile64", "futex", "sched_setaffinity", "sched_getaffinity", "set_thread_area", "get_thread_area", "io_setup", "io_destroy", "io_getevents", "io_submit", "io_cancel", "fadvise64", "<unused>", "exit_group", "lookup_dcookie", "epoll_create", "epoll_ctl", "epoll_wait", "remap_file_pages", "set_tid_address", "timer_create", "statfs64", "fstatfs64", "tgkill", "utimes", "fadvise64_64", "vserver", "mbind", "get_mempolicy", "set_mempolicy", "mq_open", "sys_kexec_load", "waitid"};
-
 W32 sysenter_retaddr = 0;
 
 W32 get_sysenter_retaddr(W32 end_of_sysenter_insn) {
@@ -1155,8 +2621,9 @@ W32 get_sysenter_retaddr(W32 end_of_sysenter_insn) {
   return sysenter_retaddr;
 }
 
-void handle_syscall_32bit(int semantics) {
-  bool DEBUG = 1; //analyze_in_detail();
+void handle_syscall_32bit(Context& ctx, int semantics) {
+  bool DEBUG = config.log_syscalls; //analyze_in_detail();
+  W64 host_start = rdtsc();
   //
   // Handle a 32-bit syscall:
   // (This is called from the assist_syscall ucode assist)
@@ -1164,6 +2631,13 @@ void handle_syscall_32bit(int semantics) {
 
   static const char* semantics_name[] = {"int80", "syscall", "sysenter"};
 
+  if unlikely (replay_log_mode) {
+    logfile << "Syscall record and replay only supports x86-64 guests", endl, flush;
+    cerr << "Syscall record and replay only supports x86-64 guests", endl, flush;
+    if (replay_log_mode == REPLAY_LOG_REPLAY) replay_log_diverged("32-bit syscall", REPLAY_LOG_ENTRY_SYSCALL, LO32(ctx.commitarf[REG_rax]));
+    replay_log_mode = REPLAY_LOG_OFF;
+  }
+
   int syscallid;
   W32 arg1, arg2, arg3, arg4, arg5, arg6;
   W32 retaddr;
@@ -1282,7 +2756,9 @@ void handle_syscall_32bit(int semantics) {
     break;
   case __NR_32bit_exit: {
     logfile << "handle_syscall at iteration ", iterations, ": exit(): exiting with arg ", (W64s)arg1, "...", endl, flush;
-    user_process_terminated((int)arg1);
+    exit_guest_thread(ctx, (int)arg1);
+    ctx.commitarf[REG_rax] = 0;
+    break;
   }
   case __NR_32bit_exit_group: {
     logfile << "handle_syscall at iteration ", iterations, ": exit_group(): exiting with arg ", (W64s)arg1, "...", endl, flush;
@@ -1325,13 +2801,49 @@ void handle_syscall_32bit(int semantics) {
     ctx.commitarf[REG_rax] = (Waddr)asp.mmap((void*)(Waddr)mm->addr, mm->len, mm->prot, mm->flags, mm->fd, mm->offset);
     break;
   }
+  case __NR_32bit_clone: {
+    // Note the i386 argument order: flags, newsp, parent_tid, tls, child_tid
+    if ((arg1 & (GUEST_CLONE_VM|GUEST_CLONE_THREAD)) == (GUEST_CLONE_VM|GUEST_CLONE_THREAD)) {
+      ctx.commitarf[REG_rax] = (W32)clone_guest_thread(ctx, arg1, arg2, arg3, arg5, arg4, retaddr);
+    } else {
+      ctx.commitarf[REG_rax] = do_syscall_32bit(syscallid, arg1, arg2, arg3, arg4, arg5, arg6);
+    }
+    break;
+  }
+  case __NR_32bit_futex:
+    ctx.commitarf[REG_rax] = (W32)handle_guest_futex(ctx, arg1, arg2, arg3, arg4, arg5, arg6, true);
+    break;
+  case __NR_32bit_gettid:
+    ctx.commitarf[REG_rax] = current_guest_thread(ctx).tid;
+    break;
+  case __NR_32bit_set_tid_address:
+    current_guest_thread(ctx).clear_child_tid = arg1;
+    ctx.commitarf[REG_rax] = current_guest_thread(ctx).tid;
+    break;
+  case __NR_32bit_sched_yield:
+    guest_thread_switch_pending = (live_guest_threads > 1);
+    ctx.commitarf[REG_rax] = 0;
+    break;
   default:
+    if (config.virtual_sleep) {
+      W64 args[4] = {arg1, arg2, arg3, arg4};
+      W64 rc;
+      if (handle_guest_sleep(ctx, syscallid, args, true, rc)) {
+        ctx.commitarf[REG_rax] = (W32)rc;
+        break;
+      }
+    }
     ctx.commitarf[REG_rax] = do_syscall_32bit(syscallid, arg1, arg2, arg3, arg4, arg5, arg6);
     break;
   }
   ctx.commitarf[REG_rip] = retaddr;
 
   if (DEBUG) logfile << "handle_syscall: result ", ctx.commitarf[REG_rax], " (", (void*)(Waddr)ctx.commitarf[REG_rax], "); returning to ", (void*)(Waddr)ctx.commitarf[REG_rip], endl, flush;
+
+  W64 args[6] = {arg1, arg2, arg3, arg4, arg5, arg6};
+  trace_syscall(ctx, semantics, false, syscallid, args, retaddr, rdtsc() - host_start);
+
+  finish_guest_thread_syscall(ctx);
 }
 
 const char* ptlcall_names[PTLCALL_COUNT] = {"nop", "marker", "switch_to_sim", "switch_to_native", "capture_stats"};
@@ -1351,85 +2863,382 @@ W64 handle_ptlcall(W64 rip, W64 callid, W64 arg1, W64 arg2, W64 arg3, W64 arg4,
   case PTLCALL_MARKER: {
     logfile << "  MARKER: iteration ", iterations, ", cycle ", sim_cycle, ", user commits ", total_user_insns_committed, endl;
     break;
-  };
-  case PTLCALL_SWITCH_TO_SIM: {
-    logfile << "  WARNING: already running in simulation mode", endl;
-    return (W64)(-EINVAL);
+  };
+  case PTLCALL_SWITCH_TO_SIM: {
+    logfile << "  WARNING: already running in simulation mode", endl;
+    return (W64)(-EINVAL);
+  }
+  case PTLCALL_CAPTURE_STATS: {
+    const char* snapshotname = (const char*)(Waddr)arg1;
+    if (asp.check((void*)snapshotname, PROT_READ)) {
+      capture_stats_snapshot(snapshotname);
+    } else {
+      logfile << "WARNING: invalid snapshotname pointer (", snapshotname, "); using default snapshot ID", endl;
+      capture_stats_snapshot(null);
+    }
+    break;
+  }
+  case PTLCALL_SWITCH_TO_NATIVE: {
+    logfile << "  Switching to native mode at rip ", (void*)(Waddr)rip, endl;
+    requested_switch_to_native = 1;
+    break;
+  }
+  }
+  return 0;
+}
+
+// This is where we end up after issuing opcode 0x0f37 (undocumented x86 PTL call opcode)
+void assist_ptlcall(Context& ctx) {
+  ctx.commitarf[REG_rax] = handle_ptlcall(ctx.commitarf[REG_nextrip], ctx.commitarf[REG_rdi], ctx.commitarf[REG_rsi], ctx.commitarf[REG_rdx], ctx.commitarf[REG_rcx], ctx.commitarf[REG_r8], ctx.commitarf[REG_r9]);
+  ctx.commitarf[REG_rip] = ctx.commitarf[REG_nextrip];
+}
+
+//
+// Get the processor core frequency in cycles/second:
+//
+static W64 core_freq_hz = 0;
+
+W64 get_core_freq_hz() {
+  if likely (core_freq_hz) return core_freq_hz;
+
+  W64 hz = 0;
+
+  istream cpufreqis("/sys/devices/system/cpu/cpu0/cpufreq/cpuinfo_max_freq");
+  if (cpufreqis) {
+    char s[256];
+    cpufreqis >> readline(s, sizeof(s));      
+    
+    int khz;
+    int n = sscanf(s, "%d", &khz);
+    
+    if (n == 1) {
+      hz = (W64)khz * 1000;
+      core_freq_hz = hz;
+      return hz;
+    }
+  }
+  
+  istream is("/proc/cpuinfo");
+  
+  if (!is) {
+    cerr << "get_core_freq_hz(): warning: cannot open /proc/cpuinfo. Is this a Linux machine?", endl;
+    core_freq_hz = hz;
+    return hz;
+  }
+  
+  while (is) {
+    char s[256];
+    is >> readline(s, sizeof(s));
+    
+    int mhz;
+    int n = sscanf(s, "cpu MHz : %d", &mhz);
+    if (n == 1) {
+      hz = (W64)mhz * 1000000;
+      core_freq_hz = hz;
+      return hz;
+    }
+  }
+
+  // Can't read either of these procfiles: abort
+  assert(false);
+  return 0;
+}
+
+//
+// Simulated time: host time at the first query, advanced from then
+// on only by sim_cycle at the core frequency.
+//
+static W64 sim_realtime_base_ns = 0;
+static W64 sim_monotonic_base_ns = 0;
+static bool sim_time_base_valid = 0;
+
+W64 sim_cycles_to_ns(W64 cycles) {
+  W64 hz = sim_core_freq_hz();
+  return ((cycles / hz) * 1000000000ULL) + (((cycles % hz) * 1000000000ULL) / hz);
+}
+
+//
+// Returns false for clocks that do not follow simulated time
+// (process and thread CPU time clocks and the like).
+//
+bool get_simulated_time(int clock, W64& ns) {
+  bool realtime;
+
+  switch (clock) {
+  case CLOCK_REALTIME:
+  case CLOCK_REALTIME_COARSE:
+    realtime = 1; break;
+  case CLOCK_MONOTONIC:
+  case CLOCK_MONOTONIC_RAW:
+  case CLOCK_MONOTONIC_COARSE:
+  case CLOCK_BOOTTIME:
+    realtime = 0; break;
+  default:
+    return false;
+  }
+
+  W64 elapsed = sim_cycles_to_ns(sim_cycle);
+
+  if unlikely (!sim_time_base_valid) {
+    timespec ts;
+    sys_clock_gettime(CLOCK_REALTIME, &ts);
+    sim_realtime_base_ns = ((W64)ts.tv_sec * 1000000000ULL) + ts.tv_nsec - elapsed;
+    sys_clock_gettime(CLOCK_MONOTONIC, &ts);
+    sim_monotonic_base_ns = ((W64)ts.tv_sec * 1000000000ULL) + ts.tv_nsec - elapsed;
+    sim_time_base_valid = 1;
+  }
+
+  ns = ((realtime) ? sim_realtime_base_ns : sim_monotonic_base_ns) + elapsed;
+  return true;
+}
+
+//
+// Called on every switch back to simulation: while running natively
+// the guest read host time, which may be ahead of the simulated clock,
+// so restart the simulated clock from the later of the two to keep it
+// monotonic.
+//
+static void rebase_simulated_time() {
+  if (!sim_time_base_valid) return;
+
+  W64 elapsed = sim_cycles_to_ns(sim_cycle);
+  timespec ts;
+
+  sys_clock_gettime(CLOCK_REALTIME, &ts);
+  W64 host = ((W64)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+  sim_realtime_base_ns = max(host, sim_realtime_base_ns + elapsed) - elapsed;
+
+  sys_clock_gettime(CLOCK_MONOTONIC, &ts);
+  host = ((W64)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+  sim_monotonic_base_ns = max(host, sim_monotonic_base_ns + elapsed) - elapsed;
+}
+
+//
+// Emulated vDSO
+//
+// The host vDSO is hidden from the guest (see copy_args_env_auxv()):
+// its time functions read kernel data pages and execute rdtsc, which
+// is slow to simulate and returns host rather than simulated time.
+// Instead 64-bit guests get this minimal vDSO image exporting
+// clock_gettime, gettimeofday and time (plus their __vdso_ aliases).
+// In native mode each function is just the corresponding syscall; in
+// simulation the decoder turns each entry point into one assist that
+// returns simulated time. While recording or replaying syscalls, the
+// real syscalls are simulated instead so the log stays complete.
+//
+#define PTLSIM_VDSO_PAGE (PTLSIM_THUNK_PAGE + 4*PAGE_SIZE)
+
+enum { VDSO_CLOCK_GETTIME, VDSO_GETTIMEOFDAY, VDSO_TIME, VDSO_FUNC_COUNT };
+
+static bool emulated_vdso_present = 0;
+
+#ifdef __x86_64__
+
+static const char* vdso_func_names[VDSO_FUNC_COUNT] = {"clock_gettime", "gettimeofday", "time"};
+static const int vdso_func_syscalls[VDSO_FUNC_COUNT] = {__NR_clock_gettime, __NR_gettimeofday, __NR_time};
+
+// Null symbol, then each function as both <name> and __vdso_<name>:
+#define VDSO_SYMBOL_COUNT (1 + 2*VDSO_FUNC_COUNT)
+
+struct EmulatedVDSO {
+  Elf64_Ehdr ehdr;
+  Elf64_Phdr phdr[2];
+  Elf64_Dyn dyn[8];
+  W32 hash[2 + 1 + VDSO_SYMBOL_COUNT]; // nbucket, nchain, bucket[1], chain[]
+  Elf64_Sym syms[VDSO_SYMBOL_COUNT];
+  char strtab[256];
+  byte code[VDSO_FUNC_COUNT][16];
+};
+
+static W32 vdso_add_string(EmulatedVDSO& vdso, int& used, const char* s) {
+  W32 offset = used;
+  int n = strlen(s) + 1;
+  assert((used + n) <= sizeof(vdso.strtab));
+  memcpy(vdso.strtab + used, s, n);
+  used += n;
+  return offset;
+}
+
+void setup_vdso_page() {
+  Waddr v = (Waddr)asp.mmap((void*)PTLSIM_VDSO_PAGE, PAGE_SIZE, PROT_READ|PROT_WRITE, MAP_FIXED|MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
+  assert(v == PTLSIM_VDSO_PAGE);
+  assert(sizeof(EmulatedVDSO) <= PAGE_SIZE);
+
+  EmulatedVDSO& vdso = *(EmulatedVDSO*)v;
+  setzero(vdso);
+
+  // The image is linked at address 0, so every address below is an offset into the page:
+#define vdso_offset(field) ((Waddr)&(vdso.field) - (Waddr)&vdso)
+
+  Elf64_Ehdr& ehdr = vdso.ehdr;
+  memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+  ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+  ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+  ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+  ehdr.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+  ehdr.e_type = ET_DYN;
+  ehdr.e_machine = EM_X86_64;
+  ehdr.e_version = EV_CURRENT;
+  ehdr.e_phoff = vdso_offset(phdr);
+  ehdr.e_ehsize = sizeof(Elf64_Ehdr);
+  ehdr.e_phentsize = sizeof(Elf64_Phdr);
+  ehdr.e_phnum = lengthof(vdso.phdr);
+  ehdr.e_shentsize = sizeof(Elf64_Shdr);
+
+  Elf64_Phdr& load = vdso.phdr[0];
+  load.p_type = PT_LOAD;
+  load.p_flags = PF_R|PF_X;
+  load.p_filesz = PAGE_SIZE;
+  load.p_memsz = PAGE_SIZE;
+  load.p_align = PAGE_SIZE;
+
+  Elf64_Phdr& dynamic = vdso.phdr[1];
+  dynamic.p_type = PT_DYNAMIC;
+  dynamic.p_flags = PF_R;
+  dynamic.p_offset = dynamic.p_vaddr = dynamic.p_paddr = vdso_offset(dyn);
+  dynamic.p_filesz = dynamic.p_memsz = sizeof(vdso.dyn);
+  dynamic.p_align = 8;
+
+  int strused = 1; // offset 0 is the empty string
+  W32 soname = vdso_add_string(vdso, strused, "linux-vdso.so.1");
+
+  // A single hash bucket chaining through every symbol:
+  vdso.hash[0] = 1;
+  vdso.hash[1] = VDSO_SYMBOL_COUNT;
+  vdso.hash[2] = VDSO_SYMBOL_COUNT - 1;
+  W32* chain = &vdso.hash[3];
+  foreach (i, VDSO_SYMBOL_COUNT) chain[i] = (i) ? (i - 1) : 0;
+
+  foreach (i, VDSO_FUNC_COUNT) {
+    // mov $syscall,%eax; syscall; ret
+    byte* p = vdso.code[i];
+    *p++ = 0xb8; *(W32*)p = vdso_func_syscalls[i]; p += 4;
+    *p++ = 0x0f; *p++ = 0x05;
+    *p++ = 0xc3;
+
+    stringbuf sb;
+    sb << "__vdso_", vdso_func_names[i];
+
+    foreach (j, 2) {
+      Elf64_Sym& sym = vdso.syms[1 + 2*i + j];
+      sym.st_name = vdso_add_string(vdso, strused, (j) ? vdso_func_names[i] : (char*)sb);
+      sym.st_info = ELF64_ST_INFO(STB_GLOBAL, STT_FUNC);
+      sym.st_shndx = 1; // anything but SHN_UNDEF and SHN_ABS
+      sym.st_value = vdso_offset(code[i]);
+      sym.st_size = p - vdso.code[i];
+    }
+  }
+
+  Elf64_Dyn* dyn = vdso.dyn;
+  dyn->d_tag = DT_HASH; dyn->d_un.d_ptr = vdso_offset(hash); dyn++;
+  dyn->d_tag = DT_STRTAB; dyn->d_un.d_ptr = vdso_offset(strtab); dyn++;
+  dyn->d_tag = DT_SYMTAB; dyn->d_un.d_ptr = vdso_offset(syms); dyn++;
+  dyn->d_tag = DT_STRSZ; dyn->d_un.d_val = strused; dyn++;
+  dyn->d_tag = DT_SYMENT; dyn->d_un.d_val = sizeof(Elf64_Sym); dyn++;
+  dyn->d_tag = DT_SONAME; dyn->d_un.d_val = soname; dyn++;
+  dyn->d_tag = DT_NULL;
+
+#undef vdso_offset
+
+  asp.mprotect((void*)v, PAGE_SIZE, PROT_READ|PROT_EXEC);
+  emulated_vdso_present = 1;
+}
+
+static int vdso_function_at(Waddr rip) {
+  const EmulatedVDSO& vdso = *(const EmulatedVDSO*)PTLSIM_VDSO_PAGE;
+  foreach (i, VDSO_FUNC_COUNT) {
+    if (rip == (Waddr)&vdso.code[i]) return i;
+  }
+  return -1;
+}
+
+bool vdso_fast_path_entry(Waddr rip) {
+  if likely (floor(rip, PAGE_SIZE) != PTLSIM_VDSO_PAGE) return false;
+  if unlikely ((!emulated_vdso_present) | (!config.fast_vdso) | (replay_log_mode != 0)) return false;
+  return (vdso_function_at(rip) >= 0);
+}
+
+static inline bool vdso_user_writable(Waddr p, int bytes) {
+  return (asp.check((void*)p, PROT_WRITE) && asp.check((void*)(p + bytes - 1), PROT_WRITE));
+}
+
+void assist_vdso_time(Context& ctx) {
+  int func = vdso_function_at(ctx.commitarf[REG_selfrip]);
+  W64 arg1 = ctx.commitarf[REG_rdi];
+  W64 arg2 = ctx.commitarf[REG_rsi];
+  W64s rc = 0;
+  W64 ns;
+
+  switch (func) {
+  case VDSO_CLOCK_GETTIME: {
+    if unlikely (!get_simulated_time(arg1, ns)) {
+      rc = do_syscall_64bit(__NR_clock_gettime, arg1, arg2, 0, 0, 0, 0);
+      break;
+    }
+    if unlikely (!vdso_user_writable(arg2, sizeof(timespec))) { rc = -EFAULT; break; }
+    timespec* ts = (timespec*)(Waddr)arg2;
+    ts->tv_sec = ns / 1000000000ULL;
+    ts->tv_nsec = ns % 1000000000ULL;
+    break;
   }
-  case PTLCALL_CAPTURE_STATS: {
-    const char* snapshotname = (const char*)(Waddr)arg1;
-    if (asp.check((void*)snapshotname, PROT_READ)) {
-      capture_stats_snapshot(snapshotname);
-    } else {
-      logfile << "WARNING: invalid snapshotname pointer (", snapshotname, "); using default snapshot ID", endl;
-      capture_stats_snapshot(null);
+  case VDSO_GETTIMEOFDAY: {
+    if likely (arg1) {
+      if unlikely (!vdso_user_writable(arg1, sizeof(timeval))) { rc = -EFAULT; break; }
+      get_simulated_time(CLOCK_REALTIME, ns);
+      timeval* tv = (timeval*)(Waddr)arg1;
+      tv->tv_sec = ns / 1000000000ULL;
+      tv->tv_usec = (ns % 1000000000ULL) / 1000;
     }
+    // The timezone is not time dependent, so the host kernel fills it in:
+    if unlikely (arg2) rc = do_syscall_64bit(__NR_gettimeofday, 0, arg2, 0, 0, 0, 0);
     break;
   }
-  case PTLCALL_SWITCH_TO_NATIVE: {
-    logfile << "  Switching to native mode at rip ", (void*)(Waddr)rip, endl;
-    requested_switch_to_native = 1;
+  case VDSO_TIME: {
+    get_simulated_time(CLOCK_REALTIME, ns);
+    rc = ns / 1000000000ULL;
+    if (arg1) {
+      if unlikely (!vdso_user_writable(arg1, sizeof(time_t))) { rc = -EFAULT; break; }
+      *(time_t*)(Waddr)arg1 = rc;
+    }
     break;
   }
+  default:
+    assert(false);
   }
-  return 0;
-}
 
-// This is where we end up after issuing opcode 0x0f37 (undocumented x86 PTL call opcode)
-void assist_ptlcall(Context& ctx) {
-  ctx.commitarf[REG_rax] = handle_ptlcall(ctx.commitarf[REG_nextrip], ctx.commitarf[REG_rdi], ctx.commitarf[REG_rsi], ctx.commitarf[REG_rdx], ctx.commitarf[REG_rcx], ctx.commitarf[REG_r8], ctx.commitarf[REG_r9]);
-  ctx.commitarf[REG_rip] = ctx.commitarf[REG_nextrip];
+  ctx.commitarf[REG_rax] = rc;
+
+  // Return to the caller, as the ret at the end of the function would:
+  W64& rsp = ctx.commitarf[REG_rsp];
+  ctx.commitarf[REG_rip] = *(W64*)(Waddr)rsp;
+  rsp += 8;
 }
 
-//
-// Get the processor core frequency in cycles/second:
-//
-static W64 core_freq_hz = 0;
+#else // ! __x86_64__
 
-W64 get_core_freq_hz() {
-  if likely (core_freq_hz) return core_freq_hz;
+// The emulated vDSO is only built for 64-bit guests:
+void setup_vdso_page() { }
+bool vdso_fast_path_entry(Waddr rip) { return false; }
+void assist_vdso_time(Context& ctx) { assert(false); }
 
-  W64 hz = 0;
+#endif // __x86_64__
 
-  istream cpufreqis("/sys/devices/system/cpu/cpu0/cpufreq/cpuinfo_max_freq");
-  if (cpufreqis) {
-    char s[256];
-    cpufreqis >> readline(s, sizeof(s));      
-    
-    int khz;
-    int n = sscanf(s, "%d", &khz);
-    
-    if (n == 1) {
-      hz = (W64)khz * 1000;
-      core_freq_hz = hz;
-      return hz;
-    }
-  }
-  
+//
+// Count the host processors (for sizing parallel jobs):
+//
+int get_host_processor_count() {
   istream is("/proc/cpuinfo");
-  
-  if (!is) {
-    cerr << "get_core_freq_hz(): warning: cannot open /proc/cpuinfo. Is this a Linux machine?", endl;
-    core_freq_hz = hz;
-    return hz;
-  }
-  
+  if (!is) return 1;
+
+  int n = 0;
+
   while (is) {
     char s[256];
     is >> readline(s, sizeof(s));
-    
-    int mhz;
-    int n = sscanf(s, "cpu MHz : %d", &mhz);
-    if (n == 1) {
-      hz = (W64)mhz * 1000000;
-      core_freq_hz = hz;
-      return hz;
-    }
+    n += (strncmp(s, "processor", 9) == 0);
   }
 
-  // Can't read either of these procfiles: abort
-  assert(false);
-  return 0;
+  return max(n, 1);
 }
 
 const char* get_full_exec_filename() {
@@ -1444,6 +3253,50 @@ void print_sysinfo(ostream& os) {
   // Nothing special on userspace PTLsim
 }
 
+//
+// Bulk transfer to and from another process: process_vm_readv/writev
+// moves a whole buffer in one syscall; /proc/<pid>/mem is the fallback
+// (it is also the only way to write read-only pages like the text the
+// loader thunk goes into). Returns the number of bytes transferred;
+// callers fall back to word-at-a-time ptrace for the rest.
+//
+W64 transfer_process_memory(int pid, void* local, Waddr remote, W64 size, bool write) {
+  struct { void* base; size_t length; } localiov, remoteiov;
+  W64 done = 0;
+
+  while (done < size) {
+    localiov.base = (byte*)local + done;
+    localiov.length = size - done;
+    remoteiov.base = (void*)(remote + done);
+    remoteiov.length = size - done;
+
+    ssize_t rc = (write)
+      ? sys_process_vm_writev(pid, &localiov, 1, &remoteiov, 1, 0)
+      : sys_process_vm_readv(pid, &localiov, 1, &remoteiov, 1, 0);
+    if (rc <= 0) break;
+    done += rc;
+  }
+
+  if likely (done == size) return done;
+
+  stringbuf memname;
+  memname << "/proc/", pid, "/mem";
+  int fd = sys_open(memname, (write) ? O_RDWR : O_RDONLY, 0);
+  if unlikely (fd < 0) return done;
+
+  while (done < size) {
+    if (sys_seek(fd, remote + done, SEEK_SET) != (remote + done)) break;
+    ssize_t rc = (write)
+      ? sys_write(fd, (byte*)local + done, size - done)
+      : sys_read(fd, (byte*)local + done, size - done);
+    if (rc <= 0) break;
+    done += rc;
+  }
+
+  sys_close(fd);
+  return done;
+}
+
 //
 // Injection into target process
 //
@@ -1451,33 +3304,37 @@ void print_sysinfo(ostream& os) {
 #ifdef __x86_64__
 
 void copy_from_process_memory(int pid, void* target, const void* source, int size) {
-  W64* destp = (W64*)target;
-  W64* srcp = (W64*)source;
+  W64 done = floor(transfer_process_memory(pid, target, (Waddr)source, size, false), 8);
+  if likely (done == size) return;
 
-  foreach (i, ceil(size, 8) / sizeof(W64)) {
+  W64* destp = (W64*)((byte*)target + done);
+  W64* srcp = (W64*)((byte*)source + done);
+
+  foreach (i, (ceil(size, 8) - done) / sizeof(W64)) {
     W64 rc = sys_ptrace(PTRACE_PEEKDATA, pid, (W64)srcp++, (W64)destp++);
   }
 }
 
 void copy_to_process_memory(int pid, void* target, const void* source, int size) {
-  W64* destp = (W64*)target;
-  W64* srcp = (W64*)source;
+  W64 done = floor(transfer_process_memory(pid, (void*)source, (Waddr)target, size, true), 8);
+  if likely (done == size) return;
+
+  W64* destp = (W64*)((byte*)target + done);
+  W64* srcp = (W64*)((byte*)source + done);
 
-  foreach (i, ceil(size, 8) / sizeof(W64)) {
+  foreach (i, (ceil(size, 8) - done) / sizeof(W64)) {
     W64 rc = sys_ptrace(PTRACE_POKEDATA, pid, (W64)(destp++), (W64)(*srcp++));
     assert(rc == 0);
   }
 }
 
 void write_process_memory_W64(int pid, W64 target, W64 data) {
-  int rc = sys_ptrace(PTRACE_POKEDATA, pid, target, data);
-  assert(rc == 0);
+  copy_to_process_memory(pid, (void*)target, &data, sizeof(data));
 }
 
 W64 read_process_memory_W64(int pid, W64 source) {
   W64 data;
-  int rc = sys_ptrace(PTRACE_PEEKDATA, pid, source, (W64)&data);
-  assert(rc == 0);
+  copy_from_process_memory(pid, &data, (void*)source, sizeof(data));
   return data;
 }
 
@@ -1642,19 +3499,25 @@ int ptlsim_inject(int argc, char** argv) {
 #else // ! __x86_64__
 
 void copy_from_process_memory(int pid, void* target, const void* source, int size) {
-  W32* destp = (W32*)target;
-  W32* srcp = (W32*)source;
+  W64 done = floor(transfer_process_memory(pid, target, (Waddr)source, size, false), 4);
+  if likely (done == size) return;
 
-  foreach (i, ceil(size, 4) / sizeof(W32)) {
+  W32* destp = (W32*)((byte*)target + done);
+  W32* srcp = (W32*)((byte*)source + done);
+
+  foreach (i, (ceil(size, 4) - done) / sizeof(W32)) {
     W64 rc = sys_ptrace(PTRACE_PEEKDATA, pid, (W32)srcp++, (W32)destp++);
   }
 }
 
 void copy_to_process_memory(int pid, void* target, const void* source, int size) {
-  W32* destp = (W32*)target;
-  W32* srcp = (W32*)source;
+  W64 done = floor(transfer_process_memory(pid, (void*)source, (Waddr)target, size, true), 4);
+  if likely (done == size) return;
+
+  W32* destp = (W32*)((byte*)target + done);
+  W32* srcp = (W32*)((byte*)source + done);
 
-  foreach (i, ceil(size, 4) / sizeof(W32)) {
+  foreach (i, (ceil(size, 4) - done) / sizeof(W32)) {
     W64 rc = sys_ptrace(PTRACE_POKEDATA, pid, (W32)(destp++), (W32)(*srcp++));
     assert(rc == 0);
   }
@@ -1889,6 +3752,170 @@ void init_signal_callback() {
   assert(sys_rt_sigaction(SIGXCPU, &sa, NULL, sizeof(W64)) == 0);
 }
 
+//
+// Native fast-forward: a host perf_event counter counts user mode
+// instructions (or branches) retired while the guest runs natively.
+// When it overflows, the kernel disables it and signals this thread,
+// and the handler plants a switch-to-sim breakpoint at the interrupted
+// rip, exactly as SIGXCPU does. Overflow has a few instructions of
+// skid, so the exact count is read back and logged at the switch.
+//
+
+// Subset of the kernel's struct perf_event_attr (PERF_ATTR_SIZE_VER0):
+struct HostPerfEventAttr {
+  W32 type;
+  W32 size;
+  W64 config;
+  W64 sample_period;
+  W64 sample_type;
+  W64 read_format;
+  W64 flags;
+  W32 wakeup_events;
+  W32 bp_type;
+  W64 bp_addr;
+};
+
+enum {
+  HOST_PERF_TYPE_HARDWARE = 0,
+  HOST_PERF_COUNT_HW_INSTRUCTIONS = 1,
+  HOST_PERF_COUNT_HW_BRANCH_INSTRUCTIONS = 4,
+};
+
+enum {
+  HOST_PERF_FLAG_DISABLED = (1 << 0),
+  HOST_PERF_FLAG_EXCLUDE_KERNEL = (1 << 5),
+  HOST_PERF_FLAG_EXCLUDE_HV = (1 << 6),
+};
+
+// _IO('$', n) and _IOW('$', 4, W64):
+#define HOST_PERF_IOC_ENABLE  0x2400
+#define HOST_PERF_IOC_DISABLE 0x2401
+#define HOST_PERF_IOC_REFRESH 0x2402
+#define HOST_PERF_IOC_RESET   0x2403
+#define HOST_PERF_IOC_PERIOD  0x40082404
+
+#ifndef F_SETSIG
+#define F_SETSIG 10
+#endif
+#ifndef F_SETOWN_EX
+#define F_SETOWN_EX 15
+#endif
+#ifndef F_OWNER_TID
+#define F_OWNER_TID 0
+#endif
+#ifndef O_ASYNC
+#define O_ASYNC 020000
+#endif
+
+// Last realtime signal (the kernel's _NSIG): the one applications are least likely to claim
+#define NATIVE_COUNTER_SIGNAL 64
+
+int native_counter_fd = -1;
+bool native_counter_branches = 0;
+bool native_counter_armed = 0;
+W64 native_counter_period = 0;
+
+static const char* native_counter_unit() {
+  return (native_counter_branches) ? "branches" : "instructions";
+}
+
+W64 read_native_counter() {
+  W64 count = 0;
+  if (native_counter_fd >= 0) sys_read(native_counter_fd, &count, sizeof(count));
+  return count;
+}
+
+extern "C" void native_counter_overflow_callback(int sig, siginfo_t* si, void* contextp) {
+  sys_ioctl(native_counter_fd, HOST_PERF_IOC_DISABLE, 0);
+  if (running_in_sim_mode) return;
+
+  ucontext_t* context = (ucontext_t*)contextp;
+#ifdef __x86_64__
+  void* rip = (void*)context->uc_mcontext.gregs[REG_RIP];
+#else
+  void* rip = (void*)context->uc_mcontext.gregs[REG_EIP];
+#endif
+
+  W64 count = read_native_counter();
+  if (logfile) logfile << endl, "=== Native counter reached ", count, " user ", native_counter_unit(), " (period ", native_counter_period, "): ",
+                 "switching tid ", sys_gettid(), " to simulation mode at rip ", rip, " ===", endl, flush;
+
+  remove_switch_to_sim_breakpoint();
+  set_switch_to_sim_breakpoint(rip);
+  // Context switch to PTLsim takes place after the sighandler returns
+}
+
+//
+// Arm the counter to fire after <period> more native user mode
+// instructions or branches. It only starts counting inside
+// switch_to_native_restore_context(), so almost none of PTLsim's
+// own code gets counted. Returns false if the host has no usable
+// perf counters.
+//
+bool arm_native_counter(W64 period, bool branches) {
+  if unlikely ((native_counter_fd >= 0) && (branches != native_counter_branches)) {
+    sys_close(native_counter_fd);
+    native_counter_fd = -1;
+  }
+
+  if (native_counter_fd < 0) {
+#ifdef __x86_64__
+    // Same restriction as init_signal_callback(): the ucontext layout must match
+    if (!ctx.use64) return false;
+#endif
+    HostPerfEventAttr attr;
+    setzero(attr);
+    attr.type = HOST_PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = (branches) ? HOST_PERF_COUNT_HW_BRANCH_INSTRUCTIONS : HOST_PERF_COUNT_HW_INSTRUCTIONS;
+    attr.sample_period = period;
+    attr.flags = HOST_PERF_FLAG_DISABLED | HOST_PERF_FLAG_EXCLUDE_KERNEL | HOST_PERF_FLAG_EXCLUDE_HV;
+    attr.wakeup_events = 1;
+
+    int fd = sys_perf_event_open(&attr, 0, -1, -1, 0);
+    if (fd < 0) {
+      logfile << "Warning: cannot open host perf counter for user ", ((branches) ? "branches" : "instructions"), " (error ", -fd, ")", endl, flush;
+      return false;
+    }
+
+    struct kernel_sigaction sa;
+    setzero(sa);
+    sa.k_sa_handler = native_counter_overflow_callback;
+    sa.sa_flags = SA_SIGINFO;
+    assert(sys_rt_sigaction(NATIVE_COUNTER_SIGNAL, &sa, NULL, sizeof(W64)) == 0);
+
+    struct { int type; pid_t pid; } owner;
+    owner.type = F_OWNER_TID;
+    owner.pid = sys_gettid();
+    sys_fcntl(fd, F_SETOWN_EX, (Waddr)&owner);
+    sys_fcntl(fd, F_SETSIG, NATIVE_COUNTER_SIGNAL);
+    sys_fcntl(fd, F_SETFL, O_ASYNC);
+
+    native_counter_fd = fd;
+    native_counter_branches = branches;
+  } else {
+    sys_ioctl(native_counter_fd, HOST_PERF_IOC_PERIOD, (Waddr)&period);
+  }
+
+  native_counter_period = period;
+  native_counter_armed = 1;
+  return true;
+}
+
+// Called as the very last thing before jumping back to native code:
+void start_native_counter() {
+  if likely (!native_counter_armed) return;
+  native_counter_armed = 0;
+  sys_ioctl(native_counter_fd, HOST_PERF_IOC_RESET, 0);
+  // Enable until the next overflow, then the kernel disables it again:
+  sys_ioctl(native_counter_fd, HOST_PERF_IOC_REFRESH, 1);
+}
+
+void disarm_native_counter() {
+  native_counter_armed = 0;
+  if (native_counter_fd >= 0) sys_ioctl(native_counter_fd, HOST_PERF_IOC_DISABLE, 0);
+}
+
 bool check_for_async_sim_break() {
   if unlikely ((sim_cycle >= config.stop_at_cycle) |
                (iterations >= config.stop_at_iteration) |
@@ -2082,7 +4109,12 @@ byte* copy_args_env_auxv(byte* destptr, const byte* origargv) {
   auxv_start = destauxv;
 
   while (auxv->a_type != AT_NULL) {
-    if ((auxv->a_type == AT_SYSINFO) || (auxv->a_type == AT_SYSINFO_EHDR)) {
+    if ((auxv->a_type == AT_SYSINFO_EHDR) && (sizeof(ptrsize_t) == sizeof(W64)) && emulated_vdso_present) {
+      // Substitute the emulated vDSO for the host one:
+      destauxv->a_type = AT_SYSINFO_EHDR;
+      destauxv->a_un.a_val = PTLSIM_VDSO_PAGE;
+      auxv->a_type = AT_IGNORE;
+    } else if ((auxv->a_type == AT_SYSINFO) || (auxv->a_type == AT_SYSINFO_EHDR)) {
       // We do not support SYSENTER-style VDSOs, so disable this:
       // logfile << "copy_args_env_auxv: Disabled 32-bit AT_SYSINFO auxv", endl;
       destauxv->a_type = AT_IGNORE;
@@ -2190,6 +4222,7 @@ extern "C" void* ptlsim_preinit(void* origrsp, void* nextinit) {
 
   ThreadState* tls = &basetls;
   tls->self = tls;
+  tls->tid = 0;
   // Give PTLsim itself 64 MB for the .text, .data and .bss sections:
   void* stack = ptl_mm_alloc_private_pages(SIM_THREAD_STACK_SIZE, PROT_READ|PROT_WRITE, PTL_IMAGE_BASE + 64*1024*1024);
   assert(mmap_valid(stack));
@@ -2197,6 +4230,8 @@ extern "C" void* ptlsim_preinit(void* origrsp, void* nextinit) {
   setup_sim_thunk_page();
 
 #ifdef __x86_64__
+  if (ctx.use64) setup_vdso_page();
+
   const byte* argv = (const byte*)origrsp;
 
   int bytes = (ctx.use64)
@@ -2230,8 +4265,251 @@ extern "C" void* ptlsim_preinit(void* origrsp, void* nextinit) {
   return sp;
 }
 
+//
+// Parallel sampled simulation
+//
+// With -sample-interval N, the sequential core fast-forwards the
+// process and every N user instructions the whole process (guest
+// plus simulator state) is forked. The child warms up and then
+// measures one interval on the detailed core, writing snapshots
+// "warmup" and "sample" into <stats>.sample-<n>, while the parent
+// keeps fast-forwarding. Once the parent is done, the children are
+// reaped and their intervals are merged into <stats>.samples.
+//
+// Children are cloned without an exit signal, so a SIGCHLD handler
+// installed by the guest never sees them. Guest syscalls in each
+// child are still executed for real: a guest writing to files or
+// pipes will see those writes repeated by every child.
+//
+static const int MAX_SAMPLE_CHILDREN = 256;
+
+bool sample_child = 0;
+W64 sample_count = 0;
+int sample_children_running = 0;
+int sample_child_pids[MAX_SAMPLE_CHILDREN];
+
+static void sample_filename(stringbuf& sb, const char* basename, W64 n) {
+  sb.reset();
+  sb << basename, ".sample-", n;
+}
+
+//
+// Wait for one sample child (any child if pid is -1) to exit:
+//
+static bool reap_sample_child(int pid = -1) {
+  int status;
+  int rc = sys_wait4(pid, &status, __WCLONE, null);
+  if (rc <= 0) return false;
+
+  foreach (i, sample_children_running) {
+    if (sample_child_pids[i] != rc) continue;
+    sample_child_pids[i] = sample_child_pids[--sample_children_running];
+    break;
+  }
+
+  if (WIFEXITED(status) && (WEXITSTATUS(status) == 0)) {
+    logfile << "Sample child pid ", rc, " finished", endl, flush;
+  } else {
+    logfile << "Warning: sample child pid ", rc, " terminated abnormally (status ", (void*)(Waddr)status, ")", endl, flush;
+  }
+
+  return true;
+}
+
+static void exit_sample_child(int rc) {
+  logfile << "Sample ", sample_count, " finished at ", sim_cycle, " cycles, ", total_user_insns_committed, " commits", endl, flush;
+  capture_stats_snapshot("sample");
+  flush_stats();
+  shutdown_subsystems();
+  logfile.close();
+  sys_exit(rc);
+}
+
+//
+// Fork a child to simulate the interval starting at the current
+// instruction. Returns only in the parent.
+//
+static void start_sample() {
+  int jobs = (config.sample_jobs) ? min(config.sample_jobs, (W64)MAX_SAMPLE_CHILDREN) : min(get_host_processor_count(), MAX_SAMPLE_CHILDREN);
+  while (sample_children_running >= jobs) {
+    if (!reap_sample_child()) break;
+  }
+
+  // Nothing may be left in our buffers for the child to write out:
+  flush_stats();
+  flush_syscall_trace();
+  flush_replay_log();
+  logfile.flush();
+
+  int pid = sys_clone(0, null);
+
+  if (pid < 0) {
+    logfile << "Warning: cannot fork sample ", sample_count, " (rc ", pid, "); skipping it", endl, flush;
+    sample_count++;
+    return;
+  }
+
+  if (pid) {
+    logfile << "Forked sample ", sample_count, " as pid ", pid, " at ", total_user_insns_committed, " commits", endl, flush;
+    sample_child_pids[sample_children_running++] = pid;
+    sample_count++;
+    return;
+  }
+
+  sample_child = 1;
+  sample_children_running = 0;
+  // The child has its own tid for current_lock_owner():
+  getcurrent()->tid = 0;
+
+  stringbuf sb;
+
+  if (config.log_filename.set()) {
+    sample_filename(sb, config.log_filename, sample_count);
+    logfile.open(sb);
+    config.log_filename = sb;
+  }
+
+  sample_filename(sb, config.stats_filename, sample_count);
+  reopen_stats_after_fork(sb);
+  config.stats_filename = sb;
+
+  reopen_replay_log_after_fork();
+
+  if (config.syscall_trace_filename.set()) {
+    close_syscall_trace();
+    sample_filename(sb, config.syscall_trace_filename, sample_count);
+    config.syscall_trace_filename = sb;
+  }
+
+  logfile << "Sample ", sample_count, " (pid ", sys_getpid(), ") starting at ", total_user_insns_committed, " commits", endl, flush;
+
+  W64 stop_at_user_insns = config.stop_at_user_insns;
+
+  if (config.sample_warmup_insns) {
+    config.stop_at_user_insns = min(total_user_insns_committed + config.sample_warmup_insns, stop_at_user_insns);
+    simulate(config.core_name);
+  }
+
+  capture_stats_snapshot("warmup");
+
+  if (total_user_insns_committed < stop_at_user_insns) {
+    config.stop_at_user_insns = min(total_user_insns_committed + config.sample_insns, stop_at_user_insns);
+    simulate(config.core_name);
+  }
+
+  exit_sample_child(0);
+}
+
+//
+// Reap every sample child, then merge their intervals:
+//
+static void finish_sampled_simulation() {
+  if (sample_child | (!sample_count)) return;
+
+  logfile << "Waiting for ", sample_children_running, " sample children to finish...", endl, flush;
+  while (sample_children_running) {
+    if (!reap_sample_child()) break;
+  }
+
+  dynarray<char*> filenames;
+  stringbuf sb;
+
+  foreach (i, sample_count) {
+    sample_filename(sb, config.stats_filename, i);
+    filenames.push(strdup(sb));
+  }
+
+  sb.reset();
+  sb << config.stats_filename, ".samples";
+
+  logfile << "Merging ", sample_count, " samples into ", sb, endl, flush;
+  if (!merge_stats_files(sb, filenames.data, filenames.length, "sample", "warmup")) {
+    logfile << "Warning: no samples could be merged", endl, flush;
+  }
+
+  foreach (i, filenames.length) free(filenames[i]);
+
+  sample_count = 0;
+}
+
+//
+// Fast-forward in the sequential core, forking a sample child at
+// every sample point, until the normal stopping point is reached:
+//
+static void simulate_sampled() {
+  if (!config.stats_filename.set()) {
+    logfile << "Warning: -sample-interval requires -stats; running without sampling", endl, flush;
+    cerr << "Warning: -sample-interval requires -stats; running without sampling", endl, flush;
+    simulate(config.core_name);
+    return;
+  }
+
+  W64 stop_at_user_insns = config.stop_at_user_insns;
+
+  for (;;) {
+    W64 next_sample_at = total_user_insns_committed + config.sample_interval;
+    config.stop_at_user_insns = min(next_sample_at, stop_at_user_insns);
+    simulate("seq");
+
+    // Stopped for any reason other than reaching the sample point:
+    if ((total_user_insns_committed < next_sample_at) |
+        (total_user_insns_committed >= stop_at_user_insns) |
+        requested_switch_to_native) break;
+
+    start_sample();
+  }
+
+  config.stop_at_user_insns = stop_at_user_insns;
+  finish_sampled_simulation();
+}
+
+//
+// Interleaved mode: each entry into the simulator runs one window of
+// warm-up followed by a measured interval, bracketed by snapshots
+// "warmup-<k>" and "window-<k>". The guest then runs natively for
+// <interleave-native> user instructions before the next window.
+// Returns true if the native counter was armed for another window.
+//
+static int interleave_window = 0;
+
+static bool simulate_interleaved_window() {
+  W64 stop_at_user_insns = config.stop_at_user_insns;
+  stringbuf sb;
+
+  logfile << "Interleave window ", interleave_window, " starting at ", total_user_insns_committed, " commits", endl, flush;
+
+  if (config.interleave_warmup_insns) {
+    config.stop_at_user_insns = min(total_user_insns_committed + config.interleave_warmup_insns, stop_at_user_insns);
+    simulate(config.core_name);
+  }
+
+  sb << "warmup-", interleave_window;
+  capture_stats_snapshot(sb);
+
+  if ((total_user_insns_committed < stop_at_user_insns) & (!requested_switch_to_native)) {
+    config.stop_at_user_insns = min(total_user_insns_committed + config.interleave_sim_insns, stop_at_user_insns);
+    simulate(config.core_name);
+  }
+
+  sb.reset();
+  sb << "window-", interleave_window;
+  capture_stats_snapshot(sb);
+  interleave_window++;
+
+  config.stop_at_user_insns = stop_at_user_insns;
+
+  // Explicit switch to native or overall stopping point: run natively from here on
+  if (requested_switch_to_native | (total_user_insns_committed >= stop_at_user_insns)) return false;
+
+  return arm_native_counter(config.interleave_native_insns, false);
+}
+
 void user_process_terminated(int rc) {
   x86_set_mxcsr(MXCSR_DEFAULT);
+  flush_syscall_trace();
+  flush_replay_log();
+  if unlikely (sample_child) exit_sample_child(rc);
+  finish_sampled_simulation();
   logfile << "user_process_terminated(rc = ", rc, "): initiating shutdown at ", sim_cycle, " cycles, ", total_user_insns_committed, " commits...", endl, flush;
   capture_stats_snapshot("final");
   flush_stats();
@@ -2260,9 +4538,25 @@ void switch_to_sim() {
   //
   x86_set_mxcsr(ctx.mxcsr | MXCSR_EXCEPTION_DISABLE_MASK);
 
-  simulate(config.core_name);
-  capture_stats_snapshot("final");
+  rebase_simulated_time();
+  start_guest_threads();
+  init_replay_log();
+
+  bool next_window = false;
+
+  if (config.sample_interval) {
+    simulate_sampled();
+  } else if (config.interleave_native_insns) {
+    next_window = simulate_interleaved_window();
+  } else {
+    simulate(config.core_name);
+  }
+  if (!next_window) capture_stats_snapshot("final");
   flush_stats();
+  flush_syscall_trace();
+  flush_replay_log();
+
+  stop_guest_threads();
 
   done |= (config.dump_at_end | config.overshoot_and_dump);
 
@@ -2273,6 +4567,11 @@ void switch_to_sim() {
 
   x86_set_mxcsr(MXCSR_DEFAULT);
 
+  if (next_window) {
+    logfile << "Running natively for ", native_counter_period, " user instructions until interleave window ", interleave_window, endl, flush;
+    switch_to_native_restore_context();
+  }
+
   if (config.exit_after_fullsim) {
     logfile << endl, "=== Exiting after full simulation on tid ", sys_gettid(), " at rip ", (void*)(Waddr)ctx.commitarf[REG_rip], " (", 
       sim_cycle, " cycles, ", total_user_insns_committed, " user commits, ", iterations, " iterations) ===", endl, endl;
@@ -2285,13 +4584,19 @@ void switch_to_sim() {
     RIPVirtPhys rip(ctx.commitarf[REG_rip]);
     rip.update(ctx);
 
-    BasicBlock* bb = bbcache(rip);
-    if (!bb) {
-      bb = bbcache.translate(ctx, rip);
-    }
+    int bytes;
+
+    {
+      ScopedLock<RecursiveMutex> scope(bbcache.lock);
 
-    assert(bb->transops[0].som);
-    int bytes = bb->transops[0].bytes;
+      BasicBlock* bb = bbcache(rip);
+      if (!bb) {
+        bb = bbcache.translate(ctx, rip);
+      }
+
+      assert(bb->transops[0].som);
+      bytes = bb->transops[0].bytes;
+    }
     Waddr ripafter = rip + (config.overshoot_and_dump ? bytes : 0);
 
     logfile << endl;
@@ -2351,8 +4656,11 @@ int main(int argc, char** argv) {
   logfile << "loader: interp_entry ", interp_entry, ", program_entry ", program_entry, endl, flush;
 
   if (!config.trigger_mode) {
+    bool fast_forward = (config.native_insns | config.native_branches);
     if (config.start_at_rip != INVALIDRIP)
       set_switch_to_sim_breakpoint((void*)(Waddr)config.start_at_rip);
+    else if (fast_forward && arm_native_counter((config.native_branches) ? config.native_branches : config.native_insns, (config.native_branches != 0)))
+      logfile << "Fast-forwarding natively for ", native_counter_period, " user ", native_counter_unit(), endl, flush;
     else if (config.include_dyn_linker)
       set_switch_to_sim_breakpoint(interp_entry);
     else set_switch_to_sim_breakpoint(program_entry);
@@ -28,6 +28,7 @@ struct ThreadState {
   ThreadState* self;
   void* stack;
   simcall_func_t simcall;
+  W32s tid;
 };
 
 extern ThreadState basetls;
@@ -56,10 +57,16 @@ native_auxv_t* find_auxv_entry(int type);
 void switch_stack_and_jump_32_or_64(void* code, void* stack, bool use64);
 void switch_to_native_restore_context();
 void set_switch_to_sim_breakpoint(void* addr);
+bool arm_native_counter(W64 period, bool branches);
+void start_native_counter();
+void disarm_native_counter();
+W64 read_native_counter();
+extern W64 native_counter_period;
 void enable_ptlsim_call_gate();
 void disable_ptlsim_call_gate();
 
 int ptlsim_inject(int argc, char** argv);
+W64 transfer_process_memory(int pid, void* local, Waddr remote, W64 size, bool write);
 
 //
 // Signal callbacks
@@ -89,10 +96,16 @@ extern bool running_in_sim_mode;
 // Each chunk covers 2 GB of virtual address space:
 #define ADDRESS_SPACE_BITS (32)
 #define ADDRESS_SPACE_SIZE (1LL << ADDRESS_SPACE_BITS)
-#define SPAT_BYTES ((ADDRESS_SPACE_SIZE / PAGE_SIZE) / 8)
+#define SPAT_PAGES (ADDRESS_SPACE_SIZE / PAGE_SIZE)
+#define SPAT_BYTES (SPAT_PAGES / 8)
 
 #endif
 
+// Ranges remapped by the simulator itself between two resyncs with /proc/self/maps:
+#define MAX_CHANGED_RANGES 64
+
+struct MemoryMapExtent;
+
 class AddressSpace {
 public:
   AddressSpace();
@@ -120,8 +133,11 @@ public:
 #ifdef __x86_64__
   typedef byte SPATChunk[SPAT_BYTES_PER_CHUNK];
   typedef SPATChunk** spat_t;
+  typedef byte AttrChunk[SPAT_PAGES_PER_CHUNK];
+  typedef AttrChunk** attrmap_t;
 #else
   typedef byte* spat_t;
+  typedef byte* attrmap_t;
 #endif
   spat_t readmap;
   spat_t writemap;
@@ -131,10 +147,17 @@ public:
   spat_t transmap;
   spat_t dirtymap;
 
+  // One byte of PROT_xxx bits per page, so check() needs a single probe:
+  attrmap_t attrmap;
+
   spat_t allocmap();
   void freemap(spat_t top);
+  attrmap_t allocattrmap();
+  void freeattrmap(attrmap_t top);
 
   byte& pageid_to_map_byte(spat_t top, Waddr pageid);
+  void update_range(spat_t top, Waddr firstpage, Waddr lastpage, bool set);
+  void update_attr_range(Waddr firstpage, Waddr lastpage, int prot);
   void make_accessible(void* address, Waddr size, spat_t top);
   void make_inaccessible(void* address, Waddr size, spat_t top);
 
@@ -170,6 +193,7 @@ public:
   long sys_errno;
 
   void setattr(void* start, Waddr length, int prot);
+  void update_attr(void* start, Waddr length, int prot);
   int getattr(void* start);
   int mprotect(void* start, Waddr length, int prot);
   int munmap(void* start, Waddr length);
@@ -200,17 +224,22 @@ public:
     return fastcheck((Waddr)addr, top);
   }
 
-  bool check(void* p, int prot) const {
-    if unlikely ((prot & PROT_READ) && (!fastcheck(p, readmap)))
-      return false;
-    
-    if unlikely ((prot & PROT_WRITE) && (!fastcheck(p, writemap)))
-      return false;
+  int fastattr(Waddr addr) const {
+#ifdef __x86_64__
+    W64 chunkid = pageid(addr) >> log2(SPAT_PAGES_PER_CHUNK);
 
-    if unlikely ((prot & PROT_EXEC) && (!fastcheck(p, execmap)))
-      return false;
-    
-    return true;
+    if unlikely (!attrmap[chunkid])
+      return 0;
+
+    AddressSpace::AttrChunk& chunk = *attrmap[chunkid];
+    return chunk[lowbits(pageid(addr), log2(SPAT_PAGES_PER_CHUNK))];
+#else // 32-bit
+    return attrmap[pageid(addr)];
+#endif
+  }
+
+  bool check(void* p, int prot) const {
+    return ((fastattr((Waddr)p) & prot) == prot);
   }
 
   bool dtlbcheck(void* page) const { return fastcheck(page, dtlbmap); }
@@ -229,6 +258,17 @@ public:
   void setdirty(Waddr mfn) { make_page_accessible((void*)(mfn << 12), dirtymap); }
   void cleardirty(Waddr mfn) { make_page_inaccessible((void*)(mfn << 12), dirtymap); }
 
+  //
+  // Incremental resync: only extents that changed in /proc/self/maps
+  // since the last resync, plus any ranges the simulator remapped in
+  // the meantime, are rewritten in the maps.
+  //
+  MemoryMapExtent* lastmaps;
+  int lastmapcount;
+  int changed_range_count;
+  Waddr changed_range_start[MAX_CHANGED_RANGES];
+  Waddr changed_range_length[MAX_CHANGED_RANGES];
+
   void resync_with_process_maps();
 };
 
@@ -242,12 +282,26 @@ static inline bool smc_isdirty(Waddr mfn) { return asp.isdirty(mfn); }
 static inline void smc_setdirty(Waddr mfn) { asp.setdirty(mfn); }
 static inline void smc_cleardirty(Waddr mfn) { asp.cleardirty(mfn); }
 
-// Only one VCPU in userspace PTLsim:
-static inline Context& contextof(int vcpu) { return ctx; }
+//
+// Guest threads are multiplexed onto a small set of hardware
+// contexts; contexts[0] is always the global ctx:
+//
+#define MAX_CONTEXTS 4
+
+extern Context* contexts[MAX_CONTEXTS];
+extern int hardware_context_count;
 
-#define contextcount (1)
+static inline Context& contextof(int vcpu) { return *contexts[vcpu]; }
 
-#define MAX_CONTEXTS 1
+#define contextcount (hardware_context_count)
+
+// Cycle at which each hardware context must call event_upcall() to reschedule:
+extern W64 guest_thread_event_cycle[MAX_CONTEXTS];
+extern W64 sim_cycle;
+
+inline bool Context::check_events() const {
+  return (sim_cycle >= guest_thread_event_cycle[vcpuid]);
+}
 
 // virtual == physical in userspace PTLsim:
 static inline void* phys_to_mapped_virt(Waddr rawphys) {
@@ -397,10 +451,47 @@ inline RIPVirtPhys& RIPVirtPhys::update(Context& ctx, int bytes) {
 //
 enum { SYSCALL_SEMANTICS_INT80, SYSCALL_SEMANTICS_SYSCALL, SYSCALL_SEMANTICS_SYSENTER };
 
-void handle_syscall_32bit(int semantics);
+// These also label the stats.external.syscalls histograms:
+#define SYSCALL_NAME_COUNT_64BIT 249
+#define SYSCALL_NAME_COUNT_32BIT 273
+
+extern const char* syscall_names_64bit[SYSCALL_NAME_COUNT_64BIT];
+extern const char* syscall_names_32bit[SYSCALL_NAME_COUNT_32BIT];
+
+//
+// Binary syscall trace record (written to the -syscall-trace file):
+//
+struct SyscallTraceRecord {
+  W64 cycle;        // sim_cycle when the syscall returned
+  W64 host_ns;      // host time spent handling it
+  W64 rip;          // return address
+  W64 args[6];
+  W64 rc;
+  W16 id;
+  byte semantics;   // SYSCALL_SEMANTICS_* (32-bit only)
+  byte use64;       // x86-64 syscall numbering
+  W32 tid;
+};
+
+void flush_syscall_trace();
+
+//
+// Syscall record and replay (see kernel.cpp)
+//
+enum { REPLAY_LOG_OFF, REPLAY_LOG_RECORD, REPLAY_LOG_REPLAY };
+extern int replay_log_mode;
+
+// Log or replay a nondeterministic rdtsc result:
+W64 replay_log_rdtsc(W64 tsc);
+
+// Simulated time, derived from sim_cycle and the core frequency:
+W64 sim_cycles_to_ns(W64 cycles);
+bool get_simulated_time(int clock, W64& ns);
+
+void handle_syscall_32bit(Context& ctx, int semantics);
 
 // x86-64 mode has only one type of system call (the syscall instruction)
-void handle_syscall_64bit();
+void handle_syscall_64bit(Context& ctx);
 
 //
 // Local descriptor table
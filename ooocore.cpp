@@ -325,7 +325,6 @@ bool OutOfOrderCore::runcycle() {
   // to the interrupt handler.
   //
 
-#ifdef PTLSIM_HYPERVISOR
   foreach (i, threadcount) {
     ThreadContext* thread = threads[i];
     bool current_interrupts_pending = thread->ctx.check_events();
@@ -333,7 +332,6 @@ bool OutOfOrderCore::runcycle() {
     thread->handle_interrupt_at_next_eom |= edge_triggered;
     thread->prev_interrupts_pending = current_interrupts_pending;
   }
-#endif
 
   //
   // Compute reserved issue queue entries to avoid starvation:
@@ -960,6 +958,9 @@ bool ThreadContext::handle_barrier() {
   // Flush again, but restart at possibly modified rip
   flush_pipeline();
 
+  // The assist may have skipped sim_cycle over an idle period (see -virtual-sleep):
+  last_commit_at_cycle = sim_cycle;
+
 #ifndef PTLSIM_HYPERVISOR
   if (requested_switch_to_native) {
     logfile << "PTL call requested switch to native mode at rip ", (void*)(Waddr)ctx.commitarf[REG_rip], endl;
@@ -1059,7 +1060,6 @@ bool ThreadContext::handle_exception() {
 }
 
 bool ThreadContext::handle_interrupt() {
-#ifdef PTLSIM_HYPERVISOR
   // Release resources of everything in the pipeline:
   core_to_external_state();
   flush_pipeline();
@@ -1068,22 +1068,27 @@ bool ThreadContext::handle_interrupt() {
     logfile << "[vcpu ", threadid, "] interrupts pending at ", sim_cycle, " cycles, ", total_user_insns_committed, " commits", endl, flush;
     logfile << "Context at interrupt:", endl;
     logfile << ctx;
+#ifdef PTLSIM_HYPERVISOR
     logfile << sshinfo;
+#endif
     logfile.flush();
   }
 
+  // In userspace PTLsim, this may switch in a different guest thread:
   ctx.event_upcall();
 
   if (logable(6)) {
     logfile <<  "[vcpu ", threadid, "] after interrupt redirect:", endl;
     logfile << ctx;
+#ifdef PTLSIM_HYPERVISOR
     logfile << sshinfo;
+#endif
     logfile.flush();
   }
 
   // Flush again, but restart at modified rip
   flush_pipeline();
-#endif
+  last_commit_at_cycle = sim_cycle;
   return true;
 }
 
@@ -1673,6 +1678,12 @@ OutOfOrderMachine::OutOfOrderMachine(const char* name) {
 
 bool OutOfOrderMachine::init(PTLsimConfig& config) {
   // Note: we only create a single core for all contexts for now.
+  if unlikely (contextcount > MAX_THREADS_PER_CORE) {
+    logfile << "Cannot map ", contextcount, " contexts onto one core with ", MAX_THREADS_PER_CORE, " SMT threads", endl, flush;
+    cerr << "Cannot map ", contextcount, " contexts onto one core with ", MAX_THREADS_PER_CORE, " SMT threads", endl, flush;
+    return false;
+  }
+
   cores[0] = new OutOfOrderCore(0, *this);
 
   foreach (i, contextcount) {
@@ -1739,7 +1750,6 @@ int OutOfOrderMachine::run(PTLsimConfig& config) {
     int running_thread_count = 0;
     foreach (i, core.threadcount) {
       ThreadContext* thread = core.threads[i];
-#ifdef PTLSIM_HYPERVISOR
       running_thread_count += thread->ctx.running;
       if unlikely (!thread->ctx.running) {
         if unlikely (stopping) {
@@ -1751,7 +1761,6 @@ int OutOfOrderMachine::run(PTLsimConfig& config) {
         }
         continue;
       }
-#endif
     }
 
     exiting |= core.runcycle();
@@ -628,35 +628,54 @@ bool ThreadContext::fetch() {
 BasicBlock* ThreadContext::fetch_or_translate_basic_block(const RIPVirtPhys& rvp) {
   time_this_scope(ctdecode);
 
+  //
+  // A rep block branches back to itself once per iteration:
+  // keep fetching from the block we already hold a reference
+  // to, rather than releasing it and looking it up again.
+  //
+  if unlikely (current_basic_block && current_basic_block->repblock && (current_basic_block->rip == rvp)) {
+    current_basic_block->use(sim_cycle);
+    current_basic_block_transop_index = 0;
+    return current_basic_block;
+  }
+
   if likely (current_basic_block) {
     // Release our ref to the old basic block being fetched
     current_basic_block->release();
     current_basic_block = null;
   }
 
-  BasicBlock* bb = bbcache(rvp);
+  {
+    //
+    // Look up and acquire the block under the cache lock, so another
+    // thread cannot invalidate and free it before we hold a reference.
+    //
+    ScopedLock<RecursiveMutex> scope(bbcache.lock);
+
+    BasicBlock* bb = bbcache(rvp);
 
-  if likely (bb) {
-    current_basic_block = bb;
-  } else {
-    current_basic_block = bbcache.translate(ctx, rvp);
-    assert(current_basic_block);
-    if unlikely (config.event_log_enabled) {
-      OutOfOrderCoreEvent* event = core.eventlog.add(EVENT_FETCH_TRANSLATE, rvp);
-      event->fetch.bb_uop_count = current_basic_block->count;
-      event->threadid = threadid;
+    if likely (bb) {
+      current_basic_block = bb;
+    } else {
+      current_basic_block = bbcache.translate(ctx, rvp);
+      assert(current_basic_block);
+      if unlikely (config.event_log_enabled) {
+        OutOfOrderCoreEvent* event = core.eventlog.add(EVENT_FETCH_TRANSLATE, rvp);
+        event->fetch.bb_uop_count = current_basic_block->count;
+        event->threadid = threadid;
+      }
     }
-  }
 
-  //
-  // Acquire a reference to the new basic block being fetched.
-  // This must be done right away so future allocations do not
-  // reclaim the BB while we still have a reference to it.
-  //
-  current_basic_block->acquire();
+    //
+    // Acquire a reference to the new basic block being fetched.
+    // This must be done right away so future allocations do not
+    // reclaim the BB while we still have a reference to it.
+    //
+    current_basic_block->acquire();
+  }
   current_basic_block->use(sim_cycle);
 
-  if unlikely (!current_basic_block->synthops) synth_uops_for_bb(*current_basic_block);
+  // Synthops are bound when the block is translated
   assert(current_basic_block->synthops);
 
   current_basic_block_transop_index = 0;
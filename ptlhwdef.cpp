@@ -519,17 +519,26 @@ void BasicBlock::reset(const RIPVirtPhys& rip) {
 // in scope. Don't call this with non-cloned() blocks.
 //
 void BasicBlock::free() {
-  if (synthops) delete[] synthops;
+  // Synthops bound by bind_synthops() are part of the block itself
+  if (synthops && (synthops != (uopimpl_func_t*)&transops[count])) delete[] synthops;
   synthops = null;
+  if (superblock) delete superblock;
+  superblock = null;
   ::free(this);
 }
 
+//
+// The clone has room for one synthop per transop right after
+// its last transop (see bind_synthops()), so the block and its
+// uop implementations come from a single allocation.
+//
 BasicBlock* BasicBlock::clone() {
-  BasicBlock* bb = (BasicBlock*)malloc(sizeof(BasicBlockBase) + (count * sizeof(TransOp)));
+  BasicBlock* bb = (BasicBlock*)malloc(sizeof(BasicBlockBase) + (count * sizeof(TransOp)) + (count * sizeof(uopimpl_func_t)));
 
   memcpy(bb, this, sizeof(BasicBlockBase));
 
   bb->synthops = null;
+  bb->superblock = null;
   // hashlink, mfnlo_loc, mfnhi_loc are always updated after cloning
   bb->hashlink.reset();
   bb->use(0);
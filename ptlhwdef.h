@@ -831,7 +831,7 @@ struct ContextBase {
   W64 cached_pte_virt[PTE_CACHE_SIZE];
   Level1PTE cached_pte[PTE_CACHE_SIZE];
 #else
-  // Always running in userspace version:
+  // Cleared while a hardware context has no guest thread to run:
   byte running;
 #endif
 
@@ -927,6 +927,10 @@ struct Context: public ContextBase {
 #else
   void update_pte_acc_dirty(W64 rawvirt, const PTEUpdate& update) { }
   void update_shadow_segment_descriptors();
+
+  // Guest thread scheduling (see kernel.cpp):
+  bool check_events() const;
+  bool event_upcall();
 #endif
 };
 
@@ -1447,6 +1451,16 @@ enum {
   BRTYPE_JMP        = 7
 };
 
+//
+// Rep string blocks the sequential core can execute in bulk
+// (see BasicBlock::reptype):
+//
+enum {
+  REPTYPE_NONE      = 0,
+  REPTYPE_MOVS      = 1,
+  REPTYPE_STOS      = 2
+};
+
 static const char* branch_type_names[8] = {
   "bru8",
   "bru32",
@@ -1459,6 +1473,8 @@ static const char* branch_type_names[8] = {
 };
 
 
+struct SuperBlock;
+
 struct BasicBlockBase {
   RIPVirtPhys rip;
   selflistlink hashlink;
@@ -1474,8 +1490,10 @@ struct BasicBlockBase {
   W16 storecount;
   byte type:4, repblock:1, invalidblock:1, call:1, ret:1;
   byte marked:1, mfence:1, x87:1, sse:1, nondeterministic:1, brtype:3;
+  byte reptype:2, repsizeshift:2, repaddrsizeshift:2;
   W64 usedregs;
   uopimpl_func_t* synthops;
+  SuperBlock* superblock;
   int refcount;
   W32 hitcount;
   W32 predcount;
@@ -1483,14 +1501,15 @@ struct BasicBlockBase {
   W64 lastused;
   W64 lasttarget;
 
+  // Atomic, since fetch units may release blocks without the cache lock
   void acquire() {
-    refcount++;
+    xadd(refcount, 1);
   }
 
   bool release() {
-    refcount--;
-    assert(refcount >= 0);
-    return (!refcount);
+    int oldcount = xadd(refcount, -1);
+    assert(oldcount > 0);
+    return (oldcount == 1);
   }
 };
 
@@ -1500,12 +1519,31 @@ struct BasicBlock: public BasicBlockBase {
   void reset();
   void reset(const RIPVirtPhys& rip);
   BasicBlock* clone();
+  void bind_synthops();
   void free();
   void use(W64 counter) { lastused = counter; };
 };
 
 ostream& operator <<(ostream& os, const BasicBlock& bb);
 
+//
+// Superblock: a chain of cached basic blocks linked along
+// strongly biased edges (see BasicBlockCache::get_superblock).
+// It is owned by its first block and freed along with it; the
+// other blocks may only be used while bbcache.generation still
+// matches the generation the superblock was formed in.
+//
+#define MAX_SUPERBLOCK_BBS 16
+
+struct SuperBlock {
+  W64 generation;
+  W64 hits;
+  W64 side_exits;
+  int count;
+  int user_insn_count;
+  BasicBlock* bbs[MAX_SUPERBLOCK_BBS];
+};
+
 //
 // Printing and information
 //
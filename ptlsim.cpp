@@ -70,6 +70,8 @@ void PTLsimConfig::reset() {
   stats_filename.reset();
   snapshot_cycles = infinity;
   snapshot_now.reset();
+  stats_checkpoint_interval = 16;
+  progress_stats.reset();
 
 #ifndef PTLSIM_HYPERVISOR
   // Starting Point
@@ -77,6 +79,8 @@ void PTLsimConfig::reset() {
   include_dyn_linker = 1;
   trigger_mode = 0;
   pause_at_startup = 0;
+  native_insns = 0;
+  native_branches = 0;
 #endif
 
   stop_at_user_insns = infinity;
@@ -109,6 +113,7 @@ void PTLsimConfig::reset() {
 
   continuous_validation = 0;
   validation_start_cycle = 0;
+  x87_exact_math = 0;
 
   perfect_cache = 0;
 
@@ -116,10 +121,36 @@ void PTLsimConfig::reset() {
   dump_at_end = 0;
   overshoot_and_dump = 0;
   bbcache_dump_filename.reset();
+  translate_ahead_blocks = 0;
+  superblock_threshold = 0;
+  decoder_opcode_stats = 0;
+  invalid_opcode_dump_filename.reset();
 
 #ifndef PTLSIM_HYPERVISOR
   sequential_mode_insns = 0;
   exit_after_fullsim = 0;
+
+  sample_interval = 0;
+  sample_warmup_insns = 1000000;
+  sample_insns = 10000000;
+  sample_jobs = 0;
+
+  interleave_native_insns = 0;
+  interleave_warmup_insns = 1000000;
+  interleave_sim_insns = 10000000;
+
+  fast_vdso = 1;
+  virtual_sleep = 1;
+
+  hardware_contexts = 1;
+  thread_quantum = 1000000;
+
+  log_syscalls = 0;
+  syscall_trace_filename.reset();
+  syscall_trace_buffer_size = 4096;
+
+  syscall_record_filename.reset();
+  syscall_replay_filename.reset();
 #endif
 }
 
@@ -171,6 +202,8 @@ void ConfigurationParser<PTLsimConfig>::setup() {
   add(stats_filename,               "stats",                "Statistics data store hierarchy root");
   add(snapshot_cycles,              "snapshot-cycles",      "Take statistical snapshot and reset every <snapshot> cycles");
   add(snapshot_now,                 "snapshot-now",         "Take statistical snapshot immediately, using specified name");
+  add(stats_checkpoint_interval,    "stats-checkpoint",     "Write a stats file checkpoint every <n> snapshots, so killed runs keep their stats (0 = only at exit)");
+  add(progress_stats,               "progress-stats",       "Show these stats counters (comma separated paths, e.g. ooocore.commit.result.ok) in each progress update");
 #ifndef PTLSIM_HYPERVISOR
   // Userspace only
   section("Start Point");
@@ -178,6 +211,8 @@ void ConfigurationParser<PTLsimConfig>::setup() {
   add(include_dyn_linker,           "excludeld",            "Exclude dynamic linker execution");
   add(trigger_mode,                 "trigger",              "Trigger mode: wait for user process to do simcall before entering PTL mode");
   add(pause_at_startup,             "pause-at-startup",     "Pause for N seconds after starting up (to allow debugger to attach)");
+  add(native_insns,                 "native-insns",         "Run natively until N user instructions have retired (counted by host perf counters), then start simulating");
+  add(native_branches,              "native-branches",      "Run natively until N user branches have retired (counted by host perf counters), then start simulating");
 #endif
 
   section("Trace Stop Point");
@@ -214,6 +249,7 @@ void ConfigurationParser<PTLsimConfig>::setup() {
   section("Validation");
   add(continuous_validation,        "validate",             "Continuous validation: validate against known-good sequential model");
   add(validation_start_cycle,       "validate-start-cycle", "Start continuous validation after N cycles");
+  add(x87_exact_math,               "x87-exact",            "Evaluate x87 transcendentals (fsin, fcos, etc) in the software math library rather than on the host x87 unit");
 
   section("Out of Order Core (ooocore)");
   add(perfect_cache,                "perfect-cache",        "Perfect cache performance: all loads and stores hit in L1");
@@ -223,10 +259,42 @@ void ConfigurationParser<PTLsimConfig>::setup() {
   add(dump_at_end,                  "dump-at-end",          "Set breakpoint and dump core before first instruction executed on return to native mode");
   add(overshoot_and_dump,           "overshoot-and-dump",   "Set breakpoint and dump core after first instruction executed on return to native mode");
   add(bbcache_dump_filename,        "bbdump",               "Basic block cache dump filename");
+  add(translate_ahead_blocks,       "translate-ahead",      "On each basic block cache miss, also translate up to N blocks statically reachable from the missing block");
+  add(superblock_threshold,         "superblock-threshold", "Sequential core: chain blocks along strongly biased edges into superblocks once a block has run N times (0 to disable)");
+  add(decoder_opcode_stats,         "opcode-stats",         "Count decoded x86 insns, decoder path, assists and uops by opcode in stats.decoder.opcodes (needs ENABLE_OPCODE_STATS in decode.h)");
+  add(invalid_opcode_dump_filename, "invalid-opcode-dump",  "Append every opcode the decoder cannot translate (with its rip and bytes) to this file");
 #ifndef PTLSIM_HYPERVISOR
   // Userspace only
   add(sequential_mode_insns,        "seq",                  "Run in sequential mode for <seq> instructions before switching to out of order");
   add(exit_after_fullsim,           "exitend",              "Kill the thread after full simulation completes rather than going native");
+
+  section("Parallel Sampling");
+  add(sample_interval,              "sample-interval",      "Fast-forward in the sequential core and fork a detailed simulation child every N user instructions (0 to disable)");
+  add(sample_warmup_insns,          "sample-warmup",        "Warm up each sample child's core for N user instructions before its measured interval");
+  add(sample_insns,                 "sample-insns",         "Measure N user instructions in each sample child");
+  add(sample_jobs,                  "sample-jobs",          "Run at most N sample children at once (0 = one per host processor)");
+
+  section("Native Interleaving");
+  add(interleave_native_insns,      "interleave-native",    "Alternate between simulated windows and N user instructions of native execution, counted by host perf counters (0 to disable)");
+  add(interleave_warmup_insns,      "interleave-warmup",    "Warm up the core for N user instructions at the start of each simulated window");
+  add(interleave_sim_insns,         "interleave-sim",       "Measure N user instructions in each simulated window");
+
+  section("Simulated Time");
+  add(fast_vdso,                    "fast-vdso",            "Run vDSO clock_gettime, gettimeofday and time as one assist returning simulated time (0 = simulate the syscalls)");
+  add(virtual_sleep,                "virtual-sleep",        "Complete nanosleep, poll and epoll_wait timeouts in simulated time, skipping idle cycles when all threads sleep (0 = block on the host)");
+
+  section("Guest Threads");
+  add(hardware_contexts,            "contexts",             "Schedule guest threads onto N simulated hardware thread contexts (up to 4; ooo core needs SMT for more than 1)");
+  add(thread_quantum,               "thread-quantum",       "Preempt a guest thread after N cycles when other guest threads are waiting to run");
+
+  section("Syscall Tracing");
+  add(log_syscalls,                 "log-syscalls",         "Log every guest syscall with its arguments and result");
+  add(syscall_trace_filename,       "syscall-trace",        "Write a binary SyscallTraceRecord for every guest syscall to this file");
+  add(syscall_trace_buffer_size,    "syscall-trace-bufsize", "Buffer N syscall trace records in memory between writes");
+
+  section("Record and Replay");
+  add(syscall_record_filename,      "record-syscalls",      "Log syscall results, the guest memory they write and rdtsc values to this file");
+  add(syscall_replay_filename,      "replay-syscalls",      "Replay a -record-syscalls log instead of executing passthrough syscalls on the host");
 #endif
 };
 
@@ -302,7 +370,9 @@ void print_usage(int argc, char** argv) {
 
 stringbuf current_stats_filename;
 stringbuf current_log_filename;
+stringbuf current_progress_stats;
 stringbuf current_bbcache_dump_filename;
+stringbuf current_invalid_opcode_dump_filename;
 
 void backup_and_reopen_logfile() {
   if (config.log_filename) {
@@ -354,6 +424,53 @@ void flush_stats() {
   statswriter.flush();
 }
 
+//
+// Switch a forked child over to its own stats file without
+// touching the file it inherited from its parent.
+//
+void reopen_stats_after_fork(const char* filename) {
+  statswriter.discard();
+  statswriter.open(filename, &_binary_ptlsim_dst_start,
+                   &_binary_ptlsim_dst_end - &_binary_ptlsim_dst_start,
+                   sizeof(PTLsimStats));
+  current_stats_filename = filename;
+}
+
+//
+// Counters shown by update_progress(), compiled once against the
+// template into offsets within the live stats structure:
+//
+char* progress_stats_list = null;
+dynarray<char*> progress_stats_names;
+dynarray<DataStorePath> progress_stats_paths;
+
+void compile_progress_stats(const char* list) {
+  if (progress_stats_list) free(progress_stats_list);
+  progress_stats_list = strdup(list);
+  progress_stats_names.clear();
+  progress_stats_paths.clear();
+
+  dynarray<char*> names;
+  names.tokenize(progress_stats_list, ",");
+
+  foreach (i, names.length) {
+    DataStorePath path;
+    if (!path.compile(&_binary_ptlsim_dst_start, &_binary_ptlsim_dst_end - &_binary_ptlsim_dst_start, names[i])) {
+      logfile << "Warning: progress stats counter '", names[i], "' does not exist", endl;
+      continue;
+    }
+
+    if ((!path.numeric()) | (path.count != 1)) {
+      logfile << "Warning: progress stats path '", names[i], "' must name a single int or float counter", endl;
+      continue;
+    }
+
+    assert((path.offset + path.size) <= sizeof(PTLsimStats));
+    progress_stats_names.push(names[i]);
+    progress_stats_paths.push(path);
+  }
+}
+
 void print_sysinfo(ostream& os);
 
 bool handle_config_change(PTLsimConfig& config, int argc, char** argv) {
@@ -375,6 +492,13 @@ bool handle_config_change(PTLsimConfig& config, int argc, char** argv) {
     current_stats_filename = config.stats_filename;
   }
 
+  statswriter.checkpoint_interval = config.stats_checkpoint_interval;
+
+  if (config.progress_stats != current_progress_stats) {
+    compile_progress_stats(config.progress_stats);
+    current_progress_stats = config.progress_stats;
+  }
+
   logfile.setbuf(config.log_buffer_size);
 
   if ((config.loglevel > 0) & (config.start_log_at_rip == INVALIDRIP) & (config.start_log_at_iteration == infinity)) {
@@ -406,6 +530,19 @@ bool handle_config_change(PTLsimConfig& config, int argc, char** argv) {
     current_bbcache_dump_filename = config.bbcache_dump_filename;
   }
 
+#ifndef ENABLE_OPCODE_STATS
+  if (config.decoder_opcode_stats) {
+    logfile << "Warning: -opcode-stats needs ENABLE_OPCODE_STATS in decode.h at build time; ignored", endl;
+    config.decoder_opcode_stats = 0;
+  }
+#endif
+
+  if (config.invalid_opcode_dump_filename.set() && (config.invalid_opcode_dump_filename != current_invalid_opcode_dump_filename)) {
+    if (invalid_opcode_dump_file) invalid_opcode_dump_file.close();
+    invalid_opcode_dump_file.open(config.invalid_opcode_dump_filename, true);
+    current_invalid_opcode_dump_filename = config.invalid_opcode_dump_filename;
+  }
+
   if (config.log_trigger_virt_addr_start && (!config.log_trigger_virt_addr_end)) {
     config.log_trigger_virt_addr_end = config.log_trigger_virt_addr_start;
   }
@@ -520,6 +657,14 @@ void update_progress() {
       sb << ' ', (void*)contextof(i).commitarf[REG_rip];
     }
 
+    foreach (i, progress_stats_paths.length) {
+      const DataStorePath& path = progress_stats_paths[i];
+      sb << "; ", progress_stats_names[i], ' ';
+      if (path.type == DataStoreNodeTemplate::DS_NODE_TYPE_FLOAT)
+        sb << floatstring(path.get(&stats), 0, 3);
+      else sb << path.getint(&stats);
+    }
+
     while (sb.size() < 160) sb << ' ';
 
     logfile << sb, endl, flush;
@@ -83,6 +83,7 @@ void split_unaligned(const TransOp& transop, TransOpBuffer& buf);
 
 void capture_stats_snapshot(const char* name = null);
 void flush_stats();
+void reopen_stats_after_fork(const char* filename);
 bool handle_config_change(PTLsimConfig& config, int argc = 0, char** argv = null);
 void collect_common_sysinfo(PTLsimStats& stats);
 void collect_sysinfo(PTLsimStats& stats, int argc, char** argv);
@@ -169,6 +170,8 @@ struct PTLsimConfig {
   stringbuf stats_filename;
   W64 snapshot_cycles;
   stringbuf snapshot_now;
+  W64 stats_checkpoint_interval;
+  stringbuf progress_stats;
 
 #ifndef PTLSIM_HYPERVISOR
   // Starting Point
@@ -176,6 +179,8 @@ struct PTLsimConfig {
   bool include_dyn_linker;
   bool trigger_mode;
   W64 pause_at_startup;
+  W64 native_insns;
+  W64 native_branches;
 #endif
 
   // Stopping Point
@@ -210,6 +215,7 @@ struct PTLsimConfig {
 
   bool continuous_validation;
   W64 validation_start_cycle;
+  bool x87_exact_math;
 
   // Out of order core features
   bool perfect_cache;
@@ -219,11 +225,43 @@ struct PTLsimConfig {
   bool dump_at_end;
   bool overshoot_and_dump;
   stringbuf bbcache_dump_filename;
+  W64 translate_ahead_blocks;
+  W64 superblock_threshold;
+  bool decoder_opcode_stats;
+  stringbuf invalid_opcode_dump_filename;
 
 #ifndef PTLSIM_HYPERVISOR
   // Simulation Mode
   W64 sequential_mode_insns;
   bool exit_after_fullsim;
+
+  // Parallel Sampling
+  W64 sample_interval;
+  W64 sample_warmup_insns;
+  W64 sample_insns;
+  W64 sample_jobs;
+
+  // Native Interleaving
+  W64 interleave_native_insns;
+  W64 interleave_warmup_insns;
+  W64 interleave_sim_insns;
+
+  // Simulated Time
+  bool fast_vdso;
+  bool virtual_sleep;
+
+  // Guest Threads
+  W64 hardware_contexts;
+  W64 thread_quantum;
+
+  // Syscall Tracing
+  bool log_syscalls;
+  stringbuf syscall_trace_filename;
+  W64 syscall_trace_buffer_size;
+
+  // Record and Replay
+  stringbuf syscall_record_filename;
+  stringbuf syscall_replay_filename;
 #endif
   void reset();
 };
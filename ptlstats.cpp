@@ -7,6 +7,7 @@
 
 #include <globals.h>
 #include <datastore.h>
+#include <pthread.h>
 #define PTLSIM_PUBLIC_ONLY
 #include <ptlhwdef.h>
 
@@ -20,6 +21,8 @@ struct PTLstatsConfig {
   stringbuf mode_table;
   stringbuf mode_slice;
   stringbuf mode_slice_graph;
+  stringbuf mode_merge;
+  stringbuf mode_export;
 
   stringbuf table_row_names;
   stringbuf table_col_names;
@@ -59,6 +62,8 @@ struct PTLstatsConfig {
 
   bool print_datastore_info;
   bool print_template;
+  W64 jobs;
+  W64 export_block_rows;
 
   void reset();
 };
@@ -73,6 +78,8 @@ void PTLstatsConfig::reset() {
   mode_table.reset();
   mode_slice.reset();
   mode_slice_graph.reset();
+  mode_merge.reset();
+  mode_export.reset();
 
   table_row_names.reset();
   table_col_names.reset();
@@ -112,6 +119,8 @@ void PTLstatsConfig::reset() {
 
   print_datastore_info = 0;
   print_template = 0;
+  jobs = 0;
+  export_block_rows = 256;
 }
 
 PTLstatsConfig config;
@@ -129,6 +138,8 @@ void ConfigurationParser<PTLstatsConfig>::setup() {
   add(mode_table,                       "table",                     "Table of one node across multiple data stores");
   add(mode_slice,                       "slice",                     "Slice of every snapshot, in list format");
   add(mode_slice_graph,                 "slice-graph",               "Slice of every snapshot, in line graph format");
+  add(mode_merge,                       "merge",                     "Merge snapshot (minus -subtract) of all data stores into this new data store");
+  add(mode_export,                      "export",                    "Export every snapshot of all data stores into this columnar file");
 
   section("Table or Graph");
   add(table_row_names,                  "rows",                      "Row names (comma separated)");
@@ -169,6 +180,8 @@ void ConfigurationParser<PTLstatsConfig>::setup() {
   section("Miscellaneous");
   add(print_datastore_info,             "info",                      "Print information about the data store file");
   add(print_template,                   "template",                  "Print template in C++ struct format");
+  add(jobs,                             "jobs",                      "Read stats files with N threads in collect, table and bargraph modes (0 = one per host processor)");
+  add(export_block_rows,                "export-block",              "Snapshots per block of columns in export mode");
 };
 
 struct RGBAColor {
@@ -452,8 +465,14 @@ void create_svg_of_histogram_percent_bargraph(ostream& os, W64s* histogram, int
   svg.exitlayer();
 }
 
+//
+// If yminpoints and ymaxpoints are given (for samples that each stand
+// for a range of snapshots), the range of each unstacked line is
+// shaded behind it.
+//
 void create_svg_of_percentage_line_graph(ostream& os, double* xpoints, int xcount, double** ypoints, int ycount, char** ynames,
-                                         double imagewidth, double imageheight, const LineAttributes* linetype, const RGBA& background, bool stacked) {
+                                         double imagewidth, double imageheight, const LineAttributes* linetype, const RGBA& background, bool stacked,
+                                         double** yminpoints = null, double** ymaxpoints = null) {
   double leftpad = 10.0;
   double toppad = 5.0;
   double rightpad = 4.0;
@@ -564,6 +583,44 @@ void create_svg_of_percentage_line_graph(ostream& os, double* xpoints, int xcoun
   }
   */
 
+  if ((!stacked) && yminpoints && ymaxpoints) {
+    for (int col = ycount-1; col >= 0; col--) {
+      const LineAttributes& line = (linetype) ? linetype[col] : black_linetype;
+
+      if (!line.enabled)
+        continue;
+
+      svg.strokewidth = 0;
+      svg.setdash(0);
+      svg.filled = 1;
+      svg.fill = RGBA(line.stroke.r, line.stroke.g, line.stroke.b, 64);
+
+      // Along the maxima, then back along the minima:
+      foreach (k, 2*xcount) {
+        int sample = (k < xcount) ? k : (2*xcount - 1 - k);
+        double yy = (k < xcount) ? ymaxpoints[col][sample] : yminpoints[col][sample];
+        double xp = xpoints[sample] * xscale;
+        double yp = imageheight - (yy * yscale);
+        if (sample == 0) xp = 0; else if (sample == xcount-1) xp = imagewidth;
+        yp = clipto(yp, 0.0, imageheight - 1);
+        if (k == 0) {
+          char* pathname = null;
+          stringbuf sb;
+          if (ynames) {
+            sb << "range_", ynames[col];
+            pathname = sb;
+          }
+          svg.startpath(xp, yp, pathname);
+        } else {
+          svg.nextpoint(xp, yp);
+        }
+      }
+
+      svg.closepath();
+      svg.endpath();
+    }
+  }
+
   for (int col = ycount-1; col >= 0; col--) {
     const LineAttributes& line = (linetype) ? linetype[col] : black_linetype;
     svg.strokewidth = line.width;
@@ -669,20 +726,118 @@ void printbanner() {
   cerr << endl;
 }
 
-DataStoreNode* collect_into_supernode(int argc, char** argv, char* path, const char* deltastart = null, const char* deltaend = "final") {
-  DataStoreNode* supernode = new DataStoreNode("super");
+//
+// Parallel collection from many stats files
+//
+// Worker threads each open files with their own reader and read only
+// the requested subtree (see StatsFileReader::getpath()). Results go
+// into per-file slots, and the caller merges and reports errors in
+// argument order, so the output is identical to a serial run.
+//
+enum { COLLECT_OK, COLLECT_CANNOT_OPEN, COLLECT_NO_SNAPSHOT, COLLECT_NO_SUBTREE };
+
+struct CollectJob {
+  const char* filename;
+  DataStoreNode* result;
+  int status;
+};
+
+struct CollectPool {
+  CollectJob* jobs;
+  int count;
+  int next;
+  const char* path;
+  const char* name;
+  const char* namesub;
+};
+
+static void collect_one(CollectJob& job, StatsFileReader& reader, const CollectPool& pool) {
+  job.result = null;
+
+  if (!reader.open(job.filename, true)) {
+    job.status = COLLECT_CANNOT_OPEN;
+    return;
+  }
 
+  W64s uuid = reader.uuid_of_name(pool.name);
+  W64s uuidsub = (pool.namesub) ? reader.uuid_of_name(pool.namesub) : -1;
+
+  if ((uuid < 0) || (uuid >= reader.header.record_count) || (pool.namesub && ((uuidsub < 0) || (uuidsub >= reader.header.record_count)))) {
+    job.status = COLLECT_NO_SNAPSHOT;
+  } else {
+    job.result = reader.getpath(pool.path, uuid, uuidsub);
+    job.status = (job.result) ? COLLECT_OK : COLLECT_NO_SUBTREE;
+  }
+
+  reader.close();
+}
+
+static void* collect_thread(void* arg) {
+  CollectPool& pool = *(CollectPool*)arg;
   StatsFileReader reader;
 
+  for (;;) {
+    int i = __sync_fetch_and_add(&pool.next, 1);
+    if (i >= pool.count) break;
+    collect_one(pool.jobs[i], reader, pool);
+  }
+
+  return null;
+}
+
+static void collect_parallel(CollectJob* jobs, int count, const char* path, const char* name, const char* namesub) {
+  if (!count) return;
+
+  CollectPool pool;
+  pool.jobs = jobs;
+  pool.count = count;
+  pool.next = 0;
+  pool.path = path;
+  pool.name = name;
+  pool.namesub = namesub;
+
+  int threads = (config.jobs) ? (int)config.jobs : (int)sysconf(_SC_NPROCESSORS_ONLN);
+  threads = clipto(threads, 1, count);
+
+  dynarray<pthread_t> tids;
+
+  foreach (i, threads-1) {
+    pthread_t tid;
+    if (pthread_create(&tid, null, collect_thread, &pool)) break;
+    tids.push(tid);
+  }
+
+  // The main thread is a worker too:
+  collect_thread(&pool);
+
+  foreach (i, tids.length) pthread_join(tids[i], null);
+}
+
+DataStoreNode* collect_into_supernode(int argc, char** argv, char* path, const char* deltastart = null, const char* deltaend = "final") {
+  CollectJob* jobs = new CollectJob[argc];
+  foreach (i, argc) jobs[i].filename = argv[i];
+
+  collect_parallel(jobs, argc, path, deltaend, deltastart);
+
+  DataStoreNode* supernode = new DataStoreNode("super");
+
   foreach (i, argc) {
     char* filename = argv[i];
-    DataStoreNode* endbase;
-    DataStoreNode* end;
-    DataStoreNode* startbase;
-    DataStoreNode* start;
+    CollectJob& job = jobs[i];
+
+    if (job.status != COLLECT_OK) {
+      switch (job.status) {
+      case COLLECT_CANNOT_OPEN:
+        cerr << "ptlstats: Cannot open '", filename, "'", endl, endl; break;
+      case COLLECT_NO_SNAPSHOT:
+        cerr << "ptlstats: Error: cannot find ending snapshot '", deltaend, "' or starting snapshot '", deltastart, "'", endl; break;
+      case COLLECT_NO_SUBTREE:
+        cerr << "ptlstats: Error: cannot find subtree '", path, "'", endl; break;
+      }
 
-    if (!reader.open(filename)) {
-      cerr << "ptlstats: Cannot open '", filename, "'", endl, endl;
+      for (int j = i; j < argc; j++) if (jobs[j].result) delete jobs[j].result;
+      delete supernode;
+      delete[] jobs;
       return null;
     }
 
@@ -690,27 +845,11 @@ DataStoreNode* collect_into_supernode(int argc, char** argv, char* path, const c
     int filenamelen = strlen(filename);
     foreach (i, filenamelen) { if (filename[i] == '/') filename[i] = ':'; }
 
-    DataStoreNode* dsbase = (deltastart) ? reader.getdelta(deltaend, deltastart) : reader.get(deltaend);
-
-    if (!dsbase) {
-      cerr << "ptlstats: Error: cannot find ending snapshot '", deltaend, "' or starting snapshot '", deltastart, "'", endl;
-      reader.close();
-      return null;
-    }
-
-    DataStoreNode* ds = null;
-
-    if (!(ds = dsbase->searchpath(path))) {
-      cerr << "ptlstats: Error: cannot find subtree '", path, "'", endl;
-      delete dsbase;
-      reader.close();
-      return null;
-    }
-
-    ds->rename(filename);
-    supernode->add(ds);
+    job.result->rename(filename);
+    supernode->add(job.result);
   }
 
+  delete[] jobs;
   return supernode;
 }
 
@@ -827,49 +966,68 @@ bool capture_table(dynarray<char*>& rowlist, dynarray<char*>& collist, dynarray<
   //
   const char* findarray[2] = {"%row", "%col"};
 
-  StatsFileReader reader;
+  int cols = collist.size();
+  int count = rowlist.size() * cols;
+  CollectJob* jobs = new CollectJob[count];
+  dynarray<stringbuf*> filenames;
 
-  for (int row = 0; row < rowlist.size(); row++) {
-    data[row].resize(collist.size());
+  foreach (i, count) {
+    stringbuf* filename = new stringbuf();
 
-    for (int col = 0; col < collist.size(); col++) {
-      stringbuf filename;
+    const char* replarray[2];
+    replarray[0] = rowlist[i / cols];
+    replarray[1] = collist[i % cols];
+    stringsubst(*filename, config.table_row_col_pattern, findarray, replarray, 2);
 
-      const char* replarray[2];
-      replarray[0] = rowlist[row];
-      replarray[1] = collist[col];
-      stringsubst(filename, config.table_row_col_pattern, findarray, replarray, 2);
+    filenames.push(filename);
+    jobs[i].filename = *filename;
+  }
 
-      if (!reader.open(filename)) {
-        cerr << "ptlstats: Cannot open '", filename, "' for row ", row, ", col ", col, endl, endl, flush;
-        return false;
-      }
+  collect_parallel(jobs, count, statname, config.snapshot, null);
 
-      DataStoreNode* ds = reader.get(config.snapshot);
-      if (!ds) {
-        cerr << "ptlstats: Cannot open snapshot '", config.snapshot, "' in '", filename, "' for row ", row, ", col ", col, endl, endl, flush;
-        reader.close();
-        return false;
-      }
+  bool ok = true;
 
-      ds = ds->searchpath(statname);
+  foreach (i, count) {
+    int row = i / cols;
+    int col = i % cols;
+    CollectJob& job = jobs[i];
 
-      double value;
-      if (ds) {
-        value = *ds;
-        sum_of_all_rows[col] += value;
-      } else { 
-        cerr << "ptlstats: Warning: cannot find subtree '", statname, "' for row ", row, ", col ", col, endl;
-        value = 0;
-      }
+    if (col == 0) data[row].resize(cols);
+
+    if (!ok) {
+      if (job.result) delete job.result;
+      continue;
+    }
+
+    if (job.status == COLLECT_CANNOT_OPEN) {
+      cerr << "ptlstats: Cannot open '", job.filename, "' for row ", row, ", col ", col, endl, endl, flush;
+      ok = false;
+      continue;
+    }
 
-      data[row][col] = value;
+    if (job.status == COLLECT_NO_SNAPSHOT) {
+      cerr << "ptlstats: Cannot open snapshot '", config.snapshot, "' in '", job.filename, "' for row ", row, ", col ", col, endl, endl, flush;
+      ok = false;
+      continue;
+    }
 
-      reader.close();
+    double value;
+    if (job.result) {
+      value = *job.result;
+      sum_of_all_rows[col] += value;
+      delete job.result;
+    } else { 
+      cerr << "ptlstats: Warning: cannot find subtree '", statname, "' for row ", row, ", col ", col, endl;
+      value = 0;
     }
+
+    data[row][col] = value;
   }
 
-  return true;
+  foreach (i, filenames.length) delete filenames[i];
+  delete[] jobs;
+
+  return ok;
 }
 
 void create_table(ostream& os, int tabletype, char* statname, char* rownames, char* colnames, char* row_col_pattern, int scale_relative_to_col) {
@@ -1213,6 +1371,18 @@ int main(int argc, char* argv[]) {
     avgnode->rename(config.mode_collect_average);
     avgnode->print(cout, printinfo);
     delete supernode;
+  } else if (config.mode_merge.set()) {
+    argv += n; argc -= n;
+    if (!merge_stats_files(config.mode_merge, argv, argc, snapshot, subtract_branch)) {
+      cerr << "ptlstats: Error: no data stores could be merged into '", config.mode_merge, "'", endl;
+      return 2;
+    }
+  } else if (config.mode_export.set()) {
+    argv += n; argc -= n;
+    if (!export_stats_columns(config.mode_export, argv, argc, config.export_block_rows)) {
+      cerr << "ptlstats: Error: no data stores could be exported into '", config.mode_export, "'", endl;
+      return 2;
+    }
   } else if (config.mode_table.set()) {
     if ((!config.table_row_names.set()) | (!config.table_col_names.set())) {
       cerr << "ptlstats: Error: must specify both -rows and -cols options for the table mode", endl;
@@ -1261,90 +1431,157 @@ int main(int argc, char* argv[]) {
       cout << endl;
     }
 
-    double* xpoints = new double[reader.header.record_count];
-    double** ypoints = new double*[colnames.length];
+    //
+    // Compile each column into an offset in the raw records once,
+    // so each snapshot costs one read and a few subtractions
+    // instead of a full tree reconstruction and search:
+    //
+    DataStorePath* paths = new DataStorePath[colnames.length];
 
     foreach (col, colnames.length) {
-      ypoints[col] = new double[reader.header.record_count];
+      if (!reader.compile(paths[col], colnames[col])) {
+        cerr << "ptlstats: Error: cannot find subtree '", colnames[col], "' in column ", col, endl;
+        delete[] paths;
+        return 1;
+      }
+
+      if (paths[col].type != DataStoreNodeTemplate::DS_NODE_TYPE_INT) {
+        cerr << "ptlstats: Error: slice '", colnames[col], "' cannot be taken for this node time", endl;
+        delete[] paths;
+        return 1;
+      }
     }
 
-    W64 basecycle = 0;
+    //
+    // Snapshots are streamed: each record is read, subtracted from
+    // the previous one and printed or folded into the graph, so only
+    // two records are kept. The graph keeps one sample per unit of
+    // width, each with the mean, minimum and maximum of its snapshots.
+    //
+    W64 record_count = reader.header.record_count;
+    int bucket_count = 0;
+    double* xpoints = null;
+    double** ypoints = null;
+    double** yminpoints = null;
+    double** ymaxpoints = null;
+    W64* bucket_samples = null;
 
-    foreach (i, reader.header.record_count) {
-      bool do_subtract = ((!config.slice_cumulative) && (i > 0));
-      DataStoreNode* dsroot = (do_subtract) ? reader.getdelta(i, i-1) : reader.get(i);
+    if (graphing) {
+      bucket_count = (int)min(record_count, (W64)max(math::ceil(config.graph_width), 1.0));
+      xpoints = new double[bucket_count];
+      ypoints = new double*[colnames.length];
+      yminpoints = new double*[colnames.length];
+      ymaxpoints = new double*[colnames.length];
+      bucket_samples = new W64[bucket_count];
+
+      foreach (b, bucket_count) {
+        xpoints[b] = 0;
+        bucket_samples[b] = 0;
+      }
+
+      foreach (col, colnames.length) {
+        ypoints[col] = new double[bucket_count];
+        yminpoints[col] = new double[bucket_count];
+        ymaxpoints[col] = new double[bucket_count];
+        foreach (b, bucket_count) {
+          ypoints[col][b] = 0;
+          yminpoints[col][b] = 0;
+          ymaxpoints[col][b] = 0;
+        }
+      }
+    }
+
+    double* values = new double[colnames.length];
+    byte* record = new byte[reader.header.record_size];
+    byte* prevrecord = new byte[reader.header.record_size];
 
-      if (!graphing) cout << intstring(i, 16);
+    foreach (i, record_count) {
+      bool do_subtract = ((!config.slice_cumulative) && (i > 0));
 
-      xpoints[i] = i;
+      if (!reader.getraw(i, record)) {
+        cerr << "ptlstats: Error: cannot read snapshot ", i, endl;
+        record_count = i;
+        break;
+      }
 
       double sum = 0;
 
       foreach (col, colnames.length) {
-        DataStoreNode* ds = dsroot->searchpath(colnames[col]);
-
-        if (!ds) {
-          cerr << "ptlstats: Error: cannot find subtree '", colnames[col], "' in column ", col, endl;
-          break;
-        }
-        
-        if (ds->type != DataStoreNode::DS_NODE_TYPE_INT) {
-          cerr << "ptlstats: Error: slice '", colnames[col], "' cannot be taken for this node time", endl;
-          break;
-        }
-        
-        W64 rawvalue = W64(*ds);
+        const DataStorePath& path = paths[col];
+        W64 rawvalue = path.getint(record);
+        if (do_subtract) rawvalue -= path.getint(prevrecord);
         double value = rawvalue;
         if (isnan(value)) value = 0;
         sum += value;
+        values[col] = value;
+      }
 
-        /*
-        if (graphing) {
-          // graph it later
-        } else {
-          cout << ' ', intstring(rawvalue, 16);
-        }
-        */
-        /*
-        if (config.use_percents) {
-          if (config.percent_of_toplevel)
-            value = (ds->percent_of_toplevel() * 100);
-          else value = (ds->percent_of_parent() * 100);
-        }
-        */
-        ypoints[col][i] = value;
+      if (config.use_percents && sum) {
+        foreach (col, colnames.length) values[col] = 100 * (values[col] / sum);
       }
 
-      foreach (col, colnames.length) {
-        double& value = ypoints[col][i];
-        if (config.use_percents) {
-          if (sum) value = 100 * (value / sum);
+      if (graphing) {
+        int b = (int)((i * bucket_count) / record_count);
+        W64 n = bucket_samples[b]++;
+        xpoints[b] += i;
+        foreach (col, colnames.length) {
+          double value = values[col];
+          ypoints[col][b] += value;
+          yminpoints[col][b] = (n) ? min(yminpoints[col][b], value) : value;
+          ymaxpoints[col][b] = (n) ? max(ymaxpoints[col][b], value) : value;
         }
-        if (graphing) {
-          // graph it later
-        } else {
-          cout << ' ', floatstring(value, 16, 1);
+      } else {
+        cout << intstring(i, 16);
+        foreach (col, colnames.length) {
+          cout << ' ', floatstring(values[col], 16, 1);
         }
+        cout << endl;
       }
 
-      if (!graphing) cout << endl;
-
-      DataStoreNode* dscycle = dsroot->searchpath("summary.cycles");
-      assert(dscycle);
-      basecycle += W64(*dscycle);
-      delete dsroot;
+      swap(record, prevrecord);
     }
 
+    delete[] record;
+    delete[] prevrecord;
+    delete[] values;
+    delete[] paths;
+
     if (graphing) {
-      create_svg_of_percentage_line_graph(cout, xpoints, reader.header.record_count, ypoints, colnames.length, colnames,
-                                          config.graph_width, config.graph_height, null, graph_background, config.graph_stacked);
-    }
+      // Sum to mean, dropping empty buckets if the file was cut short:
+      int samples = 0;
+      foreach (b, bucket_count) {
+        W64 n = bucket_samples[b];
+        if (!n) continue;
+        xpoints[samples] = xpoints[b] / n;
+        foreach (col, colnames.length) {
+          ypoints[col][samples] = ypoints[col][b] / n;
+          yminpoints[col][samples] = yminpoints[col][b];
+          ymaxpoints[col][samples] = ymaxpoints[col][b];
+        }
+        samples++;
+      }
 
-    foreach (j, colnames.length) {
-      delete[] ypoints[j];
-    }
+      // Label the x axis by snapshot, as when every snapshot is a sample:
+      if (samples) xpoints[samples-1] = record_count-1;
+
+      bool ranges = (W64(samples) < record_count);
 
-    delete[] xpoints;
+      create_svg_of_percentage_line_graph(cout, xpoints, samples, ypoints, colnames.length, colnames,
+                                          config.graph_width, config.graph_height, null, graph_background, config.graph_stacked,
+                                          (ranges) ? yminpoints : null, (ranges) ? ymaxpoints : null);
+
+      foreach (j, colnames.length) {
+        delete[] ypoints[j];
+        delete[] yminpoints[j];
+        delete[] ymaxpoints[j];
+      }
+
+      delete[] ypoints;
+      delete[] yminpoints;
+      delete[] ymaxpoints;
+      delete[] xpoints;
+      delete[] bucket_samples;
+    }
   } else {
     if (!reader.open(filename)) {
       cerr << "ptlstats: Cannot open '", filename, "'", endl, endl;
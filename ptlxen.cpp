@@ -288,6 +288,8 @@ int current_vcpuid() {
   return vcpuid;
 }
 
+int current_lock_owner() { return current_vcpuid(); }
+
 W64 early_boot_log_seqid = 0;
 
 void early_boot_log(const void* data, int length) {
@@ -2560,6 +2562,11 @@ void assist_ptlcall(Context& ctx) {
   ctx.commitarf[REG_rip] = ctx.commitarf[REG_nextrip];
 }
 
+// The emulated vDSO only exists in userspace PTLsim; the decoder never generates this
+void assist_vdso_time(Context& ctx) {
+  assert(false);
+}
+
 void process_native_upcall() {
   //
   // Scan through the contexts and see if any have just executed
@@ -1030,7 +1030,10 @@ struct SequentialCore {
 #endif
   }
 
-#ifdef PTLSIM_HYPERVISOR
+  //
+  // In userspace PTLsim, "interrupts" are guest thread
+  // scheduling events (quantum expiry, futex wakeups):
+  //
   bool handle_interrupt() {
     core_to_external_state(ctx);
 
@@ -1038,7 +1041,9 @@ struct SequentialCore {
       logfile << "Interrupts pending at ", sim_cycle, " cycles, ", total_user_insns_committed, " commits", endl, flush;
       logfile << "Context at interrupt:", endl;
       logfile << ctx;
+#ifdef PTLSIM_HYPERVISOR
       logfile << sshinfo;
+#endif
       logfile.flush();
     }
 
@@ -1047,7 +1052,9 @@ struct SequentialCore {
     if (logable(6)) {
       logfile << "After interrupt redirect:", endl;
       logfile << ctx;
+#ifdef PTLSIM_HYPERVISOR
       logfile << sshinfo;
+#endif
       logfile.flush();
     }
 
@@ -1056,7 +1063,6 @@ struct SequentialCore {
 
     return true;
   }
-#endif
 
   BasicBlock* fetch_or_translate_basic_block(Waddr rip) {
     RIPVirtPhys rvp(rip);
@@ -1070,7 +1076,6 @@ struct SequentialCore {
     } else {
       current_basic_block = bbcache.translate(ctx, rvp);
       assert(current_basic_block);
-      synth_uops_for_bb(*current_basic_block);
 
       if unlikely (config.event_log_enabled) {
         TransOp dummyuop; setzero(dummyuop);
@@ -1087,12 +1092,131 @@ struct SequentialCore {
     return current_basic_block;
   }
 
+#ifndef PTLSIM_HYPERVISOR
+  //
+  // Bulk execution of rep movs and rep stos
+  //
+  // A rep block normally moves one element per pass through the
+  // block, so each element pays for a block fetch, the SMC check
+  // and dispatching every uop. Instead, this moves all elements
+  // that fit within the current page of both the source and the
+  // destination with one copy, then commits the architectural
+  // effects and statistics of those iterations all at once.
+  //
+  // At least one iteration is always left for the caller to run
+  // through the block normally, so the loop exit, the final
+  // register flags and any exception are handled exactly as
+  // before. Anything unusual (transactional execution, logging,
+  // dirty code pages, overlapping or inaccessible buffers) makes
+  // this decline by returning 0 iterations.
+  //
+  static W64 rep_elements_in_page(Waddr addr, int sizeshift, bool backward) {
+    Waddr offset = lowbits(addr, 12);
+    if (backward) return ((offset + (1 << sizeshift)) <= PAGE_SIZE) ? ((offset >> sizeshift) + 1) : 0;
+    return (PAGE_SIZE - offset) >> sizeshift;
+  }
+
+  // Same as the add and sub uops of the given address size
+  static W64 rep_update_reg(W64 r, W64 delta, int addrsizeshift) {
+    switch (addrsizeshift) {
+    case 1: return (r & ~0xffffULL) | lowbits(r + delta, 16);
+    case 2: return LO32(r + delta);
+    default: return r + delta;
+    }
+  }
+
+  W64 execute_rep_bulk(BasicBlock* bb, W64 insnlimit) {
+    if unlikely ((cmtrec != null) | config.event_log_enabled | logable(5)) return 0;
+    if unlikely ((bb->rip.rip == config.stop_at_rip) | (bb->rip.rip == config.start_log_at_rip)) return 0;
+    if unlikely (smc_isdirty(bb->rip.mfnlo) | smc_isdirty(bb->rip.mfnhi)) return 0;
+
+    int sizeshift = bb->repsizeshift;
+    int addrsizeshift = bb->repaddrsizeshift;
+    int addrbits = 8 << addrsizeshift;
+    bool movs = (bb->reptype == REPTYPE_MOVS);
+    bool backward = bb->rip.df;
+
+    W64 count = lowbits(arf[REG_rcx], addrbits);
+    Waddr src = arf[REG_rsi];
+    Waddr dst = arf[REG_rdi];
+
+    // Pointers must not wrap at the address size in mid-span
+    if unlikely ((addrbits < 64) && ((movs & ((src >> addrbits) != 0)) | ((dst >> addrbits) != 0))) return 0;
+
+    W64 n = min(count, insnlimit);
+    if unlikely (n < 2) return 0;
+    n--;
+
+    n = min(n, rep_elements_in_page(dst, sizeshift, backward));
+    if (movs) n = min(n, rep_elements_in_page(src, sizeshift, backward));
+    if unlikely (!n) return 0;
+
+    int bytes = n << sizeshift;
+    W64 delta = (backward) ? -(W64)(bytes - (1 << sizeshift)) : 0;
+    Waddr srclo = src + delta;
+    Waddr dstlo = dst + delta;
+
+    // Stores to the page holding the rep itself must take the normal SMC path
+    if unlikely (((dstlo >> 12) == bb->rip.mfnlo) | ((dstlo >> 12) == bb->rip.mfnhi)) return 0;
+
+    byte buf[PAGE_SIZE];
+
+    if (movs) {
+      Waddr distance = (dstlo > srclo) ? (dstlo - srclo) : (srclo - dstlo);
+      if unlikely (distance < bytes) return 0;
+      if unlikely (ctx.copy_from_user(buf, srclo, bytes) != bytes) return 0;
+    } else {
+      W64 data = arf[REG_rax];
+      switch (sizeshift) {
+      case 0: memset(buf, data, bytes); break;
+      case 1: foreach (i, n) ((W16*)buf)[i] = data; break;
+      case 2: foreach (i, n) ((W32*)buf)[i] = data; break;
+      case 3: foreach (i, n) ((W64*)buf)[i] = data; break;
+      }
+    }
+
+    // Writes within one page either fully succeed or make no changes
+    if unlikely (ctx.copy_to_user(dstlo, buf, bytes) != bytes) return 0;
+
+    W64 increment = (backward) ? -(W64)bytes : bytes;
+    if (movs) arf[REG_rsi] = rep_update_reg(src, increment, addrsizeshift);
+    arf[REG_rdi] = rep_update_reg(dst, increment, addrsizeshift);
+    arf[REG_rcx] = rep_update_reg(arf[REG_rcx], -n, addrsizeshift);
+
+    //
+    // Account for each iteration as if it made one pass through
+    // the block, ending with a taken branch back to the rep.
+    //
+    W64 uops = n * bb->count;
+    bb->hitcount += n;
+    bb->predcount += n;
+    bb->lasttarget = bb->rip.rip;
+    seq_total_basic_blocks += n;
+    total_basic_blocks_committed += n;
+    fetch_user_insns_fetched += n;
+    fetch_uops_fetched += uops;
+    total_uops_committed += uops;
+    seq_total_uops_committed += uops;
+    seq_total_user_insns_committed += n;
+    if likely (!suppress_total_user_insn_count_updates_in_seqcore) total_user_insns_committed += n;
+    stats.summary.insns += n;
+    stats.summary.uops += uops;
+    current_uuid += uops;
+
+    return n;
+  }
+#endif
+
   //
   // Execute one basic block sequentially
   //
 
   int execute(BasicBlock* bb, W64 insnlimit) {
     arf[REG_rip] = bb->rip;
+
+#ifndef PTLSIM_HYPERVISOR
+    if unlikely (bb->reptype != REPTYPE_NONE) insnlimit -= execute_rep_bulk(bb, insnlimit);
+#endif
     
     //
     // Fetch
@@ -1110,7 +1234,7 @@ struct SequentialCore {
       event->bb.bbcount = bb->count;
     }
 
-    if unlikely (!bb->synthops) synth_uops_for_bb(*bb);
+    assert(bb->synthops);
     bb->hitcount++;
 
     TransOpBuffer unaligned_ldst_buf;
@@ -1418,14 +1542,72 @@ struct SequentialCore {
     return (insnlimit < bb->user_insn_count) ? SEQEXEC_EARLY_EXIT : SEQEXEC_OK;
   }
 
+  //
+  // Execute a chain of basic blocks formed into a superblock
+  // (see BasicBlockCache::get_superblock), starting with bb.
+  // Each block after the first only runs if the previous block
+  // actually exited to it; otherwise this returns through a side
+  // exit and the next block is fetched normally. Any result other
+  // than SEQEXEC_OK also ends the superblock, since the block just
+  // executed may have invalidated the others (e.g. SMC).
+  //
+  int execute_superblock(BasicBlock* bb, W64 insnlimit) {
+    SuperBlock* sb = bbcache.get_superblock(ctx, bb);
+
+    if likely (sb->count < 2) return execute(bb, insnlimit);
+
+    sb->hits++;
+    stats.decoder.superblock.entered++;
+
+    foreach (i, sb->count) {
+      BasicBlock* next = sb->bbs[i];
+
+      if likely (i) {
+        RIPVirtPhys rvp(arf[REG_rip]);
+        rvp.update(ctx);
+
+        if unlikely (!(rvp == next->rip)) {
+          sb->side_exits++;
+          stats.decoder.superblock.side_exits++;
+          return SEQEXEC_OK;
+        }
+
+        next->use(sim_cycle);
+      }
+
+      W64 user_insns_at_start = seq_total_user_insns_committed;
+      int result = execute(next, insnlimit);
+      if unlikely (result != SEQEXEC_OK) return result;
+      insnlimit -= (seq_total_user_insns_committed - user_insns_at_start);
+    }
+
+    stats.decoder.superblock.completed++;
+    return SEQEXEC_OK;
+  }
+
   int execute() {
     Waddr rip = arf[REG_rip];
-    
-    current_basic_block = fetch_or_translate_basic_block(rip);
 
     bool exiting = 0;
 
-    int result = execute(current_basic_block, (config.stop_at_user_insns - total_user_insns_committed));
+    W64 insnlimit = (config.stop_at_user_insns - total_user_insns_committed);
+
+    int result;
+
+    {
+      //
+      // We hold no references to the blocks we run, so keep the cache
+      // locked until they finish: no other thread may free them under
+      // us, while our own SMC invalidations still go through.
+      //
+      ScopedLock<RecursiveMutex> scope(bbcache.lock);
+
+      current_basic_block = fetch_or_translate_basic_block(rip);
+
+      result = (config.superblock_threshold && (current_basic_block->hitcount >= config.superblock_threshold))
+        ? execute_superblock(current_basic_block, insnlimit)
+        : execute(current_basic_block, insnlimit);
+    }
     
     switch (result) {
     case SEQEXEC_OK:
@@ -1489,6 +1671,8 @@ struct SequentialCore {
       if likely (trans.ptelo.p) smc_cleardirty(trans.ptelo.mfn);
       if likely (trans.ptehi.p) smc_cleardirty(trans.ptehi.mfn);
       
+      synth_uops_for_bb(trans.bb);
+
       W64 user_insns_at_start = seq_total_user_insns_committed;
       result = execute(&trans.bb, insncount);
       W64 delta_insns = seq_total_user_insns_committed - user_insns_at_start;
@@ -1630,10 +1814,10 @@ struct SequentialMachine: public PTLsimMachine {
           core.external_to_core_state(ctx);
           ctx.dirty = 0;
         }
+#endif
         if unlikely (ctx.check_events()) core.handle_interrupt();
         if unlikely (!ctx.running) continue;
         running_thread_count++;
-#endif
         exiting |= core.execute();
       }
 
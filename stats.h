@@ -140,6 +140,38 @@ struct PTLsimStats { // rootnode:
       W64 invalidates[INVALIDATE_REASON_COUNT]; // label: invalidate_reason_names
     } pagecache;
 
+    // Blocks translated ahead of execution (-translate-ahead)
+    struct translate_ahead {
+      W64 translated;
+      W64 already_cached;
+      W64 invalid_page;
+      W64 dirty_page;
+    } translate_ahead;
+
+    // Superblocks formed along biased edges (-superblock-threshold)
+    struct superblock {
+      W64 formed;
+      W64 blocks;
+      W64 entered;
+      W64 completed;
+      W64 side_exits;
+    } superblock;
+
+#ifdef ENABLE_OPCODE_STATS
+    //
+    // Per-opcode profile (-opcode-stats), indexed by the decoder's
+    // opcode number (see DECODER_OPCODE_COUNT). Use "ptlstats
+    // -collectsum" to merge these histograms across runs.
+    //
+    struct opcodes {
+      W64 insns[DECODER_OPCODE_COUNT]; // histo: 0, DECODER_OPCODE_COUNT-1, 1
+      W64 complex_insns[DECODER_OPCODE_COUNT]; // histo: 0, DECODER_OPCODE_COUNT-1, 1
+      W64 assists[DECODER_OPCODE_COUNT]; // histo: 0, DECODER_OPCODE_COUNT-1, 1
+      W64 uops[DECODER_OPCODE_COUNT]; // histo: 0, DECODER_OPCODE_COUNT-1, 1
+      W64 invalid[DECODER_OPCODE_COUNT]; // histo: 0, DECODER_OPCODE_COUNT-1, 1
+    } opcodes;
+#endif
+
     W64 reclaim_rounds;
   } decoder;
 
@@ -154,6 +186,25 @@ struct PTLsimStats { // rootnode:
     EventsInMode cycles_in_mode;
     EventsInMode insns_in_mode;
     EventsInMode uops_in_mode;
+#else
+    struct threads {
+      W64 created;
+      W64 exited;
+      W64 switches;
+      W64 futex_waits;
+      W64 futex_wakeups;
+      W64 futex_timeouts;
+      W64 sleeps;
+      W64 skipped_cycles;
+    } threads;
+    struct syscalls {
+      W64 calls64[SYSCALL_NAME_COUNT_64BIT]; // label: syscall_names_64bit
+      W64 calls32[SYSCALL_NAME_COUNT_32BIT]; // label: syscall_names_32bit
+      W64 unknown;
+      // Host time spent handling each syscall:
+      W64 host_ns64[SYSCALL_NAME_COUNT_64BIT]; // label: syscall_names_64bit
+      W64 host_ns32[SYSCALL_NAME_COUNT_32BIT]; // label: syscall_names_32bit
+    } syscalls;
 #endif
   } external;
 };
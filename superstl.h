@@ -26,6 +26,8 @@
 #define FMT_LARGE	  64 /* use 'ABCDEF' instead of 'abcdef' */
 
 int current_vcpuid();
+// Identifies the host thread (userspace) or VCPU (hypervisor) holding a lock:
+int current_lock_owner();
 
 extern bool force_synchronous_streams;
 
@@ -989,6 +991,8 @@ namespace superstl {
       this->next = root;
       if likely (root) root->prev = this;
       // Do not touch root->next since it might not even exist
+      // Link in only after this->next is set, for lock-free readers
+      barrier();
       root = this;
     }
 
@@ -3712,32 +3716,32 @@ namespace superstl {
   //
   // Mutex with recursive locking
   //
-  // acquire(vcpuid) can be called multiple times
-  // with the same vcpuid, but if the vcpuid
-  // does not match locking_vcpuid, the function
-  // spins until the lock can be acquired.
+  // acquire() can be called multiple times by the
+  // same owner (see current_lock_owner()), but if
+  // the owner does not match locking_owner, the
+  // function spins until the lock can be acquired.
   //
-  // release(vcpuid) unlocks the mutex. The current
-  // vcpuid must equal locking_vcpu.
+  // release() unlocks the mutex. The current owner
+  // must equal locking_owner.
   //
   struct RecursiveMutex {
-    W16s locking_vcpuid;
-    W16 counter;
+    W32s locking_owner;
+    W32 counter;
 
     RecursiveMutex() { reset(); }
 
     void reset() {
-      locking_vcpuid = -1;
+      locking_owner = -1;
       counter = 0;
     }
 
     bool acquire() {
-      W16s current = current_vcpuid();
+      W32s current = current_lock_owner();
       bool acquired;
       bool recursive;
 
       for (;;) {
-        W16s oldv = cmpxchg(locking_vcpuid, current, W16s(-1));
+        W32s oldv = cmpxchg(locking_owner, current, W32s(-1));
         barrier();
         acquired = (oldv == -1);
         recursive = (oldv == current);
@@ -3753,13 +3757,13 @@ namespace superstl {
     }
 
     void release() {
-      W16s current = current_vcpuid();
-      assert(locking_vcpuid == current);
+      W32s current = current_lock_owner();
+      assert(locking_owner == current);
       assert(counter > 0);
 
       counter--;
       if likely (!counter) {
-        locking_vcpuid = -1;
+        locking_owner = -1;
         barrier();
       }
     }
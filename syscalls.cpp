@@ -52,14 +52,21 @@ declare_syscall0(__NR_munlockall, int, sys_munlockall);
 
 declare_syscall3(__NR_open, int, sys_open, const char*, pathname, int, flags, int, mode);
 declare_syscall1(__NR_close, int, sys_close, int, fd);
+declare_syscall2(__NR_fstat, int, sys_fstat, int, fd, struct stat*, buf);
 declare_syscall3(__NR_read, ssize_t, sys_read, int, fd, void*, buf, size_t, count);
 declare_syscall3(__NR_write, ssize_t, sys_write, int, fd, const void*, buf, size_t, count);
+declare_syscall6(__NR_process_vm_readv, ssize_t, sys_process_vm_readv, pid_t, pid, const void*, local_iov, unsigned long, liovcnt, const void*, remote_iov, unsigned long, riovcnt, unsigned long, flags);
+declare_syscall6(__NR_process_vm_writev, ssize_t, sys_process_vm_writev, pid_t, pid, const void*, local_iov, unsigned long, liovcnt, const void*, remote_iov, unsigned long, riovcnt, unsigned long, flags);
 declare_syscall1(__NR_unlink, int, sys_unlink, const char*, pathname);
 declare_syscall2(__NR_rename, int, sys_rename, const char*, oldpath, const char*, newpath);
+declare_syscall3(__NR_ioctl, int, sys_ioctl, int, fd, unsigned long, request, unsigned long, arg);
+declare_syscall3(__NR_fcntl, int, sys_fcntl, int, fd, int, cmd, unsigned long, arg);
+declare_syscall5(__NR_perf_event_open, int, sys_perf_event_open, const void*, attr, pid_t, pid, int, cpu, int, group_fd, unsigned long, flags);
 
 declare_syscall1(__NR_exit, void, sys_exit, int, code);
 declare_syscall1(__NR_brk, void*, sys_brk, void*, p);
 declare_syscall0(__NR_fork, pid_t, sys_fork);
+declare_syscall2(__NR_clone, pid_t, sys_clone, unsigned long, flags, void*, newsp);
 declare_syscall3(__NR_execve, int, sys_execve, const char*, filename, const char**, argv, const char**, envp);
 
 declare_syscall0(__NR_getpid, pid_t, sys_getpid);
@@ -77,6 +84,7 @@ declare_syscall2(__NR_getrlimit, int, sys_getrlimit, int, resource, struct rlimi
 declare_syscall2(__NR_nanosleep, int, do_nanosleep, const timespec*, req, timespec*, rem);
 
 declare_syscall2(__NR_gettimeofday, int, sys_gettimeofday, struct timeval*, tv, struct timezone*, tz);
+declare_syscall2(__NR_clock_gettime, int, sys_clock_gettime, int, clock, struct timespec*, ts);
 declare_syscall1(__NR_time, time_t, sys_time, time_t*, t);
 
 W64 sys_nanosleep(W64 nsec) {
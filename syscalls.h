@@ -18,8 +18,12 @@ extern "C" {
   ssize_t sys_write(int fd, const void* buf, size_t count);
   ssize_t sys_fdatasync(int fd);
   W64 sys_seek(int fd, W64 offset, unsigned int origin);
+  struct stat;
+  int sys_fstat(int fd, struct stat* buf);
   int sys_unlink(const char* pathname);
   int sys_rename(const char* oldpath, const char* newpath);
+  int sys_ioctl(int fd, unsigned long request, unsigned long arg);
+  int sys_fcntl(int fd, int cmd, unsigned long arg);
   
   void* sys_mmap(void* start, size_t length, int prot, int flags, int fd, W64 offset);
   int sys_munmap(void * start, size_t length);
@@ -32,6 +36,7 @@ extern "C" {
   int sys_munlockall(void);
   
   pid_t sys_fork();
+  pid_t sys_clone(unsigned long flags, void* newsp);
   int sys_execve(const char* filename, const char** argv, const char** envp);
   
   pid_t sys_gettid();
@@ -51,9 +56,17 @@ extern "C" {
   int sys_sigaction(int signum, const struct sigaction *act, struct sigaction *oldact);
 
   int sys_gettimeofday(struct timeval* tv, struct timezone* tz);
+  int sys_clock_gettime(int clock, struct timespec* ts);
   time_t sys_time(time_t* t);
   pid_t sys_wait4(pid_t pid, int *status, int options, struct rusage *rusage);
 
+  // The iov arguments are arrays of struct iovec:
+  ssize_t sys_process_vm_readv(pid_t pid, const void* local_iov, unsigned long liovcnt, const void* remote_iov, unsigned long riovcnt, unsigned long flags);
+  ssize_t sys_process_vm_writev(pid_t pid, const void* local_iov, unsigned long liovcnt, const void* remote_iov, unsigned long riovcnt, unsigned long flags);
+
+  // attr is a struct perf_event_attr:
+  int sys_perf_event_open(const void* attr, pid_t pid, int cpu, int group_fd, unsigned long flags);
+
   typedef void (*kernel_sighandler_t)(int signo, siginfo_t *si, void *context);
 
   // From glibc sysdeps/unix/sysv/linux/kernel_sigaction.h for kernels >= 2.2.x:
@@ -374,6 +387,10 @@ extern "C" {
 #define __NR_inotify_rm_watch	255
 #define __NR_syscall_max __NR_inotify_rm_watch
 
+#define __NR_perf_event_open	298
+#define __NR_process_vm_readv	310
+#define __NR_process_vm_writev	311
+
 #else
 
 //
@@ -703,6 +720,10 @@ extern "C" {
 #define __NR_inotify_add_watch	292
 #define __NR_inotify_rm_watch	293
 
+#define __NR_perf_event_open	336
+#define __NR_process_vm_readv	347
+#define __NR_process_vm_writev	348
+
 #define NR_syscalls 294
 
 #endif
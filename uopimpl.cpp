@@ -1369,15 +1369,14 @@ void name(IssueState& state, W64 ra, W64 rb, W64 rc, W16 raflags, W16 rbflags, W
   W64 rd; \
   vec16b va = buildvec(rb, ra); \
   vec16b vb = buildvec(0, 0); \
-  logfile << "va = ", va, ", vb = ", vb, endl; \
   if ((size == 0) & bit(sizemask, 0)) asm(#opcode0 " " extra "%[vb],%[va]; movq %[va],%[rd];" \
      : [rd] "=" W64_CONSTRAINT (rd), [va] "+x" (va), [vb] "+x" (vb)); \
   if ((size == 1) & bit(sizemask, 1)) asm(#opcode1 " " extra "%[vb],%[va]; movq %[va],%[rd];" \
-     : [rd] "=" W64_CONSTRAINT (rd), [va] "=x" (va), [vb] "=x" (vb)); \
+     : [rd] "=" W64_CONSTRAINT (rd), [va] "+x" (va), [vb] "+x" (vb)); \
   if ((size == 2) & bit(sizemask, 2)) asm(#opcode2 " " extra "%[vb],%[va]; movq %[va],%[rd];" \
-     : [rd] "=" W64_CONSTRAINT (rd), [va] "=x" (va), [vb] "=x" (vb)); \
+     : [rd] "=" W64_CONSTRAINT (rd), [va] "+x" (va), [vb] "+x" (vb)); \
   if ((size == 3) & bit(sizemask, 3)) asm(#opcode3 " " extra "%[vb],%[va]; movq %[va],%[rd];" \
-     : [rd] "=" W64_CONSTRAINT (rd), [va] "=x" (va), [vb] "=x" (vb)); \
+     : [rd] "=" W64_CONSTRAINT (rd), [va] "+x" (va), [vb] "+x" (vb)); \
   state.reg.rddata = rd; \
   state.reg.rdflags = 0; \
   capture_uop_context(state, ra, rb, rc, raflags, rbflags, rcflags, ptlopcode, size); \
@@ -1507,6 +1506,161 @@ uopimpl_func_t implmap_vcmp[16][4] = {
 };
 
 #undef makecond
+
+//
+// Host SIMD implementations
+//
+// These replace the per-lane scalar loops in the reference
+// implementations of permb, vbt and vcmp above with a few
+// host SSE instructions, and give bit-identical results.
+//
+// Every host PTLsim runs on has SSE2, which the packed uops
+// above already assume; versions that need a later SSE level
+// are only selected by get_synthcode_for_uop() if init_uops()
+// finds that level in the host CPUID.
+//
+static bool host_has_ssse3 = 0;
+static bool host_has_sse42 = 0;
+
+static inline vec16b lo64_to_vec(W64 v) {
+  vec16b r;
+  asm(MOV_TO_XMM " %[v],%[r]" : [r] "=x" (r) : [v] W64_CONSTRAINT (v));
+  return r;
+}
+
+static inline W64 vec_to_lo64(vec16b r) {
+  W64 v;
+  asm("movq %[r],%[v]" : [v] "=" W64_CONSTRAINT (v) : [r] "x" (r));
+  return v;
+}
+
+void uop_impl_permb_ssse3(IssueState& state, W64 ra, W64 rb, W64 rc, W16 raflags, W16 rbflags, W16 rcflags) {
+  // Spread the eight 4-bit selectors in rc out into the low nibble of each byte
+  W64 sel = LO32(rc);
+  sel = (sel | (sel << 16)) & 0x0000ffff0000ffffULL;
+  sel = (sel | (sel << 8)) & 0x00ff00ff00ff00ffULL;
+  sel = (sel | (sel << 4)) & 0x0f0f0f0f0f0f0f0fULL;
+
+  vec16b ab = buildvec(rb, ra);
+  asm("pshufb %[ctl],%[ab]" : [ab] "+x" (ab) : [ctl] "x" (lo64_to_vec(sel)));
+  W64 rd = vec_to_lo64(ab);
+
+  state.reg.rddata = rd;
+  state.reg.rdflags = x86_genflags<W64>(rd);
+
+  capture_uop_context(state, ra, rb, rc, raflags, rbflags, rcflags, OP_permb, 0);
+}
+
+//
+// Shift the selected bit of each lane up into the lane's sign
+// bit, then gather the sign bits with pmovmsk. The upper 64 bits
+// of the vector are zero, so they contribute only zero bits.
+//
+template <int sizeshift>
+void uop_impl_vbt_sse2(IssueState& state, W64 ra, W64 rb, W64 rc, W16 raflags, W16 rbflags, W16 rcflags) {
+  int sizebits = (1 << sizeshift) * 8;
+
+  vec16b v = lo64_to_vec(ra);
+  vec16b count = lo64_to_vec((sizebits - 1) - lowbits(rb, 3 + sizeshift));
+  W32 rd;
+
+  switch (sizeshift) {
+  case 0:
+    asm("psllw %[count],%[v]; pmovmskb %[v],%[rd]" : [rd] "=r" (rd), [v] "+x" (v) : [count] "x" (count)); break;
+  case 1:
+    asm("psllw %[count],%[v]; packsswb %[v],%[v]; pmovmskb %[v],%[rd]" : [rd] "=r" (rd), [v] "+x" (v) : [count] "x" (count));
+    rd &= 0xf; break;
+  case 2:
+    asm("pslld %[count],%[v]; movmskps %[v],%[rd]" : [rd] "=r" (rd), [v] "+x" (v) : [count] "x" (count)); break;
+  case 3:
+    asm("psllq %[count],%[v]; movmskpd %[v],%[rd]" : [rd] "=r" (rd), [v] "+x" (v) : [count] "x" (count)); break;
+  }
+
+  state.reg.rddata = rd;
+  state.reg.rdflags = x86_genflags<W64>(rd);
+}
+
+uopimpl_func_t implmap_vbt_sse2[4] = {&uop_impl_vbt_sse2<0>, &uop_impl_vbt_sse2<1>, &uop_impl_vbt_sse2<2>, &uop_impl_vbt_sse2<3>};
+
+#define make_sse_vec_primitive(name, opcode0, opcode1, opcode2, opcode3) \
+template <int sizeshift> \
+static inline vec16b name(vec16b a, vec16b b) { \
+  switch (sizeshift) { \
+  case 0: asm(#opcode0 " %[b],%[a]" : [a] "+x" (a) : [b] "x" (b)); break; \
+  case 1: asm(#opcode1 " %[b],%[a]" : [a] "+x" (a) : [b] "x" (b)); break; \
+  case 2: asm(#opcode2 " %[b],%[a]" : [a] "+x" (a) : [b] "x" (b)); break; \
+  case 3: asm(#opcode3 " %[b],%[a]" : [a] "+x" (a) : [b] "x" (b)); break; \
+  } \
+  return a; \
+}
+
+// pcmpeqq is SSE4.1 and pcmpgtq is SSE4.2
+make_sse_vec_primitive(sse_vec_eq,  pcmpeqb, pcmpeqw, pcmpeqd, pcmpeqq);
+make_sse_vec_primitive(sse_vec_gt,  pcmpgtb, pcmpgtw, pcmpgtd, pcmpgtq);
+make_sse_vec_primitive(sse_vec_sub, psubb,   psubw,   psubd,   psubq);
+
+static const W64 vec_lane_sign_bits[4] = {
+  0x8080808080808080ULL,
+  0x8000800080008000ULL,
+  0x8000000080000000ULL,
+  0x8000000000000000ULL
+};
+
+//
+// Only the conditions that map onto signed compares are
+// implemented here: unsigned compares flip the sign bits
+// first, and "s" tests the sign of the lane difference.
+// Each odd condition is the inverse of the even one below it.
+//
+template <int sizeshift, int cond>
+void uop_impl_vcmp_sse(IssueState& state, W64 ra, W64 rb, W64 rc, W16 raflags, W16 rbflags, W16 rcflags) {
+  vec16b a = lo64_to_vec(ra);
+  vec16b b = lo64_to_vec(rb);
+  vec16b bias = lo64_to_vec(vec_lane_sign_bits[sizeshift]);
+  vec16b d;
+
+  switch (cond & ~1) {
+  case COND_c:  d = sse_vec_gt<sizeshift>(b ^ bias, a ^ bias); break;
+  case COND_e:  d = sse_vec_eq<sizeshift>(a, b); break;
+  case COND_be: d = ~sse_vec_gt<sizeshift>(a ^ bias, b ^ bias); break;
+  case COND_s:  d = sse_vec_gt<sizeshift>(x86_sse_zerob(), sse_vec_sub<sizeshift>(a, b)); break;
+  case COND_l:  d = sse_vec_gt<sizeshift>(b, a); break;
+  case COND_le: d = ~sse_vec_gt<sizeshift>(a, b); break;
+  default: assert(false);
+  }
+
+  if (cond & 1) d = ~d;
+
+  W64 rd = vec_to_lo64(d);
+
+  state.reg.rddata = rd;
+  state.reg.rdflags = x86_genflags<W64>(rd);
+}
+
+#define makecond(c) {&uop_impl_vcmp_sse<0, c>, &uop_impl_vcmp_sse<1, c>, &uop_impl_vcmp_sse<2, c>, &uop_impl_vcmp_sse<3, c>}
+#define nocond {null, null, null, null}
+
+uopimpl_func_t implmap_vcmp_sse[16][4] = {
+  nocond,         // o
+  nocond,         // no
+  makecond(2),    // c
+  makecond(3),    // nc
+  makecond(4),    // e
+  makecond(5),    // ne
+  makecond(6),    // be
+  makecond(7),    // nbe
+  makecond(8),    // s
+  makecond(9),    // ns
+  nocond,         // p
+  nocond,         // np
+  makecond(12),   // l
+  makecond(13),   // nl
+  makecond(14),   // le
+  makecond(15)    // nle
+};
+
+#undef makecond
+#undef nocond
 #undef sizes
 
 uopimpl_func_t get_synthcode_for_uop(int op, int size, bool setflags, int cond, int extshift, bool except, bool internal) {
@@ -1651,7 +1805,7 @@ uopimpl_func_t get_synthcode_for_uop(int op, int size, bool setflags, int cond,
     func = implmap_clz[size][setflags]; break;
     // case OP_ctpop:
   case OP_permb:
-    func = uop_impl_permb; break;
+    func = (host_has_ssse3) ? uop_impl_permb_ssse3 : uop_impl_permb; break;
 
   case OP_div:
     func = implmap_div[size]; break;
@@ -1754,13 +1908,15 @@ uopimpl_func_t get_synthcode_for_uop(int op, int size, bool setflags, int cond,
   case OP_vshr:
     func = implmap_vshr[size]; break;
   case OP_vbt:
-    func = implmap_vbt[size]; break;
+    func = implmap_vbt_sse2[size]; break;
   case OP_vsar:
     func = implmap_vsar[size]; break;
   case OP_vavg:
     func = implmap_vavg[size]; break;
   case OP_vcmp:
-    func = implmap_vcmp[cond][size]; break;
+    func = implmap_vcmp[cond][size];
+    if (implmap_vcmp_sse[cond][size] && ((size < 3) | host_has_sse42)) func = implmap_vcmp_sse[cond][size];
+    break;
   case OP_vmin:
     func = implmap_vmin[size]; break;
   case OP_vmax:
@@ -1790,13 +1946,29 @@ uopimpl_func_t get_synthcode_for_uop(int op, int size, bool setflags, int cond,
   return func;
 }
 
+static inline uopimpl_func_t get_synthcode_for_transop(const TransOp& transop) {
+  return get_synthcode_for_uop(transop.opcode, transop.size, transop.setflags, transop.cond, transop.extshift, 0, transop.internal);
+}
+
+//
+// Bind synthops for a block that was not allocated by
+// BasicBlock::clone() (e.g. a temporary block on the stack);
+// the caller must delete[] bb.synthops when done with it.
+//
 void synth_uops_for_bb(BasicBlock& bb) {
   bb.synthops = new uopimpl_func_t[bb.count];
-  foreach (i, bb.count) {
-    const TransOp& transop = bb.transops[i];
-    uopimpl_func_t func = get_synthcode_for_uop(transop.opcode, transop.size, transop.setflags, transop.cond, transop.extshift, 0, transop.internal);
-    bb.synthops[i] = func;
-  }
+  foreach (i, bb.count) bb.synthops[i] = get_synthcode_for_transop(bb.transops[i]);
+}
+
+//
+// Bind synthops for a block allocated by BasicBlock::clone(),
+// into the space reserved for them right after the transops.
+// BasicBlockCache::translate() does this once for every block
+// it caches, so neither core ever looks up a synthop at runtime.
+//
+void BasicBlock::bind_synthops() {
+  synthops = (uopimpl_func_t*)&transops[count];
+  foreach (i, count) synthops[i] = get_synthcode_for_transop(transops[i]);
 }
 
 uopimpl_func_t get_synthcode_for_cond_branch(int opcode, int cond, int size, bool except) {
@@ -1819,6 +1991,10 @@ uopimpl_func_t get_synthcode_for_cond_branch(int opcode, int cond, int size, boo
 }
 
 void init_uops() {
+  W32 eax, ebx, ecx, edx;
+  cpuid(1, eax, ebx, ecx, edx);
+  host_has_ssse3 = bit(ecx, 9);
+  host_has_sse42 = bit(ecx, 20);
 }
 
 void shutdown_uops() {